@@ -0,0 +1,244 @@
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+/*
+ * Pinning worker threads to CPUs.
+ *
+ * affinity_init builds the ordered list of CPUs to use; affinity_pin(slot)
+ * then pins the calling thread to the slot-th of them (wrapping around).
+ * Give consecutive slots to threads that work on neighbouring parts of the
+ * map, and have every thread touch the memory it owns first, so its pages
+ * are placed on its own NUMA node.
+ *
+ * The list comes from the FRAC_CPUS environment variable if it is set, as
+ * a list like "0-3,8-11". Otherwise FRAC_AFFINITY picks a policy over the
+ * CPUs the process is allowed to run on, using the topology in sysfs:
+ *
+ *   compact  fill one NUMA node before the next, and every core of a node
+ *            before its second hardware thread
+ *   scatter  alternate between NUMA nodes, cores before hardware threads
+ *   none     leave placement to the scheduler (the default)
+ *
+ * Needs _GNU_SOURCE defined before the first system header.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define AFFINITY_MAX_CPUS 1024
+
+typedef struct {
+    int cpu, node, smt, package, core;
+    int rank;   // position of the cpu within its node
+} affinity_cpu_t;
+
+static int affinity_cpus[AFFINITY_MAX_CPUS];
+static int affinity_nodes[AFFINITY_MAX_CPUS];
+static int affinity_count;
+static int affinity_scatter;
+
+static int affinity_read_int(const char *fmt, int a, int b, int fallback) {
+    char path[128];
+    FILE *f;
+    int v;
+
+    snprintf(path, sizeof(path), fmt, a, b);
+    f = fopen(path, "r");
+    if (!f)
+        return fallback;
+    if (fscanf(f, "%d", &v) != 1)
+        v = fallback;
+    fclose(f);
+
+    return v;
+}
+
+/*
+ * Parses a cpu list ("0-3,8,10-11") into cpus. Returns the number of
+ * cpus, or -1 if the list is malformed.
+ */
+static int affinity_parse_list(const char *list, int *cpus, int max) {
+    const char *c = list;
+    char *end;
+    int n = 0, lo, hi;
+
+    while (*c) {
+        lo = strtol(c, &end, 10);
+        if (end == c || lo < 0)
+            return -1;
+        hi = lo;
+        c = end;
+        if (*c == '-') {
+            hi = strtol(c + 1, &end, 10);
+            if (end == c + 1 || hi < lo)
+                return -1;
+            c = end;
+        }
+        for (; lo <= hi && n < max; lo++)
+            cpus[n++] = lo;
+        if (*c == ',')
+            c++;
+        else if (*c && *c != '\n')
+            return -1;
+        else if (*c)
+            c++;
+    }
+
+    return n;
+}
+
+// NUMA node of cpu, from the node directories' cpu lists
+static int affinity_node_of(int cpu) {
+    char path[64], line[4096];
+    int cpus[AFFINITY_MAX_CPUS];
+    FILE *f;
+    int node, n, i;
+
+    for (node = 0; node < AFFINITY_MAX_CPUS; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        f = fopen(path, "r");
+        if (!f)
+            return 0;
+        if (!fgets(line, sizeof(line), f))
+            line[0] = '\0';
+        fclose(f);
+
+        n = affinity_parse_list(line, cpus, AFFINITY_MAX_CPUS);
+        for (i = 0; i < n; i++)
+            if (cpus[i] == cpu)
+                return node;
+    }
+
+    return 0;
+}
+
+static int affinity_cmp(const void *a, const void *b) {
+    const affinity_cpu_t *x = (const affinity_cpu_t *) a;
+    const affinity_cpu_t *y = (const affinity_cpu_t *) b;
+
+    if (affinity_scatter) {
+        if (x->smt != y->smt)
+            return x->smt - y->smt;
+        if (x->rank != y->rank)
+            return x->rank - y->rank;
+        return x->node - y->node;
+    }
+
+    if (x->node != y->node)
+        return x->node - y->node;
+    if (x->smt != y->smt)
+        return x->smt - y->smt;
+    if (x->package != y->package)
+        return x->package - y->package;
+    if (x->core != y->core)
+        return x->core - y->core;
+    return x->cpu - y->cpu;
+}
+
+/*
+ * Builds the cpu list as configured and prints it after tag. Pinning is
+ * off if nothing was configured or the configuration is unusable.
+ */
+static void affinity_init(const char *tag) {
+    affinity_cpu_t info[AFFINITY_MAX_CPUS];
+    cpu_set_t allowed;
+    const char *env;
+    int i, j, n, first, nodes;
+
+    affinity_count = 0;
+
+    env = getenv("FRAC_CPUS");
+    if (env) {
+        n = affinity_parse_list(env, affinity_cpus, AFFINITY_MAX_CPUS);
+        if (n <= 0) {
+            fprintf(stderr, "%s Bad FRAC_CPUS '%s', not pinning\n", tag, env);
+            return;
+        }
+        affinity_count = n;
+        for (i = 0; i < n; i++)
+            affinity_nodes[i] = affinity_node_of(affinity_cpus[i]);
+    } else {
+        env = getenv("FRAC_AFFINITY");
+        if (!env || !strcmp(env, "none"))
+            return;
+        if (!strcmp(env, "scatter")) {
+            affinity_scatter = 1;
+        } else if (strcmp(env, "compact")) {
+            fprintf(stderr, "%s Bad FRAC_AFFINITY '%s', not pinning\n", tag, env);
+            return;
+        }
+
+        if (sched_getaffinity(0, sizeof(allowed), &allowed))
+            return;
+
+        n = 0;
+        for (i = 0; i < CPU_SETSIZE && n < AFFINITY_MAX_CPUS; i++) {
+            if (!CPU_ISSET(i, &allowed))
+                continue;
+            info[n].cpu = i;
+            info[n].node = affinity_node_of(i);
+            info[n].package = affinity_read_int(
+                "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", i, 0, 0);
+            info[n].core = affinity_read_int(
+                "/sys/devices/system/cpu/cpu%d/topology/core_id", i, 0, i);
+            n++;
+        }
+
+        // Hardware threads of a core after the first are ranked behind all
+        // first threads; ranks within a node interleave nodes for scatter
+        for (i = 0; i < n; i++) {
+            info[i].smt = 0;
+            info[i].rank = 0;
+            for (j = 0; j < i; j++) {
+                if (info[j].node != info[i].node)
+                    continue;
+                if (info[j].package == info[i].package && info[j].core == info[i].core)
+                    info[i].smt++;
+                else
+                    info[i].rank++;
+            }
+        }
+
+        qsort(info, n, sizeof(affinity_cpu_t), affinity_cmp);
+        for (i = 0; i < n; i++) {
+            affinity_cpus[i] = info[i].cpu;
+            affinity_nodes[i] = info[i].node;
+        }
+        affinity_count = n;
+    }
+
+    nodes = 0;
+    for (i = 0; i < affinity_count; i++)
+        if (affinity_nodes[i] + 1 > nodes)
+            nodes = affinity_nodes[i] + 1;
+
+    printf("%s Pinning threads to cpus", tag);
+    first = 1;
+    for (i = 0; i < affinity_count && i < 64; i++) {
+        printf("%s%d", first ? " " : ",", affinity_cpus[i]);
+        first = 0;
+    }
+    printf("%s on %d node%s\n", affinity_count > 64 ? ",..." : "", nodes, nodes == 1 ? "" : "s");
+}
+
+// Pins the calling thread to slot (modulo the list). Does nothing when
+// pinning is off.
+static void affinity_pin(int slot) {
+    cpu_set_t set;
+    int status;
+
+    if (!affinity_count)
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(affinity_cpus[slot % affinity_count], &set);
+    status = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (status)
+        fprintf(stderr, "pthread_setaffinity_np(cpu %d): %s\n",
+            affinity_cpus[slot % affinity_count], strerror(status));
+}
+
+#endif
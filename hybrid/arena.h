@@ -0,0 +1,164 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+/*
+ * Tile buffers that live across maps.
+ *
+ * Every worker sends its finished tile to the master as heights and
+ * pixels. The master has a pair of buffers for every worker, so it can
+ * start all the receives at once and take each tile as it arrives
+ * (arena_start, arena_waitany or arena_testany), whatever order the
+ * workers finish in, or move one tile at a time (arena_transfer). A worker
+ * that shares the master's map only sends its pixels (arena_start_pixels).
+ * The tile size only depends on the number of ranks, so the buffers are
+ * mapped once, on the first map, and bound to persistent requests
+ * (MPI_Send_init / MPI_Recv_init): a worker's send to the master, or the
+ * master's receive from each worker.
+ * Later maps start the transfers with no allocation, no request setup, and
+ * no clearing, since every cell is written before it is sent. The buffers
+ * stay at the same address for the whole run, so an interconnect that
+ * registers memory only does it once.
+ */
+
+#include <stdlib.h>
+#include <mpi.h>
+#include "hugemem.h"
+
+#define ARENA_PENDING (-2)
+
+typedef struct {
+    int w, h;
+    int *heights;
+    unsigned *pixels;
+    int nranks;
+    int slots;               // tiles the buffers hold: one per rank on the master
+    MPI_Request *requests;   // heights and pixels, per peer rank
+    int *pending;            // requests of each peer's tile still in flight
+} arena_t;
+
+static void arena_free(arena_t *a) {
+    int r;
+
+    if (!a->heights)
+        return;
+
+    for (r = 0; r < 2 * a->nranks; r++)
+        if (a->requests[r] != MPI_REQUEST_NULL)
+            MPI_Request_free(&a->requests[r]);
+    free(a->requests);
+    free(a->pending);
+    huge_free(a->heights, (size_t)a->w * a->h * a->slots * sizeof(int));
+    huge_free(a->pixels, (size_t)a->w * a->h * a->slots * sizeof(unsigned));
+    a->heights = NULL;
+}
+
+/*
+ * Maps the buffers for w x h tiles and binds the requests of rank myid:
+ * receives from every other rank on the master, a send to the master on
+ * the workers. Does nothing if the arena is already set up for that size.
+ */
+static void arena_init(arena_t *a, int w, int h, int myid, int master, int nranks,
+        int heights_tag, int pixels_tag) {
+    size_t cells = (size_t)w * h;
+    int r;
+
+    if (a->heights && a->w == w && a->h == h)
+        return;
+    arena_free(a);
+
+    a->w = w;
+    a->h = h;
+    a->nranks = nranks;
+    a->slots = myid == master ? nranks : 1;
+    a->heights = (int *) huge_alloc(cells * a->slots * sizeof(int));
+    a->pixels = (unsigned *) huge_alloc(cells * a->slots * sizeof(unsigned));
+    a->requests = (MPI_Request *) malloc(2 * nranks * sizeof(MPI_Request));
+    a->pending = (int *) calloc(nranks, sizeof(int));
+    if (!a->requests || !a->pending) {
+        perror("arena requests");
+        exit(1);
+    }
+
+    for (r = 0; r < nranks; r++) {
+        a->requests[2 * r] = MPI_REQUEST_NULL;
+        a->requests[2 * r + 1] = MPI_REQUEST_NULL;
+
+        if (myid == master && r != master) {
+            MPI_Recv_init(a->heights + r * cells, cells, MPI_INT, r, heights_tag, MPI_COMM_WORLD, &a->requests[2 * r]);
+            MPI_Recv_init(a->pixels + r * cells, cells, MPI_UNSIGNED, r, pixels_tag, MPI_COMM_WORLD, &a->requests[2 * r + 1]);
+        } else if (myid != master && r == master) {
+            MPI_Send_init(a->heights, cells, MPI_INT, r, heights_tag, MPI_COMM_WORLD, &a->requests[2 * r]);
+            MPI_Send_init(a->pixels, cells, MPI_UNSIGNED, r, pixels_tag, MPI_COMM_WORLD, &a->requests[2 * r + 1]);
+        }
+    }
+}
+
+// The buffers of the tile moved between this rank and rank peer
+static int *arena_heights(arena_t *a, int peer) {
+    return a->heights + (size_t)(a->slots > 1 ? peer : 0) * a->w * a->h;
+}
+
+static unsigned *arena_pixels(arena_t *a, int peer) {
+    return a->pixels + (size_t)(a->slots > 1 ? peer : 0) * a->w * a->h;
+}
+
+// Starts moving the tile between this rank and rank peer
+static void arena_start(arena_t *a, int peer) {
+    MPI_Startall(2, &a->requests[2 * peer]);
+    a->pending[peer] = 2;
+}
+
+// Starts moving only the pixels of the tile, for a peer on the master's
+// node whose heights are already in a shared map
+static inline void arena_start_pixels(arena_t *a, int peer) {
+    MPI_Start(&a->requests[2 * peer + 1]);
+    a->pending[peer] = 1;
+}
+
+// Waits for any started tile to arrive in full and returns its peer, or -1
+// when none is left in flight
+static inline int arena_waitany(arena_t *a) {
+    int index;
+
+    while (1) {
+        MPI_Waitany(2 * a->nranks, a->requests, &index, MPI_STATUS_IGNORE);
+        if (index == MPI_UNDEFINED)
+            return -1;
+        if (--a->pending[index / 2] == 0)
+            return index / 2;
+    }
+}
+
+// Like arena_waitany without waiting: returns the peer of a tile that
+// arrived in full, -1 when none is left in flight, or ARENA_PENDING if
+// tiles are still on the way
+static inline int arena_testany(arena_t *a) {
+    int index, flag;
+
+    while (1) {
+        MPI_Testany(2 * a->nranks, a->requests, &index, &flag, MPI_STATUS_IGNORE);
+        if (!flag)
+            return ARENA_PENDING;
+        if (index == MPI_UNDEFINED)
+            return -1;
+        if (--a->pending[index / 2] == 0)
+            return index / 2;
+    }
+}
+
+// Moves the tile between this rank and rank peer, and waits for it
+static void arena_transfer(arena_t *a, int peer) {
+    arena_start(a, peer);
+    MPI_Waitall(2, &a->requests[2 * peer], MPI_STATUSES_IGNORE);
+    a->pending[peer] = 0;
+}
+
+// Moves only the pixels of the tile (see arena_start_pixels), and waits
+// for them
+static inline void arena_transfer_pixels(arena_t *a, int peer) {
+    arena_start_pixels(a, peer);
+    MPI_Wait(&a->requests[2 * peer + 1], MPI_STATUS_IGNORE);
+    a->pending[peer] = 0;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef __CANCEL_H__
+#define __CANCEL_H__
+
+/*
+ * Cancelling the map being made.
+ *
+ * A token counts the maps asked of whatever makes them. The maker notes
+ * the number of the map it starts on with cancel_begin and calls
+ * cancel_check with it between levels and tiles; once a newer map has been
+ * asked for (cancel_supersede) or the program is stopping (cancel_stop),
+ * the check returns nonzero and the maker drops its map where it is,
+ * half made, so its cores go to the next one. A check is two relaxed
+ * loads, cheap enough for every tile. Makers that are several threads must
+ * agree on the answer before acting on it, since they share barriers.
+ */
+
+typedef struct {
+    unsigned gen;   // maps asked for
+    int stop;
+} cancel_t;
+
+// The number of the latest map asked for, to start on
+static inline unsigned cancel_begin(cancel_t *c) {
+    return __atomic_load_n(&c->gen, __ATOMIC_ACQUIRE);
+}
+
+// Asks for a new map, which cancels the one being made. Returns its number.
+static inline unsigned cancel_supersede(cancel_t *c) {
+    return __atomic_add_fetch(&c->gen, 1, __ATOMIC_ACQ_REL);
+}
+
+// Cancels the map being made and every later one
+static inline void cancel_stop(cancel_t *c) {
+    __atomic_store_n(&c->stop, 1, __ATOMIC_RELEASE);
+}
+
+// Whether map gen should be dropped
+static inline int cancel_check(cancel_t *c, unsigned gen) {
+    return __atomic_load_n(&c->stop, __ATOMIC_RELAXED)
+        || __atomic_load_n(&c->gen, __ATOMIC_RELAXED) != gen;
+}
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+
+/*
+ * Control words from the master to the other ranks while a map is made.
+ *
+ * Every rank but the master posts a receive for one word when it starts a
+ * map (control_begin) and tests it between levels and tiles
+ * (control_test), without blocking. The master sends exactly one word per
+ * map to each of them: CONTROL_CANCEL as soon as it wants the map dropped
+ * (control_send), or CONTROL_DONE from control_end once it has the whole
+ * map. Words from one source with one tag arrive in order, so every map's
+ * word meets that map's receive; control_end also completes the master's
+ * sends and the other ranks' receive, so no map leaves one behind.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <mpi.h>
+
+#define CONTROL_DONE 0
+#define CONTROL_CANCEL 1
+
+typedef struct {
+    int myid, master, nranks, tag;
+    int word;               // the word being received, or the one the master sent
+    int sent;               // whether the master sent this map's word
+    int cancelled;          // whether the map is known to be cancelled
+    MPI_Request *requests;  // the master's sends, one per rank, or the receive
+} control_t;
+
+static void control_init(control_t *c, int myid, int master, int nranks, int tag) {
+    c->myid = myid;
+    c->master = master;
+    c->nranks = nranks;
+    c->tag = tag;
+    c->requests = malloc((myid == master ? nranks : 1) * sizeof(MPI_Request));
+    if (!c->requests) {
+        perror("control requests");
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+}
+
+static void control_free(control_t *c) {
+    free(c->requests);
+}
+
+static void control_begin(control_t *c) {
+    c->word = CONTROL_DONE;
+    c->sent = 0;
+    c->cancelled = 0;
+    if (c->myid != c->master)
+        MPI_Irecv(&c->word, 1, MPI_INT, c->master, c->tag, MPI_COMM_WORLD, &c->requests[0]);
+}
+
+// The master: sends word to every other rank, unless this map's went
+// already
+static void control_send(control_t *c, int word) {
+    int r;
+
+    if (c->myid != c->master || c->sent)
+        return;
+
+    c->word = word;
+    c->sent = 1;
+    c->cancelled = word == CONTROL_CANCEL;
+    for (r = 0; r < c->nranks; r++) {
+        if (r == c->master)
+            c->requests[r] = MPI_REQUEST_NULL;
+        else
+            MPI_Isend(&c->word, 1, MPI_INT, r, c->tag, MPI_COMM_WORLD, &c->requests[r]);
+    }
+}
+
+// The other ranks: whether the master has cancelled the map so far
+static int control_test(control_t *c) {
+    int done = 0;
+
+    if (c->myid != c->master && !c->cancelled) {
+        MPI_Test(&c->requests[0], &done, MPI_STATUS_IGNORE);
+        c->cancelled = done && c->word == CONTROL_CANCEL;
+    }
+
+    return c->cancelled;
+}
+
+// Ends the map's exchange: the master sends CONTROL_DONE if it sent
+// nothing; every rank waits for its requests. Returns whether the map was
+// cancelled.
+static int control_end(control_t *c) {
+    if (c->myid == c->master) {
+        control_send(c, CONTROL_DONE);
+        MPI_Waitall(c->nranks, c->requests, MPI_STATUSES_IGNORE);
+    } else {
+        MPI_Wait(&c->requests[0], MPI_STATUS_IGNORE);
+        c->cancelled = c->word == CONTROL_CANCEL;
+    }
+
+    return c->cancelled;
+}
+
+#endif
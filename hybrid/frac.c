@@ -1,11 +1,24 @@
+// For CPU affinity
+#define _GNU_SOURCE
+
 #include <SDL/SDL.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <errno.h>
 
 #include "errors.h"
+#include "trace.h"
+#include "tilemap.h"
+#include "hugemem.h"
+#include "nodemem.h"
+#include "arena.h"
+#include "dirty.h"
+#include "affinity.h"
+#include "cancel.h"
+#include "control.h"
 #include <pthread.h>
 #include <mpi.h>
 
@@ -18,11 +31,20 @@
 
 #define TASK_TAG 1
 #define RESULT_TAG 2
+#define PIXELS_TAG 3
+#define CONTROL_TAG 4
 
 //Fiddle with these two to make different types of landscape at different distances
 #define RANGE_CHANGE 13000
 #define REDUCTION 0.7
 
+// Where the S key saves the map on screen
+#define MAP_FILE "frac_map.tmap"
+#define MAP_TILE 256
+
+// How long idle workers sleep between checks for the master's decision
+#define IDLE_POLL_NS 1000000
+
 #define NUM_THREADS 4
 
 
@@ -47,20 +69,61 @@ pthread_cond_t work_cv = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t display_mutex = PTHREAD_MUTEX_INITIALIZER;    
 pthread_cond_t display_cv = PTHREAD_COND_INITIALIZER;
 
-int stop_signal, received;
+int stop_signal;
+
+// Maps requested by main and tiles finished by the threads. Waiting on
+// these instead of on the bare condition variables means a broadcast that
+// lands before a thread starts waiting is not lost.
+int work_gen, done_gen;
+
+// Escape while a map is being made cancels it (see cancel.h). The master
+// reads the key and tells the other ranks with a control word (see
+// control.h); their main thread sets the token, and thread 0 reads it for
+// all the threads at barriers, into two slots in turn. map_gen is the
+// map's number in the token, tile_dropped whether the rank's tile was
+// given up.
+cancel_t cancel;
+control_t control;
+unsigned map_gen;
+int map_cancelled[2];
+int tile_dropped;
 
 SDL_Surface *screen;
-int heightmap[WIDTH + 1][HEIGHT + 1];
+// What changed on screen since the last update (see dirty.h)
+dirty_t dirty;
+// The whole map, on huge pages (see hugemem.h) or shared by the ranks of a
+// node (see nodemem.h). heightmap is where this rank draws: the whole map
+// on the master, the top left corner of its tile on a worker.
+int (*whole_map)[HEIGHT + 1];
+int (*heightmap)[HEIGHT + 1];
 SDL_Event event;
 
 int myid, numprocs;
 
+// Rank among the ranks on this machine, to give each its own cpus
+int local_rank;
+
+// Channel shifts and alpha mask of the master's screen. They are broadcast
+// so that ranks without a display can colour their tiles in its format.
+int pix_format[4];
+
+// Row-major pixels of this rank's tile, filled by its threads
+Uint32 *tile_pixels;
+
 int node_w = WIDTH;
 int node_h = HEIGHT;
 int node_W = WIDTH; 
 int node_H = HEIGHT;
 float node_deviance = 1.0;
 
+// A worker's tile ends where the next one starts in the map: its row
+// node_H is the top row of the tile below, and its column node_W the left
+// column of the tile to the right. Column node_W is never used, but the
+// tile makes its own bottom row, so a worker keeps that row here instead
+// of in the map.
+int tile_in_place;
+int tile_bottom[WIDTH + 1];
+
 static void shift_all(int amnt);
 
 static int rand_range(int low, int high) {
@@ -77,6 +140,10 @@ static void set_point(int x, int y, int value) {
     pix[offset] = value;
 }
 
+static Uint32 map_rgb(Uint8 r, Uint8 g, Uint8 b) {
+    return (r << pix_format[0]) | (g << pix_format[1]) | (b << pix_format[2]) | (Uint32)pix_format[3];
+}
+
 static Uint32 height_to_colour(int height) {
     int value;
     int range;
@@ -89,25 +156,56 @@ static Uint32 height_to_colour(int height) {
     value = ((float)(height - MINHEIGHT) / range) * 255;
 
     if (height < 0)
-        return SDL_MapRGB(screen->format, 0, 0, value);
-    return SDL_MapRGB(screen->format, 30, value, 30);
-    return SDL_MapRGB(screen->format, value, value, value);
+        return map_rgb(0, 0, value);
+    return map_rgb(30, value, 30);
+    return map_rgb(value, value, value);
 }
 
 static void heightmap_to_screen(void) {
     int i, e;
 
+    TRACE_BEGIN(colour);
     for (e = 0; e < HEIGHT; ++e)
         for (i = 0; i < WIDTH; ++i)
             set_point(i, e, height_to_colour(heightmap[i][e]));
+    TRACE_END(colour, "colour", -1);
+}
+
+// Colours rows [first, last) of a w wide tile into a row-major pixel buffer
+static void tile_to_pixels(Uint32 *pixels, int w, int first, int last) {
+    int i, e;
+
+    TRACE_BEGIN(colour);
+    for (e = first; e < last; ++e)
+        for (i = 0; i < w; ++i)
+            pixels[e * w + i] = height_to_colour(heightmap[i][e]);
+    TRACE_END(colour, "colour", -1);
+}
+
+// Copies a coloured tile into the screen at (x, y)
+static void pixels_to_screen(Uint32 *pixels, int x, int y, int w, int h) {
+    Uint32 *pix = (Uint32 *) screen->pixels;
+    int pitch = screen->pitch / sizeof(Uint32);
+    int e;
+
+    for (e = 0; e < h; ++e)
+        memcpy(pix + (y + e) * pitch + x, pixels + e * w, w * sizeof(Uint32));
+    dirty_add(&dirty, x, y, w, h);
+}
+
+// Point (x, y) of the map this rank draws (see tile_bottom)
+static int *cell(int x, int y) {
+    if (tile_in_place && y == node_H)
+        return &tile_bottom[x];
+    return &heightmap[x][y];
 }
 
 static int rect_avg_heights(SDL_Rect *r) {
     int total;
     total = heightmap[r->x][r->y];
     total += heightmap[(r->x + r->w) % node_W][r->y];
-    total += heightmap[r->x][r->y + r->h];
-    total += heightmap[(r->x + r->w) % node_H][r->y + r->h];
+    total += *cell(r->x, r->y + r->h);
+    total += *cell((r->x + r->w) % node_H, r->y + r->h);
     return total / 4;
 }
 
@@ -126,12 +224,12 @@ static int diam_avg_heights(SDL_Rect *r) {
 
     //LEFT
     if (r->x >= 0) {
-        total += heightmap[r->x][r->y + r->h / 2];
+        total += *cell(r->x, r->y + r->h / 2);
         divisors++;
     }
 
     //RIGHT
-    total += heightmap[(r->x + r->w) % node_W][r->y + r->h / 2];
+    total += *cell((r->x + r->w) % node_W, r->y + r->h / 2);
 
     //BOTTOM
     if (r->y + r->h < node_H) {
@@ -164,10 +262,18 @@ static void draw_all_diamonds(int startx, int starty, int W, int H, int w, int h
 
     for (r.y = starty - r.h / 2; r.y < H; r.y += r.h)
         for (r.x = startx; r.x < W; r.x += r.w)
-            heightmap[r.x + r.w / 2][r.y + r.h / 2] = diam_avg_heights(&r) + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
+            *cell(r.x + r.w / 2, r.y + r.h / 2) = diam_avg_heights(&r) + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
     for (r.y = starty; r.y < H; r.y += r.h)
         for (r.x = startx - r.w / 2; r.x + r.w / 2 < W; r.x += r.w)
-            heightmap[r.x + r.w / 2][r.y + r.h / 2] = diam_avg_heights(&r) + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
+            *cell(r.x + r.w / 2, r.y + r.h / 2) = diam_avg_heights(&r) + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
+}
+
+// Save the map on screen as a tiled, compressed file
+static void save_map(void) {
+    if (tilemap_write(MAP_FILE, &heightmap[0][0], HEIGHT + 1, WIDTH, HEIGHT, MAP_TILE, NUM_THREADS))
+        perror(MAP_FILE);
+    else
+        printf("[HYBRID] Saved %s\n", MAP_FILE);
 }
 
 static void shift_all(int amnt) {
@@ -177,16 +283,72 @@ static void shift_all(int amnt) {
             heightmap[i][e] += amnt;
 }
 
+// Barrier wait that is timed as its own span when tracing
+static void barrier_wait(int level) {
+    TRACE_BEGIN(wait);
+    pthread_barrier_wait(&barrier);
+    TRACE_END(wait, "barrier", level);
+}
+
+// Barrier at which the threads also agree whether map gen is cancelled,
+// as thread 0 sees it when it gets there. Thread 0 only writes a slot
+// again two checks later, past a barrier every thread has to reach after
+// reading it.
+static int barrier_cancelled(long my_id, unsigned gen, int *checks, int level) {
+    int slot = (*checks)++ & 1;
+
+    if (my_id == 0)
+        map_cancelled[slot] = cancel_check(&cancel, gen);
+    barrier_wait(level);
+
+    return map_cancelled[slot];
+}
+
+// The part of this rank's W x H tile that thread id works on in the fine
+// levels: a block of the sqrt(NUM_THREADS) x sqrt(NUM_THREADS) grid when
+// NUM_THREADS is a power of 4, otherwise a band of columns. Blocks on the
+// right and bottom edges take the extra column and row.
+static void owned_block(long id, int W, int H, int *x0, int *x1, int *y0, int *y1) {
+    int side;
+
+    for (side = 1; side * side < NUM_THREADS; side *= 2)
+        ;
+
+    if (side * side == NUM_THREADS) {
+        *x0 = (id % side) * W / side;
+        *x1 = (id % side + 1) * W / side;
+        *y0 = (id / side) * H / side;
+        *y1 = (id / side + 1) * H / side;
+    } else {
+        *x0 = id * W / NUM_THREADS;
+        *x1 = (id + 1) * W / NUM_THREADS;
+        *y0 = 0;
+        *y1 = H;
+    }
+
+    if (*x1 == W)
+        *x1 = W + 1;
+    if (*y1 == H)
+        *y1 = H + 1;
+}
+
 // Makes a map with PTHREADS
 static void *make_map(void *args) {
     int i, e;
     int status;
+    int level;
 
     struct timespec start, stop;
     double accum;
 
     long my_id = (long)args;
+    int own_x0, own_x1, own_y0, own_y1;
+    int first = 1;
+    int gen = 0, checks = 0, abandon;
+    unsigned cancel_gen;
+
     srand(time(NULL));
+    affinity_pin(local_rank * NUM_THREADS + my_id);
 
     while (1) {
 
@@ -194,36 +356,64 @@ static void *make_map(void *args) {
         status = pthread_mutex_lock(&work_mutex);
         if (status) err_abort(status, "lock mutex");
 
-        status = pthread_cond_wait(&work_cv, &work_mutex);
-        if (status) err_abort(status, "wait for condition");
-
-        status = pthread_mutex_unlock(&work_mutex);
-        if (status) err_abort(status, "unlock mutex");
+        while (work_gen == gen && !stop_signal) {
+            status = pthread_cond_wait(&work_cv, &work_mutex);
+            if (status) err_abort(status, "wait for condition");
+        }
 
-        // Check if ESC was pressed (stop_signal was set)
-        if (stop_signal) {
+        // Stop only with no map pending, or some threads would wait at its
+        // barriers for ever
+        if (work_gen == gen) {
+            status = pthread_mutex_unlock(&work_mutex);
+            if (status) err_abort(status, "unlock mutex");
             pthread_exit(NULL);
         }
+        gen = work_gen;
+        cancel_gen = map_gen;
 
-        if (my_id == 0) {
+        status = pthread_mutex_unlock(&work_mutex);
+        if (status) err_abort(status, "unlock mutex");
 
-            //Reset the whole heightmap to the minimum height
-            for (e = 0; e < node_H + 1; ++e)
-                for (i = 0; i < node_W + 1; ++i)
+        //Reset the tile to the minimum height. On the first map every
+        //thread resets the block it owns, so its pages are placed on the
+        //thread's NUMA node. After that only the bottom row needs it:
+        //the rest of the tile is written before it is read. The tile's
+        //right column belongs to its neighbour and is left alone.
+        owned_block(my_id, node_W, node_H, &own_x0, &own_x1, &own_y0, &own_y1);
+        TRACE_BEGIN(reset);
+        if (first) {
+            for (i = own_x0; i < own_x1 && i < node_W; ++i)
+                for (e = own_y0; e < own_y1 && e < node_H; ++e)
                     heightmap[i][e] = MINHEIGHT;
+            first = 0;
+        }
+        if (own_y1 == node_H + 1) {
+            for (i = own_x0; i < own_x1; ++i)
+                *cell(i, node_H) = MINHEIGHT;
+        }
+        TRACE_END(reset, "reset", -1);
+
+        barrier_wait(-1);
 
+        if (my_id == 0) {
             //Add our starting corner points
             heightmap[0][0] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
-            heightmap[0][node_H] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
+            *cell(0, node_H) = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
         }
 
-        pthread_barrier_wait (&barrier);
-
         clock_gettime(CLOCK_REALTIME, &start);
         if (my_id == 0) {
-            while (node_h >= 2 && node_w >= 2) {
+            while (node_h >= 2 && node_w >= 2 && !cancel_check(&cancel, cancel_gen)) {
+                for (level = 0; (WIDTH >> level) > node_w; level++)
+                    ;
+
+                TRACE_BEGIN(square);
                 draw_all_squares(0, 0, node_W, node_H, node_w, node_h, node_deviance);
+                TRACE_END(square, "square", level);
+
+                TRACE_BEGIN(diamond);
                 draw_all_diamonds(0, 0, node_W, node_H, node_w, node_h, node_deviance);
+                TRACE_END(diamond, "diamond", level);
 
                 node_w /= 2;
                 node_h /= 2;
@@ -236,7 +426,10 @@ static void *make_map(void *args) {
             }
         }
 
-        pthread_barrier_wait (&barrier);
+        abandon = barrier_cancelled(my_id, cancel_gen, &checks, -1);
+
+        for (level = 0; (WIDTH >> level) > node_w; level++)
+            ;
 
         int startx = 0;
         int starty = 0;
@@ -259,22 +452,35 @@ static void *make_map(void *args) {
         int local_H = starty + node_h;
 
 
-        // Else do work and create map
-        while (local_h >= 2 && local_w >= 2) {
+        // Else do work and create map, unless it was cancelled
+        while (!abandon && local_h >= 2 && local_w >= 2) {
             // Individual computation
+            TRACE_BEGIN(square);
             draw_all_squares(startx, starty, local_W, local_H, local_w, local_h, local_deviance);
-            pthread_barrier_wait(&barrier);
+            TRACE_END(square, "square", level);
+            barrier_wait(level);
 
+            TRACE_BEGIN(diamond);
             draw_all_diamonds(startx, starty, local_W, local_H, local_w, local_h, local_deviance);
-            pthread_barrier_wait(&barrier);
+            TRACE_END(diamond, "diamond", level);
+            abandon = barrier_cancelled(my_id, cancel_gen, &checks, level);
 
             local_w /= 2;
             local_h /= 2;
 
             local_deviance *= REDUCTION;
+            level++;
         }
 
-        pthread_barrier_wait(&barrier);
+        barrier_wait(-1);
+
+        // Every thread colours its own band of the tile, unless the map was
+        // dropped
+        if (!abandon)
+            tile_to_pixels(tile_pixels, node_W, my_id * node_H / NUM_THREADS,
+                (my_id + 1) * node_H / NUM_THREADS);
+
+        barrier_wait(-1);
 
         if (my_id == 0) {
             clock_gettime(CLOCK_REALTIME, &stop);
@@ -284,30 +490,92 @@ static void *make_map(void *args) {
                     / (double)BILLION;
             //printf("[PTHREADS] Make_map: %lf\n", accum);
 
-            while (!received) {      
-                status = pthread_mutex_lock(&display_mutex);
-                if (status) err_abort(status, "lock mutex");
+            status = pthread_mutex_lock(&display_mutex);
+            if (status) err_abort(status, "lock mutex");
 
-                status = pthread_cond_signal(&display_cv);
-                if (status) err_abort(status, "signal condition");
+            tile_dropped = abandon;
+            done_gen = gen;
+            status = pthread_cond_signal(&display_cv);
+            if (status) err_abort(status, "signal condition");
 
-                status = pthread_mutex_unlock(&display_mutex);
-                if (status) err_abort(status, "unlock mutex");
-            }
+            status = pthread_mutex_unlock(&display_mutex);
+            if (status) err_abort(status, "unlock mutex");
         }
     }
 }
 
+/*
+ * The master: whether the map being made is cancelled, reading the keys
+ * that cancel it. Escape does, and the other ranks get the word to drop
+ * their tiles. Other keys are ignored while a map is being made.
+ */
+static int cancelled(void) {
+    SDL_Event e;
+
+    while (!cancel_check(&cancel, map_gen) && SDL_PollEvent(&e))
+        if (e.type == SDL_QUIT || (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_ESCAPE))
+            cancel_stop(&cancel);
+
+    if (!cancel_check(&cancel, map_gen))
+        return 0;
+    control_send(&control, CONTROL_CANCEL);
+
+    return 1;
+}
+
+// The master: waits for any tile the workers send and returns its rank,
+// or -1 when none is left to come. It keeps reading keys meanwhile, so it
+// can cancel the map while they make their tiles. Like share_decision, it
+// sleeps in between.
+static int wait_tile_reading_keys(arena_t *arena) {
+    struct timespec nap = { 0, IDLE_POLL_NS };
+    int peer;
+
+    while ((peer = arena_testany(arena)) == ARENA_PENDING) {
+        cancelled();
+        nanosleep(&nap, NULL);
+    }
+
+    return peer;
+}
+
+// Shares the master's should_continue with every rank. The master may
+// wait on a key for a long time, and a blocking broadcast spins on most MPI
+// libraries, so workers test a nonblocking one and sleep in between to
+// leave their cores idle.
+static void share_decision(int *should_continue, int master) {
+    struct timespec nap = { 0, IDLE_POLL_NS };
+    MPI_Request request;
+    int done = 0;
+
+    MPI_Ibcast(should_continue, 1, MPI_INT, master, MPI_COMM_WORLD, &request);
+    if (myid == master) {
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        return;
+    }
+
+    while (1) {
+        MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+        if (done)
+            break;
+        nanosleep(&nap, NULL);
+    }
+}
+
 // Split the Map between numprocs
 int main(int argc, char *argv[]) {
     const int master = 0;
-    int should_continue = 0;
+    int should_continue = 0, dropped;
     MPI_Status stat;
+    arena_t arena = { 0 };
+    // The task a worker was given, sent back with its tile to place it
+    Task task;
 
     int w = WIDTH;
     int h = HEIGHT;
     float deviance;
     int i, e;
+    int level;
 
     struct timespec start, stop;
     double accum;
@@ -323,6 +591,39 @@ int main(int argc, char *argv[]) {
     MPI_Init(&argc, &argv);
     MPI_Comm_size(MPI_COMM_WORLD, &numprocs);
     MPI_Comm_rank(MPI_COMM_WORLD, &myid);
+    TRACE_INIT(myid);
+
+    // Ranks sharing a machine take consecutive slices of its cpu list,
+    // and within a rank consecutive threads own neighbouring blocks
+    MPI_Comm node_comm;
+    MPI_Win node_win;
+    int node_size, leader, *node_mate;
+    size_t map_bytes = (size_t)(WIDTH + 1) * (HEIGHT + 1) * sizeof(int);
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, myid, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &local_rank);
+    MPI_Comm_size(node_comm, &node_size);
+    leader = myid;
+    MPI_Bcast(&leader, 1, MPI_INT, 0, node_comm);
+    affinity_init("[HYBRID]");
+
+    // Ranks on one node share a map and make their tiles in place in it,
+    // so the node keeps one copy, and the master's node-mates only send
+    // their pixels. A rank alone on its node keeps a private map on huge
+    // pages.
+    if (node_size > 1) {
+        whole_map = nodemem_alloc(node_comm, map_bytes, &node_win);
+        if (local_rank == 0)
+            memset(whole_map, 0, map_bytes);
+        nodemem_fence(node_comm, node_win);
+    } else {
+        whole_map = huge_alloc(map_bytes);
+    }
+    heightmap = whole_map;
+    tile_in_place = myid != master;
+    node_mate = malloc(numprocs * sizeof(int));
+    MPI_Allgather(&leader, 1, MPI_INT, node_mate, 1, MPI_INT, MPI_COMM_WORLD);
+    for (i = 0; i < numprocs; i++)
+        node_mate[i] = node_mate[i] == master && i != master && node_size > 1;
 
     // Start PTHREADS
     pthread_barrier_init (&barrier, NULL, NUM_THREADS);
@@ -352,34 +653,48 @@ int main(int argc, char *argv[]) {
     if (myid == master) {
         SDL_Init(SDL_INIT_EVERYTHING);
         screen = SDL_SetVideoMode(WIDTH, HEIGHT, 32, SDL_HWSURFACE);
+
+        pix_format[0] = screen->format->Rshift;
+        pix_format[1] = screen->format->Gshift;
+        pix_format[2] = screen->format->Bshift;
+        pix_format[3] = screen->format->Amask;
     }
+    MPI_Bcast(pix_format, 4, MPI_INT, master, MPI_COMM_WORLD);
+    control_init(&control, myid, master, numprocs, CONTROL_TAG);
 
 
     while (1) {
         w = WIDTH;
         h = HEIGHT;
-        received = 0;
+        control_begin(&control);
 
         if (myid == master) {
             clock_gettime(CLOCK_REALTIME, &start);
         }
 
-        // Init heightmap for everybody
-        for (e = 0; e < HEIGHT; ++e)
-            for (i = 0; i < WIDTH; ++i)
-                heightmap[i][e] = MINHEIGHT;
-
         if (myid == master) {
 
             // Add our starting corner points
             heightmap[0][0] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
             heightmap[0][HEIGHT] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
 
+            map_gen = cancel_begin(&cancel);
             deviance = 1.0;
+            level = 0;
             while (h >= 2 || w >= 2) {
-                draw_all_squares(0, 0, WIDTH, HEIGHT, w, h, deviance);
-                draw_all_diamonds(0, 0, WIDTH, HEIGHT, w, h, deviance);
+                // A cancelled map still comes down to the tiles' size, so
+                // the workers get theirs
+                if (!cancelled()) {
+                    TRACE_BEGIN(square);
+                    draw_all_squares(0, 0, WIDTH, HEIGHT, w, h, deviance);
+                    TRACE_END(square, "square", level);
+
+                    TRACE_BEGIN(diamond);
+                    draw_all_diamonds(0, 0, WIDTH, HEIGHT, w, h, deviance);
+                    TRACE_END(diamond, "diamond", level);
+                }
 
+                level++;
                 deviance *= REDUCTION;
 
                 w /= 2;
@@ -399,8 +714,11 @@ int main(int argc, char *argv[]) {
         MPI_Bcast(&w, 1, MPI_INT, master, MPI_COMM_WORLD);
         MPI_Bcast(&deviance, 1, MPI_FLOAT, master, MPI_COMM_WORLD);
 
-        //int borders[numprocs][4];
-        int *buffer = (int *) calloc(w * h, sizeof(int));
+        // Tiles have the same size every map, so this only sets up the
+        // buffers the first time
+        arena_init(&arena, w, h, myid, master, numprocs, RESULT_TAG, PIXELS_TAG);
+        int *buffer = arena.heights;
+        tile_pixels = arena.pixels;
         int H = h, W = w;
 
         // Continue processing. But split work.
@@ -424,23 +742,36 @@ int main(int argc, char *argv[]) {
 
                         // printf("Master sending to %d values = %d %d %d %d, pos = %d %d, h = %d w = %d \n", 
                         //     proc, t.v1, t.v2, t.v3, t.v4, t.x, t.y, t.h, t.w);
+                        TRACE_BEGIN(send);
                         MPI_Send(&t, 1, taskType, proc, TASK_TAG, MPI_COMM_WORLD);
+                        TRACE_END(send, "mpi_send", -1);
                         proc++;
                     }
                 }
             }
 
+            // Then posts the receive of every tile, to take them as they
+            // come while the workers are still making the others. The
+            // heights of a node-mate's tile are already in the map.
+            for (i = 1; i < numprocs; i++) {
+                if (node_mate[i])
+                    arena_start_pixels(&arena, i);
+                else
+                    arena_start(&arena, i);
+            }
         } else {
             Task t;
+            TRACE_BEGIN(recv);
             MPI_Recv(&t, 1, taskType, master, TASK_TAG, MPI_COMM_WORLD, &stat);
+            TRACE_END(recv, "mpi_recv", -1);
+            task = t;
             // printf("Process %d received values = %d %d %d %d, pos = %d %d, h = %d w = %d \n", 
             //     myid, t.v1, t.v2, t.v3, t.v4, t.x, t.y, t.h, t.w);
 
             // init
+            heightmap = (int (*)[HEIGHT + 1])&whole_map[t.x][t.y];
             heightmap[0][0] = t.v1;
-            heightmap[0][h] = t.v2;
-            heightmap[w][0] = t.v3;
-            heightmap[w][h] = t.v4;
+            tile_bottom[0] = t.v2;
 
             node_H = h;
             node_W = w;
@@ -457,56 +788,96 @@ int main(int argc, char *argv[]) {
             status = pthread_mutex_lock(&work_mutex);
             if (status) err_abort(status, "lock mutex");
 
+            map_gen = cancel_begin(&cancel);
+            work_gen++;
             status = pthread_cond_broadcast(&work_cv);
             if (status) err_abort(status, "signal condition");
 
             status = pthread_mutex_unlock(&work_mutex);
             if (status) err_abort(status, "unlock mutex");
 
-            // Wait for result
+            // Wait for result, testing for the master's word to drop it
+            // every IDLE_POLL_NS
             status = pthread_mutex_lock(&display_mutex);
             if (status) err_abort(status, "lock mutex");
 
-            status = pthread_cond_wait(&display_cv, &display_mutex);
-            if (status) err_abort(status, "signal condition");
-            received = 1;
+            while (done_gen != work_gen) {
+                struct timespec until;
+
+                clock_gettime(CLOCK_REALTIME, &until);
+                until.tv_nsec += IDLE_POLL_NS;
+                if (until.tv_nsec >= 1000000000) {
+                    until.tv_sec++;
+                    until.tv_nsec -= 1000000000;
+                }
+                status = pthread_cond_timedwait(&display_cv, &display_mutex, &until);
+                if (status && status != ETIMEDOUT) err_abort(status, "wait for condition");
+
+                if (!cancel_check(&cancel, map_gen) && control_test(&control))
+                    cancel_supersede(&cancel);
+            }
 
             status = pthread_mutex_unlock(&display_mutex);
             if (status) err_abort(status, "unlock mutex");
 
         }
 
-        MPI_Barrier(MPI_COMM_WORLD);
-
         if (myid == master) {
 
-            // Receive buffers from workers.
-            for (i = 1; i < numprocs; i++) {
+            // Receive buffers from workers, whichever comes first. The
+            // task sent along says where the tile goes.
+            while (1) {
                 Task t;
-                MPI_Recv(&t, 1, taskType, i, TASK_TAG, MPI_COMM_WORLD, &stat);
-                MPI_Recv(buffer, H * W, MPI_INT, i, RESULT_TAG, MPI_COMM_WORLD, &stat);
+                TRACE_BEGIN(recv);
+                i = wait_tile_reading_keys(&arena);
+                if (i >= 0)
+                    MPI_Recv(&t, 1, taskType, i, TASK_TAG, MPI_COMM_WORLD, &stat);
+                TRACE_END(recv, "mpi_recv", -1);
+                if (i < 0)
+                    break;
+                if (cancelled())
+                    continue;
 
-                // Store them in heightmap
+                // Store them in heightmap, unless the worker shares it
                 int j;
-                for (j = 0; j < W; j++) {
-                    memcpy(&heightmap[t.x + j][t.y], buffer + (j * W), W * sizeof(int));
+                for (j = 0; j < W && !node_mate[i]; j++) {
+                    memcpy(&heightmap[t.x + j][t.y], arena_heights(&arena, i) + (j * W), W * sizeof(int));
                 }
+
+                // The worker's threads already coloured its tile
+                pixels_to_screen(arena_pixels(&arena, i), t.x, t.y, W, H);
+                dirty_flush(&dirty, screen);
             }
-        } else {
-            Task t;
+
+            // The node-mates' tiles, for S
+            if (node_size > 1)
+                MPI_Win_sync(node_win);
+        } else if (!tile_dropped && leader != master) {
             for (i = 0; i < W; i++) {
                 memcpy(buffer + (i * H), &heightmap[i][0], H * sizeof(int));
             }
+        }
+        if (myid != master) {
 
             // Send the buffer to master
-            MPI_Send(&t, 1, taskType, master, TASK_TAG, MPI_COMM_WORLD);
-            MPI_Send (buffer, H * W, MPI_INT, master, RESULT_TAG, MPI_COMM_WORLD);
+            TRACE_BEGIN(send);
+            if (node_size > 1)
+                MPI_Win_sync(node_win);
+            MPI_Send(&task, 1, taskType, master, TASK_TAG, MPI_COMM_WORLD);
+            if (leader == master)
+                arena_transfer_pixels(&arena, master);
+            else
+                arena_transfer(&arena, master);
+            TRACE_END(send, "mpi_send", -1);
         }
 
+        // A cancelled map still made every transfer, so the messages match
+        // as ever, but nothing more is shown
+        dropped = control_end(&control);
+
         MPI_Barrier(MPI_COMM_WORLD);
-        free(buffer);
 
-        if (myid == master) {
+        if (myid == master && !dropped) {
             clock_gettime(CLOCK_REALTIME, &stop);
 
             accum = ( stop.tv_sec - start.tv_sec )
@@ -514,15 +885,28 @@ int main(int argc, char *argv[]) {
                / (double)1000000000;
             printf("[HYBRID] Overall time on key pressed event: %lf\n", accum);
 
-            heightmap_to_screen();
-            SDL_Flip(screen);
+            // Without workers the master computed and colours everything.
+            // Otherwise every tile went to the display as it arrived.
+            if (numprocs == 1) {
+                heightmap_to_screen();
+                dirty_add(&dirty, 0, 0, WIDTH, HEIGHT);
+                dirty_flush(&dirty, screen);
+            }
+
+            // Sleep until escape
+            while (SDL_WaitEvent(&event)) {
+                if (event.type == SDL_QUIT)
+                    break;
+                if (event.type != SDL_KEYDOWN)
+                    continue;
 
-            while (1) {
-                SDL_PollEvent(&event);
                 if (event.key.keysym.sym == SDLK_ESCAPE) {
                     should_continue = 0;
                     break;
                 }
+                else if (event.key.keysym.sym == SDLK_s) {
+                    save_map();
+                }
             }
         }
         // if (myid == master) {
@@ -552,7 +936,7 @@ int main(int argc, char *argv[]) {
         should_continue = 0;
 
         // Find out from master if the program should close or create another map.
-        MPI_Bcast(&should_continue, 1, MPI_INT, master, MPI_COMM_WORLD);
+        share_decision(&should_continue, master);
 
         if (!should_continue) {
             break;
@@ -560,11 +944,10 @@ int main(int argc, char *argv[]) {
     }
 
     // Close threads
-    stop_signal = 1;
-
     status = pthread_mutex_lock(&work_mutex);
     if (status) err_abort(status, "lock mutex");
 
+    stop_signal = 1;
     status = pthread_cond_broadcast(&work_cv);
     if (status) err_abort(status, "signal condition");
 
@@ -585,12 +968,22 @@ int main(int argc, char *argv[]) {
     pthread_mutex_destroy(&display_mutex);
     pthread_cond_destroy(&display_cv);
 
+    TRACE_DUMP();
+
     // All work done
     // Master closes I/O
     if (myid == master) {
         SDL_FreeSurface(screen);
         SDL_Quit();
     }
+    arena_free(&arena);
+    control_free(&control);
+    if (node_size > 1)
+        nodemem_free(&node_win);
+    else
+        huge_free(whole_map, map_bytes);
+    MPI_Comm_free(&node_comm);
+    free(node_mate);
 
 
     // Close MPI
@@ -0,0 +1,240 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/*
+ * Hot-path instrumentation. When compiled -DTRACE, every
+ * TRACE_BEGIN/TRACE_END pair records one timed span into a buffer
+ * owned by the calling thread. TRACE_DUMP writes all spans as Chrome
+ * trace-event JSON (load it in chrome://tracing or Perfetto) and prints
+ * a summary table to stderr. When TRACE is not defined, all of the
+ * macros expand to nothing.
+ *
+ * The output file defaults to "frac_trace.json" and can be changed with
+ * the FRAC_TRACE_FILE environment variable. MPI builds pass their rank to
+ * TRACE_INIT, which is used as the trace pid and appended to the name.
+ */
+
+#ifdef TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#define TRACE_CHUNK 4096
+
+typedef struct {
+    const char *name;
+    int level;
+    long long start; // ns
+    long long dur;   // ns
+} trace_event_t;
+
+typedef struct trace_buf {
+    int tid;
+    int count, size;
+    trace_event_t *events;
+    struct trace_buf *next;
+} trace_buf_t;
+
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static trace_buf_t *trace_bufs;
+static int trace_next_tid;
+static int trace_pid;
+static long long trace_epoch;
+static __thread trace_buf_t *trace_mine;
+
+static long long trace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void trace_init(int pid) {
+    trace_pid = pid;
+    trace_epoch = trace_now();
+}
+
+static trace_buf_t *trace_thread_buf(void) {
+    if (trace_mine)
+        return trace_mine;
+
+    trace_mine = (trace_buf_t *) calloc(1, sizeof(trace_buf_t));
+    if (!trace_mine) {
+        perror("trace buffer");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&trace_mutex);
+    trace_mine->tid = trace_next_tid++;
+    trace_mine->next = trace_bufs;
+    trace_bufs = trace_mine;
+    pthread_mutex_unlock(&trace_mutex);
+
+    return trace_mine;
+}
+
+static void trace_record(const char *name, int level, long long start, long long stop) {
+    trace_buf_t *b = trace_thread_buf();
+
+    if (b->count == b->size) {
+        b->size += TRACE_CHUNK;
+        b->events = (trace_event_t *) realloc(b->events, b->size * sizeof(trace_event_t));
+        if (!b->events) {
+            perror("trace buffer");
+            exit(1);
+        }
+    }
+
+    b->events[b->count].name = name;
+    b->events[b->count].level = level;
+    b->events[b->count].start = start - trace_epoch;
+    b->events[b->count].dur = stop - start;
+    b->count++;
+}
+
+/*
+ * Summary rows are keyed either by (phase, level) over all threads or by
+ * (phase, thread) over all levels.
+ */
+typedef struct {
+    const char *name;
+    int by_thread;
+    int key; // level or thread id
+    long calls;
+    long long total, max;
+} trace_row_t;
+
+static void trace_add_row(trace_row_t **rows, int *n, int *size,
+        const char *name, int by_thread, int key, long long dur) {
+    int i;
+
+    for (i = 0; i < *n; i++) {
+        if ((*rows)[i].by_thread == by_thread && (*rows)[i].key == key
+                && !strcmp((*rows)[i].name, name))
+            break;
+    }
+
+    if (i == *n) {
+        if (*n == *size) {
+            *size = *size ? *size * 2 : 64;
+            *rows = (trace_row_t *) realloc(*rows, *size * sizeof(trace_row_t));
+            if (!*rows) {
+                perror("trace summary");
+                exit(1);
+            }
+        }
+        (*rows)[i].name = name;
+        (*rows)[i].by_thread = by_thread;
+        (*rows)[i].key = key;
+        (*rows)[i].calls = 0;
+        (*rows)[i].total = 0;
+        (*rows)[i].max = 0;
+        (*n)++;
+    }
+
+    (*rows)[i].calls++;
+    (*rows)[i].total += dur;
+    if (dur > (*rows)[i].max)
+        (*rows)[i].max = dur;
+}
+
+static int trace_row_cmp(const void *a, const void *b) {
+    const trace_row_t *x = (const trace_row_t *) a;
+    const trace_row_t *y = (const trace_row_t *) b;
+
+    if (x->by_thread != y->by_thread)
+        return x->by_thread - y->by_thread;
+    if (x->key != y->key)
+        return x->key - y->key;
+    return strcmp(x->name, y->name);
+}
+
+static void trace_summary(void) {
+    trace_buf_t *b;
+    trace_row_t *rows = NULL;
+    int n = 0, size = 0;
+    int i, e;
+
+    for (b = trace_bufs; b; b = b->next) {
+        for (e = 0; e < b->count; e++) {
+            trace_add_row(&rows, &n, &size, b->events[e].name, 0, b->events[e].level, b->events[e].dur);
+            trace_add_row(&rows, &n, &size, b->events[e].name, 1, b->tid, b->events[e].dur);
+        }
+    }
+    qsort(rows, n, sizeof(trace_row_t), trace_row_cmp);
+
+    fprintf(stderr, "[TRACE %d] %-10s %6s %6s %8s %12s %12s %12s\n",
+        trace_pid, "phase", "level", "thread", "calls", "total(ms)", "mean(us)", "max(us)");
+    for (i = 0; i < n; i++) {
+        fprintf(stderr, "[TRACE %d] %-10s ", trace_pid, rows[i].name);
+        if (rows[i].by_thread)
+            fprintf(stderr, "%6s %6d ", "all", rows[i].key);
+        else if (rows[i].key >= 0)
+            fprintf(stderr, "%6d %6s ", rows[i].key, "all");
+        else
+            fprintf(stderr, "%6s %6s ", "-", "all");
+        fprintf(stderr, "%8ld %12.3lf %12.3lf %12.3lf\n", rows[i].calls,
+            rows[i].total / 1e6, rows[i].total / 1e3 / rows[i].calls, rows[i].max / 1e3);
+    }
+
+    free(rows);
+}
+
+static void trace_dump(void) {
+    trace_buf_t *b;
+    const char *path;
+    char name[256];
+    FILE *f;
+    int e, first = 1;
+
+    path = getenv("FRAC_TRACE_FILE");
+    if (!path)
+        path = "frac_trace.json";
+    if (trace_pid)
+        snprintf(name, sizeof(name), "%s.%d", path, trace_pid);
+    else
+        snprintf(name, sizeof(name), "%s", path);
+
+    pthread_mutex_lock(&trace_mutex);
+
+    f = fopen(name, "w");
+    if (!f) {
+        perror(name);
+    } else {
+        fprintf(f, "{\"traceEvents\":[\n");
+        for (b = trace_bufs; b; b = b->next) {
+            for (e = 0; e < b->count; e++) {
+                fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%.3lf,\"dur\":%.3lf,\"args\":{\"level\":%d}}",
+                    first ? "" : ",\n", b->events[e].name, trace_pid, b->tid,
+                    b->events[e].start / 1e3, b->events[e].dur / 1e3, b->events[e].level);
+                first = 0;
+            }
+        }
+        fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        fclose(f);
+    }
+
+    trace_summary();
+
+    pthread_mutex_unlock(&trace_mutex);
+}
+
+# define TRACE_INIT(pid) trace_init(pid)
+# define TRACE_BEGIN(id) long long __trace_##id = trace_now()
+# define TRACE_END(id, name, level) trace_record(name, level, __trace_##id, trace_now())
+# define TRACE_DUMP() trace_dump()
+
+#else
+
+# define TRACE_INIT(pid) do { (void)(pid); } while (0)
+# define TRACE_BEGIN(id)
+# define TRACE_END(id, name, level) do { (void)(level); } while (0)
+# define TRACE_DUMP()
+
+#endif
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef __DIRTY_H__
+#define __DIRTY_H__
+
+/*
+ * Dirty rectangles of the screen.
+ *
+ * Whatever writes pixels to the screen adds the rectangle it changed, and
+ * dirty_flush pushes just those to the display with SDL_UpdateRects
+ * rather than flipping the whole 4096 x 4096 surface (64 MB) every time.
+ * Nothing is pushed when nothing changed, and a tile can be pushed as
+ * soon as it is drawn, so results show up as they arrive. Past DIRTY_MAX
+ * rectangles the last one grows to cover the rest.
+ */
+
+#include <SDL/SDL.h>
+
+#define DIRTY_MAX 64
+
+typedef struct {
+    SDL_Rect rects[DIRTY_MAX];
+    int n;
+} dirty_t;
+
+static void dirty_add(dirty_t *d, int x, int y, int w, int h) {
+    SDL_Rect *r;
+    int x1, y1;
+
+    if (w <= 0 || h <= 0)
+        return;
+
+    if (d->n < DIRTY_MAX) {
+        r = &d->rects[d->n++];
+        r->x = x;
+        r->y = y;
+        r->w = w;
+        r->h = h;
+        return;
+    }
+
+    r = &d->rects[DIRTY_MAX - 1];
+    x1 = r->x + r->w > x + w ? r->x + r->w : x + w;
+    y1 = r->y + r->h > y + h ? r->y + r->h : y + h;
+    r->x = r->x < x ? r->x : x;
+    r->y = r->y < y ? r->y : y;
+    r->w = x1 - r->x;
+    r->h = y1 - r->y;
+}
+
+// Pushes the rectangles added since the last flush to the display
+static void dirty_flush(dirty_t *d, SDL_Surface *screen) {
+    if (d->n)
+        SDL_UpdateRects(screen, d->n, d->rects);
+    d->n = 0;
+}
+
+#endif
@@ -3,10 +3,21 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <math.h>
 
 #include <mpi.h>
 
+#include "trace.h"
+#include "tilemap.h"
+#include "hugemem.h"
+#include "arena.h"
+#include "nodemem.h"
+#include "dirty.h"
+#include "cancel.h"
+#include "control.h"
+#include "regress.h"
+
 
 #define WIDTH 4096
 #define HEIGHT 4096
@@ -14,46 +25,97 @@
 #define MAXHEIGHT 20000
 #define BILLION  1000000000L;
 
-#define TASK_TAG 1
 #define RESULT_TAG 2
+#define PIXELS_TAG 3
+#define CONTROL_TAG 4
 
 //Fiddle with these two to make different types of landscape at different distances
 #define RANGE_CHANGE 13000
 #define REDUCTION 0.7
 
-typedef struct {
-    int v1, v2, v3, v4; // corner values
-    int x, y;  // initial matrix top left corner
-    int w;  // width
-    int h;  // height
-} Task;
+// Where the S key saves the map on screen
+#define MAP_FILE "frac_map.tmap"
+#define MAP_TILE 256
+
+// How long idle workers sleep between checks for the master's decision
+#define IDLE_POLL_NS 1000000
+
+// Seed of the map -r makes
+#define REGRESS_SEED 1
+
+// Lattice cells per rank along each side of the grid at the level where
+// ranks take over, so that blocks differ in size by at most 1 in this many
+#define BLOCK_CELLS 8
 
 typedef struct {
     int x;
     int y;
 } Point;
 
+// What -r checks: diamond-square at REGRESS_SEED. Block edges are drawn
+// along the grid the ranks form, so the map, and its golden checksum,
+// depend on the number of ranks.
+typedef struct {
+    int ranks;
+    uint64_t checksum;
+} regress_golden_t;
+
+static const regress_golden_t regress_goldens[] = {
+    { 1, 0x424870dc32bdefc5ULL },
+    { 2, 0x192690c76fa73a81ULL },
+    { 4, 0x3e695fee7b495cd7ULL },
+};
+
 
 SDL_Surface *screen;
-int heightmap[WIDTH + 1][HEIGHT + 1];
+// What changed on screen since the last update (see dirty.h)
+dirty_t dirty;
+// On huge pages (see hugemem.h), or shared by the ranks of a node (see
+// nodemem.h)
+int (*heightmap)[HEIGHT + 1];
+// On the master's node, where its node-mates colour their blocks for it
+// to copy to the screen. NULL elsewhere.
+Uint32 *frame;
 SDL_Event event;
 
 int myid, numprocs;
 
+// Whether the master makes maps without a display, for -r
+int offscreen;
+
+// Seed of the map being made, from the master
+unsigned map_seed;
+
+// Space or escape while a map is being made cancels it (see cancel.h); the
+// master tells the other ranks with a control word (see control.h).
+// map_gen is the map's number in the token.
+cancel_t cancel;
+control_t control;
+unsigned map_gen;
+
+// Channel shifts and alpha mask of the master's screen. They are broadcast
+// so that ranks without a display can colour their tiles in its format.
+int pix_format[4];
+
 static void shift_all(int amnt);
 
-static int rand_range(int low, int high) {
-    return rand() % (high - low) + low;
-}
+// The random offset of cell (x, y) in the map made from seed, in
+// [low, high). A hash of the position rather than rand(), so that ranks
+// that both draw a point draw the same one.
+static int cell_rand(unsigned seed, int x, int y, int low, int high) {
+    uint32_t v = seed ^ (uint32_t)x * 0x9e3779b1U ^ (uint32_t)y * 0x85ebca77U;
 
-static void set_point(int x, int y, int value) {
-    Uint32 *pix;
-    int offset;
+    v ^= v >> 16;
+    v *= 0x7feb352dU;
+    v ^= v >> 15;
+    v *= 0x846ca68bU;
+    v ^= v >> 16;
 
-    pix = (Uint32 *) screen->pixels;
-    offset = x + y * screen->w;
+    return (int)(v % (uint32_t)(high - low)) + low;
+}
 
-    pix[offset] = value;
+static Uint32 map_rgb(Uint8 r, Uint8 g, Uint8 b) {
+    return (r << pix_format[0]) | (g << pix_format[1]) | (b << pix_format[2]) | (Uint32)pix_format[3];
 }
 
 static Uint32 height_to_colour(int height) {
@@ -68,98 +130,210 @@ static Uint32 height_to_colour(int height) {
     value = ((float)(height - MINHEIGHT) / range) * 255;
 
     if (height < 0)
-        return SDL_MapRGB(screen->format, 0, 0, value);
-    return SDL_MapRGB(screen->format, 30, value, 30);
-    return SDL_MapRGB(screen->format, value, value, value);
+        return map_rgb(0, 0, value);
+    return map_rgb(30, value, 30);
+    return map_rgb(value, value, value);
 }
 
-static void heightmap_to_screen(void) {
+// Colours the w x h block of heightmap at (x, y) into pixels, row-major
+// with pitch pixels per row
+static void colour_block(Uint32 *pixels, int pitch, int x, int y, int w, int h) {
     int i, e;
 
-    for (e = 0; e < HEIGHT; ++e)
-        for (i = 0; i < WIDTH; ++i)
-            set_point(i, e, height_to_colour(heightmap[i][e]));
+    TRACE_BEGIN(colour);
+    for (e = 0; e < h; ++e)
+        for (i = 0; i < w; ++i)
+            pixels[e * pitch + i] = height_to_colour(heightmap[x + i][y + e]);
+    TRACE_END(colour, "colour", -1);
+}
+
+// Copies a coloured tile, pitch pixels per row, into the screen at (x, y)
+static void pixels_to_screen(Uint32 *pixels, int pitch, int x, int y, int w, int h) {
+    Uint32 *pix = (Uint32 *) screen->pixels;
+    int spitch = screen->pitch / sizeof(Uint32);
+    int e;
+
+    for (e = 0; e < h; ++e)
+        memcpy(pix + (y + e) * spitch + x, pixels + e * pitch, w * sizeof(Uint32));
+    dirty_add(&dirty, x, y, w, h);
 }
 
-static int rect_avg_heights(SDL_Rect *r) {
+// Pushes what changed on screen to the display. Without one, as for -r,
+// the rectangles are dropped.
+static void flush_screen(void) {
+    if (offscreen)
+        dirty.n = 0;
+    else
+        dirty_flush(&dirty, screen);
+}
+
+// Average of the corners of the square at (x, y) with side stride
+static int square_avg(int x, int y, int stride) {
     int total;
-    total = heightmap[r->x][r->y];
-    total += heightmap[(r->x + r->w) % WIDTH][r->y];
-    total += heightmap[r->x][r->y + r->h];
-    total += heightmap[(r->x + r->w) % WIDTH][r->y + r->h];
+
+    total = heightmap[x][y];
+    total += heightmap[x + stride][y];
+    total += heightmap[x][y + stride];
+    total += heightmap[x + stride][y + stride];
+
     return total / 4;
 }
 
-static int diam_avg_heights(SDL_Rect *r) {
+// Average of the four neighbours half away from the midpoint (x, y) of a
+// lattice line
+static int diamond_avg(int x, int y, int half) {
     int total;
-    int divisors;
 
-    divisors = 1;
-    total = 0;
+    total = heightmap[x][y - half];
+    total += heightmap[x][y + half];
+    total += heightmap[x - half][y];
+    total += heightmap[x + half][y];
+
+    return total / 4;
+}
 
-    //TOP
-    if (r->y >= 0) {
-        total += heightmap[r->x + r->w / 2][r->y];
-        divisors++;
+/*
+ * Midpoint displacement along the vertical lines at xs and the horizontal
+ * lines at ys, each across the whole map, from stride down to stride last.
+ * A line only uses points on itself, so it comes out the same whoever
+ * draws it, and the blocks it bounds need nothing from each other.
+ */
+static void draw_edges(const int *xs, int nx, const int *ys, int ny, int stride, int last,
+        float deviance, int level) {
+    int i, x, y, half;
+
+    for (; stride > last; stride /= 2) {
+        half = stride / 2;
+
+        TRACE_BEGIN(edges);
+        for (i = 0; i < nx; i++)
+            for (x = xs[i], y = half; y < HEIGHT; y += stride)
+                heightmap[x][y] = (heightmap[x][y - half] + heightmap[x][y + half]) / 2
+                    + cell_rand(map_seed, x, y, -RANGE_CHANGE, RANGE_CHANGE) * deviance;
+        for (i = 0; i < ny; i++)
+            for (y = ys[i], x = half; x < WIDTH; x += stride)
+                heightmap[x][y] = (heightmap[x - half][y] + heightmap[x + half][y]) / 2
+                    + cell_rand(map_seed, x, y, -RANGE_CHANGE, RANGE_CHANGE) * deviance;
+        TRACE_END(edges, "edges", level);
+
+        level++;
+        deviance *= REDUCTION;
     }
+}
 
-    //LEFT
-    if (r->x >= 0) {
-        total += heightmap[r->x][r->y + r->h / 2];
-        divisors++;
+/*
+ * Whether the map being made is cancelled. The master reads the keys that
+ * cancel it, space for the next map and escape to stop, and sends the
+ * other ranks the word to drop it, which they test for here. Other keys
+ * are ignored while a map is being made.
+ */
+static int cancelled(void) {
+    SDL_Event e;
+
+    if (cancel_check(&cancel, map_gen))
+        return 1;
+
+    if (myid != control.master) {
+        if (control_test(&control))
+            cancel_supersede(&cancel);
+    } else if (!offscreen) {
+        while (!cancel_check(&cancel, map_gen) && SDL_PollEvent(&e)) {
+            if (e.type == SDL_QUIT || (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_ESCAPE))
+                cancel_stop(&cancel);
+            else if (e.type == SDL_KEYDOWN && e.key.keysym.sym == SDLK_SPACE)
+                cancel_supersede(&cancel);
+        }
+        if (cancel_check(&cancel, map_gen))
+            control_send(&control, CONTROL_CANCEL);
     }
 
-    //RIGHT
-    total += heightmap[(r->x + r->w) % WIDTH][r->y + r->h / 2];
+    return cancel_check(&cancel, map_gen);
+}
 
-    //BOTTOM
-    if (r->y + r->h < HEIGHT) {
-        total += heightmap[r->x + r->w / 2][r->y + r->h];
-        divisors++;
+/*
+ * Diamond-square inside the block [x0, x1] x [y0, y1], whose lattice points
+ * at stride and whose edges down to stride last are set, down to stride
+ * last. Only cells strictly inside are written, so ranks sharing a map can
+ * draw neighbouring blocks at once. Stops between levels if the map is
+ * cancelled.
+ */
+static void draw_block(int x0, int y0, int x1, int y1, int stride, int last,
+        float *deviance, int *level) {
+    int x, y, half;
+
+    for (; stride > last && !cancelled(); stride /= 2) {
+        half = stride / 2;
+
+        TRACE_BEGIN(square);
+        for (x = x0; x < x1; x += stride)
+            for (y = y0; y < y1; y += stride)
+                heightmap[x + half][y + half] = square_avg(x, y, stride)
+                    + cell_rand(map_seed, x + half, y + half, -RANGE_CHANGE, RANGE_CHANGE) * *deviance;
+        TRACE_END(square, "square", *level);
+
+        TRACE_BEGIN(diamond);
+        for (x = x0 + stride; x < x1; x += stride)
+            for (y = y0 + half; y < y1; y += stride)
+                heightmap[x][y] = diamond_avg(x, y, half)
+                    + cell_rand(map_seed, x, y, -RANGE_CHANGE, RANGE_CHANGE) * *deviance;
+        for (x = x0 + half; x < x1; x += stride)
+            for (y = y0 + stride; y < y1; y += stride)
+                heightmap[x][y] = diamond_avg(x, y, half)
+                    + cell_rand(map_seed, x, y, -RANGE_CHANGE, RANGE_CHANGE) * *deviance;
+        TRACE_END(diamond, "diamond", *level);
+
+        (*level)++;
+        *deviance *= REDUCTION;
     }
+}
 
-    if (!divisors) {
-        puts("Floating point error in diam_avg_heights. Exiting cleanly.");
-        exit(1);
-    }
+// Splits nranks into the most square px x py grid, px >= py. A prime count
+// ends up as strips of columns, which are contiguous in the heightmap.
+static void rank_grid(int nranks, int *px, int *py) {
+    for (*py = (int)sqrt(nranks); nranks % *py; (*py)--)
+        ;
+    *px = nranks / *py;
+}
 
-    return total / divisors;
+// Stride of the level from which every rank of a px x py grid makes its own
+// block: the coarsest with BLOCK_CELLS lattice cells per rank along each
+// side, or the finest if there are too many ranks for that.
+static int split_stride(int px, int py) {
+    int stride = WIDTH;
+
+    while (stride > 2 && (WIDTH / stride < px * BLOCK_CELLS || HEIGHT / stride < py * BLOCK_CELLS))
+        stride /= 2;
+
+    return stride;
 }
 
-static void draw_all_squares(int w, int h, float deviance) {
-    SDL_Rect r;
-    r.w = w;
-    r.h = h;
+// Where the n blocks along a side of cells lattice cells at stride start,
+// and where the last one ends, into lines[0..n]
+static void grid_lines(int n, int cells, int stride, int *lines) {
+    int i;
 
-    for (r.y = 0; r.y < HEIGHT; r.y += r.h) {
-        for (r.x = 0; r.x < WIDTH; r.x += r.w) {
-            heightmap[r.x + r.w / 2][r.y + r.h / 2] =
-                rect_avg_heights(&r)
-                    + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
-        }
-    }
+    for (i = 0; i <= n; i++)
+        lines[i] = i * cells / n * stride;
 }
 
-static void draw_all_diamonds(int w, int h, float deviance) {
-    SDL_Rect r;
-    r.w = w;
-    r.h = h;
+// The block of rank in the grid: whole lattice cells of the split level,
+// shared out as evenly as they go
+static void block_of(int rank, int px, int py, int stride, int *x0, int *y0, int *w, int *h) {
+    int cx = WIDTH / stride, cy = HEIGHT / stride;
+    int bx = rank % px, by = rank / px;
 
-    for (r.y = 0 - r.h / 2; r.y < HEIGHT; r.y += r.h) {
-        for (r.x = 0; r.x < WIDTH; r.x += r.w) {
-            heightmap[r.x + r.w / 2][r.y + r.h / 2] =
-                diam_avg_heights(&r)
-                    + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
-        }
-    }
+    *x0 = bx * cx / px * stride;
+    *w = (bx + 1) * cx / px * stride - *x0;
+    *y0 = by * cy / py * stride;
+    *h = (by + 1) * cy / py * stride - *y0;
+}
 
-    for (r.y = 0; r.y < HEIGHT; r.y += r.h) {
-        for (r.x = 0 - r.w / 2; r.x + r.w / 2 < WIDTH; r.x += r.w) {
-            heightmap[r.x + r.w / 2][r.y + r.h / 2] =
-                diam_avg_heights(&r)
-                    + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
-        }
-    }
+// Save the map on screen as a tiled, compressed file
+static void save_map(void) {
+    if (tilemap_write(MAP_FILE, &heightmap[0][0], HEIGHT + 1, WIDTH, HEIGHT, MAP_TILE, sysconf(_SC_NPROCESSORS_ONLN)))
+        perror(MAP_FILE);
+    else
+        printf("[MPI] Saved %s\n", MAP_FILE);
 }
 
 static void shift_all(int amnt) {
@@ -169,167 +343,279 @@ static void shift_all(int amnt) {
             heightmap[i][e] += amnt;
 }
 
+// Shares the master's should_continue with every rank. The master may
+// wait on a key for a long time, and a blocking broadcast spins on most MPI
+// libraries, so workers test a nonblocking one and sleep in between to
+// leave their cores idle.
+static void share_decision(int *should_continue, int master) {
+    struct timespec nap = { 0, IDLE_POLL_NS };
+    MPI_Request request;
+    int done = 0;
+
+    MPI_Ibcast(should_continue, 1, MPI_INT, master, MPI_COMM_WORLD, &request);
+    if (myid == master) {
+        MPI_Wait(&request, MPI_STATUS_IGNORE);
+        return;
+    }
+
+    while (1) {
+        MPI_Test(&request, &done, MPI_STATUS_IGNORE);
+        if (done)
+            break;
+        nanosleep(&nap, NULL);
+    }
+}
+
 int main(int argc, char *argv[]) {
     const int master = 0;
-    int should_continue = 0;
-    MPI_Status stat;
+    int should_continue = 0, dropped;
+    arena_t arena = { 0 };
 
-    int w = WIDTH;
-    int h = HEIGHT;
     float deviance;
-    int i, e;
+    int i, r, level;
+    int px, py, split;
+    int x0, y0, w, h;
+    int rx, ry, rw, rh;
+    int *xs, *ys, border_x[2] = { 0, WIDTH }, border_y[2] = { 0, HEIGHT };
+
+    MPI_Comm node_comm;
+    MPI_Win node_win;
+    int node_rank, node_size, nodes, leader, *leaders;
+    size_t map_bytes = (size_t)(WIDTH + 1) * (HEIGHT + 1) * sizeof(int);
 
     struct timespec start, stop;
-    double accum;
+    double accum = 0;
+
+    const char *baseline = NULL;
+    const regress_golden_t *golden = NULL;
+    char path[256], name[64];
+    double tolerance = REGRESS_TOLERANCE, best = 0;
+    uint64_t sum, first = 0;
+    int opt, run = 0, failures = 0;
 
 
     // Start MPI
     MPI_Init(&argc, &argv);
     MPI_Comm_size(MPI_COMM_WORLD, &numprocs);
     MPI_Comm_rank(MPI_COMM_WORLD, &myid);
+    TRACE_INIT(myid);
+
+    // Every rank reads the same options, and the master tells what is wrong
+    opterr = myid == master;
+    while ((opt = getopt(argc, argv, "r:")) != -1) {
+        switch (opt) {
+        case 'r':
+            baseline = optarg;
+            if (regress_parse(baseline, path, sizeof(path), &tolerance)) {
+                if (myid == master)
+                    fprintf(stderr, "Bad regression '%s', expected baseline[:tolerance%%]\n", optarg);
+                MPI_Finalize();
+                return 1;
+            }
+            break;
+        default:
+            if (myid == master)
+                fprintf(stderr, "Usage: %s [-r baseline[:tolerance]]\n", argv[0]);
+            MPI_Finalize();
+            return 1;
+        }
+    }
+    offscreen = baseline != NULL;
+
+    // Every rank, the master too, makes one block of a grid over the map
+    rank_grid(numprocs, &px, &py);
+    split = split_stride(px, py);
+    if (WIDTH / split < px || HEIGHT / split < py) {
+        if (myid == master)
+            fprintf(stderr, "[MPI] %d ranks is more than the map has cells for\n", numprocs);
+        MPI_Finalize();
+        return 1;
+    }
+    block_of(myid, px, py, split, &x0, &y0, &w, &h);
+    xs = malloc((px + 1) * sizeof(int));
+    ys = malloc((py + 1) * sizeof(int));
+    grid_lines(px, WIDTH / split, split, xs);
+    grid_lines(py, HEIGHT / split, split, ys);
+
+    // Ranks on one node share a heightmap and write their blocks straight
+    // into it, so only blocks from other nodes travel as messages. The
+    // master is node rank 0 of its node, and the leader of every node
+    // (node rank 0) is known to all ranks.
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, myid, MPI_INFO_NULL, &node_comm);
+    MPI_Comm_rank(node_comm, &node_rank);
+    MPI_Comm_size(node_comm, &node_size);
+    leader = myid;
+    MPI_Bcast(&leader, 1, MPI_INT, 0, node_comm);
+    leaders = malloc(numprocs * sizeof(int));
+    MPI_Allgather(&leader, 1, MPI_INT, leaders, 1, MPI_INT, MPI_COMM_WORLD);
+    for (nodes = 0, r = 0; r < numprocs; r++)
+        nodes += leaders[r] == r;
+
+    // A rank alone on its node keeps a private map on huge pages. On the
+    // master's node the window also holds the frame its node-mates colour.
+    frame = NULL;
+    if (node_size > 1) {
+        heightmap = nodemem_alloc(node_comm, map_bytes
+            + (leader == master ? (size_t)WIDTH * HEIGHT * sizeof(Uint32) : 0), &node_win);
+        if (leader == master)
+            frame = (Uint32 *)((char *)heightmap + map_bytes);
+    } else {
+        heightmap = huge_alloc(map_bytes);
+    }
 
-    // Mpi Task type
-    MPI_Datatype taskType, oldtypes[1]; 
-    int blockcounts[1];
-    MPI_Aint offsets[1];
-     
-    offsets[0] = 0;
-    oldtypes[0] = MPI_INT;
-    blockcounts[0] = 8;
-
-    MPI_Type_struct(1, blockcounts, offsets, oldtypes, &taskType);
-    MPI_Type_commit(&taskType);
+    // Blocks have the same size every map, so the buffers are set up once.
+    // The master's take the largest block; smaller ones arrive short. Its
+    // node-mates send nothing.
+    if (myid == master)
+        arena_init(&arena, (WIDTH / split + px - 1) / px * split,
+            (HEIGHT / split + py - 1) / py * split, myid, master, numprocs, RESULT_TAG, PIXELS_TAG);
+    else if (leader != master)
+        arena_init(&arena, w, h, myid, master, numprocs, RESULT_TAG, PIXELS_TAG);
 
     srand(time(NULL));
 
-    // SDL Init - only master handles the I/O
-    if (myid == master) {
+    // SDL Init - only master handles the I/O. -r colours the maps all the
+    // same, into a surface of its own.
+    if (myid == master && offscreen) {
+        screen = SDL_CreateRGBSurface(SDL_SWSURFACE, WIDTH, HEIGHT, 32, 0xff0000, 0xff00, 0xff, 0);
+        if (!screen) {
+            fprintf(stderr, "SDL_CreateRGBSurface: %s\n", SDL_GetError());
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    } else if (myid == master) {
         SDL_Init(SDL_INIT_EVERYTHING);
         screen = SDL_SetVideoMode(WIDTH, HEIGHT, 32, SDL_HWSURFACE);
+        // Keys held down repeat, so [ and ] keep shifting
+        SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY, SDL_DEFAULT_REPEAT_INTERVAL);
     }
+    if (myid == master) {
+        pix_format[0] = screen->format->Rshift;
+        pix_format[1] = screen->format->Gshift;
+        pix_format[2] = screen->format->Bshift;
+        pix_format[3] = screen->format->Amask;
+
+        printf("[MPI] %d ranks in a %d x %d grid, each making its block from stride %d\n",
+            numprocs, px, py, split);
+        printf("[MPI] %d nodes, %d ranks sharing the master's map\n", nodes, node_size);
+    }
+    MPI_Bcast(pix_format, 4, MPI_INT, master, MPI_COMM_WORLD);
+    control_init(&control, myid, master, numprocs, CONTROL_TAG);
 
 
     while (1) {
-        w = WIDTH;
-        h = HEIGHT;
-
         if (myid == master) {
             clock_gettime(CLOCK_REALTIME, &start);
+            map_seed = offscreen ? REGRESS_SEED : rand();
         }
-
-        // Init heightmap for everybody
-        for (e = 0; e < HEIGHT; ++e)
-            for (i = 0; i < WIDTH; ++i)
-                heightmap[i][e] = MINHEIGHT;
-
-        if (myid == master) {
-
-            // Add our starting corner points
-            heightmap[0][0] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
-            heightmap[0][HEIGHT] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
-
-            deviance = 1.0;
-            while (h >= 2 || w >= 2) {
-                draw_all_squares(w, h, deviance);
-                draw_all_diamonds(w, h, deviance);
-
+        MPI_Bcast(&map_seed, 1, MPI_UNSIGNED, master, MPI_COMM_WORLD);
+        map_gen = cancel_begin(&cancel);
+        control_begin(&control);
+
+        // The master posts the receives of every block from other nodes
+        // before making its own, and takes them as they arrive
+        if (myid == master)
+            for (r = 0; r < numprocs; r++)
+                if (leaders[r] != master)
+                    arena_start(&arena, r);
+
+        // The leader of each node makes the coarse levels over the whole
+        // map, then every block edge down to the last level. They are a
+        // tiny part of the work, the seed makes them the same on every
+        // node, and it saves sending the lattice around. Every cell is
+        // written before it is read, so nothing needs resetting.
+        deviance = 1.0;
+        level = 0;
+        if (node_rank == 0) {
+            heightmap[0][0] = cell_rand(map_seed, 0, 0, -RANGE_CHANGE, RANGE_CHANGE);
+            heightmap[WIDTH][0] = cell_rand(map_seed, WIDTH, 0, -RANGE_CHANGE, RANGE_CHANGE);
+            heightmap[0][HEIGHT] = cell_rand(map_seed, 0, HEIGHT, -RANGE_CHANGE, RANGE_CHANGE);
+            heightmap[WIDTH][HEIGHT] = cell_rand(map_seed, WIDTH, HEIGHT, -RANGE_CHANGE, RANGE_CHANGE);
+
+            draw_edges(border_x, 2, border_y, 2, WIDTH, split, deviance, level);
+            draw_block(0, 0, WIDTH, HEIGHT, WIDTH, split, &deviance, &level);
+            draw_edges(xs, px + 1, ys, py + 1, split, 1, deviance, level);
+        } else {
+            for (i = WIDTH; i > split; i /= 2) {
+                level++;
                 deviance *= REDUCTION;
-
-                w /= 2;
-                h /= 2;
-                
-                // Divide parts of the matrix between processes after we reach the
-                // step where the matrix is split into nrprocs pieces.
-                // For calculations before this step, we do not engage into communiation
-                // with others procs to prevent useless overhead.
-                if (pow(4, (HEIGHT/  (2 * h))) == numprocs - 1) {
-                    break;
-                }
             }
         }
+        if (node_size > 1) {
+            TRACE_BEGIN(fence);
+            nodemem_fence(node_comm, node_win);
+            TRACE_END(fence, "fence", -1);
+        }
 
-        MPI_Bcast(&h, 1, MPI_INT, master, MPI_COMM_WORLD);
-        MPI_Bcast(&w, 1, MPI_INT, master, MPI_COMM_WORLD);
-        MPI_Bcast(&deviance, 1, MPI_FLOAT, master, MPI_COMM_WORLD);
-
-        //int borders[numprocs][4];
-        int *buffer = (int *) calloc(w * h, sizeof(int));
-        int H = h, W = w;
+        // Then every rank the inside of its own block. A cancelled map
+        // still makes every fence and transfer, so the messages of the
+        // next one match as ever, but nothing is coloured or shown.
+        draw_block(x0, y0, x0 + w, y0 + h, split, 1, &deviance, &level);
 
-        // Continue processing. But split work.
         if (myid == master) {
-            int proc = 1;
-
-            if (numprocs != 1) {
-                for (i = 0; i < HEIGHT; i += h) {
-                    for (e = 0; e < WIDTH; e += w) {
-
-                        if (proc > numprocs - 1) {
-                            exit(1);
-                        }
-
-                        Task t;
-                        t.v1 = heightmap[e][i];
-                        t.v2 = heightmap[e][i + h];
-                        t.v3 = heightmap[e + w][i];
-                        t.v4 = heightmap[e + w][h + w];
-                        t.x = e; t.y = i; t.w = w; t.h = h;
-
-                        // printf("Master sending to %d values = %d %d %d %d, pos = %d %d, h = %d w = %d \n", 
-                        //     proc, t.v1, t.v2, t.v3, t.v4, t.x, t.y, t.h, t.w);
-                        MPI_Send(&t, 1, taskType, proc, TASK_TAG, MPI_COMM_WORLD);
-                        proc++;
-                    }
-                }
+            if (!cancelled()) {
+                colour_block((Uint32 *) screen->pixels + y0 * (screen->pitch / 4) + x0,
+                    screen->pitch / 4, x0, y0, w, h);
+                dirty_add(&dirty, x0, y0, w, h);
             }
 
-            // Receive buffers from workers.
-            for (i = 1; i < numprocs; i++) {
-                Task t;
-                MPI_Recv(&t, 1, taskType, i, TASK_TAG, MPI_COMM_WORLD, &stat);
-                MPI_Recv(buffer, H * W, MPI_INT, i, RESULT_TAG, MPI_COMM_WORLD, &stat);
-
-                // Store them in heightmap
-                int j;
-                for (j = 0; j < W; j++) {
-                    memcpy(&heightmap[t.x + j][t.y], buffer + (j * W), W * sizeof(int));
-                }
+            // Node-mates' blocks are already in the map and their colours
+            // in the frame
+            if (node_size > 1) {
+                TRACE_BEGIN(fence);
+                nodemem_fence(node_comm, node_win);
+                TRACE_END(fence, "fence", -1);
             }
 
-        } else {
-            Task t;
-            MPI_Recv(&t, 1, taskType, master, TASK_TAG, MPI_COMM_WORLD, &stat);
-            // printf("Process %d received values = %d %d %d %d, pos = %d %d, h = %d w = %d \n", 
-            //     myid, t.v1, t.v2, t.v3, t.v4, t.x, t.y, t.h, t.w);
+            for (r = 0; r < numprocs && !cancelled(); r++) {
+                if (r == master || leaders[r] != master)
+                    continue;
+                block_of(r, px, py, split, &rx, &ry, &rw, &rh);
+                pixels_to_screen(frame + ry * WIDTH + rx, WIDTH, rx, ry, rw, rh);
+            }
+            flush_screen();
 
-            // init
-            heightmap[0][0] = t.v1;
-            heightmap[0][h] = t.v2;
-            heightmap[w][0] = t.v3;
-            heightmap[w][h] = t.v4;
+            // Then the other blocks, whichever comes first
+            while (1) {
+                TRACE_BEGIN(recv);
+                r = arena_waitany(&arena);
+                TRACE_END(recv, "mpi_recv", -1);
+                if (r < 0)
+                    break;
+                if (cancelled())
+                    continue;
+                block_of(r, px, py, split, &rx, &ry, &rw, &rh);
 
-            while (h >= 2 || w >= 2) {
-                draw_all_squares(w, h, deviance);
-                draw_all_diamonds(w, h, deviance);
+                for (i = 0; i < rw; i++)
+                    memcpy(&heightmap[rx + i][ry], arena_heights(&arena, r) + i * rh, rh * sizeof(int));
 
-                deviance *= REDUCTION;
-                w = w >> 1;
-                h = h >> 1;
+                // The worker already coloured its block
+                pixels_to_screen(arena_pixels(&arena, r), rw, rx, ry, rw, rh);
+                flush_screen();
             }
-
-            for (i = 0; i < W; i++) {
-                memcpy(buffer + (i * H), &heightmap[i][0], H * sizeof(int));
+        } else if (leader == master) {
+            if (!cancelled())
+                colour_block(frame + y0 * WIDTH + x0, WIDTH, x0, y0, w, h);
+            nodemem_fence(node_comm, node_win);
+        } else {
+            if (!cancelled()) {
+                for (i = 0; i < w; i++)
+                    memcpy(arena.heights + i * h, &heightmap[x0 + i][y0], h * sizeof(int));
+                colour_block(arena.pixels, w, x0, y0, w, h);
             }
 
-            // Send the buffer to master
-            MPI_Send(&t, 1, taskType, master, TASK_TAG, MPI_COMM_WORLD);
-            MPI_Send (buffer, H * W, MPI_INT, master, RESULT_TAG, MPI_COMM_WORLD);
+            // Send the block to master
+            TRACE_BEGIN(send);
+            arena_transfer(&arena, master);
+            TRACE_END(send, "mpi_send", -1);
         }
 
+        dropped = control_end(&control);
+
+        TRACE_BEGIN(wait);
         MPI_Barrier(MPI_COMM_WORLD);
-        free(buffer);
+        TRACE_END(wait, "barrier", -1);
 
-        if (myid == master) {
+        if (myid == master && !dropped) {
             clock_gettime(CLOCK_REALTIME, &stop);
 
             accum = ( stop.tv_sec - start.tv_sec )
@@ -338,15 +624,31 @@ int main(int argc, char *argv[]) {
             printf("[MPI] Overall time on key pressed event: %lf\n", accum);
         }
 
-        if (myid == master) {
-            heightmap_to_screen();
-            SDL_Flip(screen);
-
-            while (1) {
-                SDL_PollEvent(&event);
+        if (myid == master && offscreen) {
+            // -r makes REGRESS_RUNS maps, which must all be the same, and
+            // keeps the best time
+            sum = regress_checksum(&heightmap[0][0], HEIGHT + 1, WIDTH, HEIGHT);
+            if (run == 0)
+                first = sum;
+            else if (sum != first)
+                failures++;
+            if (run == 0 || accum < best)
+                best = accum;
+            should_continue = ++run < REGRESS_RUNS;
+        } else if (myid == master && dropped) {
+            // The key that cancelled the map says what to do next
+            should_continue = !cancel.stop;
+        } else if (myid == master) {
+            // Every block went to the display as it was drawn. Sleep until
+            // a key says what to do next.
+            should_continue = 0;
+            while (SDL_WaitEvent(&event)) {
+                if (event.type == SDL_QUIT)
+                    break;
+                if (event.type != SDL_KEYDOWN)
+                    continue;
 
                 if (event.key.keysym.sym == SDLK_ESCAPE) {
-                    should_continue = 0;
                     break;
                 }
                 else if (event.key.keysym.sym == SDLK_RIGHTBRACKET) {
@@ -355,6 +657,9 @@ int main(int argc, char *argv[]) {
                 else if (event.key.keysym.sym == SDLK_LEFTBRACKET) {
                     shift_all(-200);
                 }
+                else if (event.key.keysym.sym == SDLK_s) {
+                    save_map();
+                }
                 else if (event.key.keysym.sym == SDLK_SPACE) {
                     should_continue = 1;
                     break;
@@ -365,21 +670,55 @@ int main(int argc, char *argv[]) {
         //printf("Process %d waiting on should_continue\n", myid);
         
         // Find out from master if the program should close or create another map.
-        MPI_Bcast(&should_continue, 1, MPI_INT, master, MPI_COMM_WORLD);
+        share_decision(&should_continue, master);
 
         if (!should_continue) {
             break;
         }
     }
 
+    if (myid == master && offscreen) {
+        for (i = 0; i < (int)(sizeof(regress_goldens) / sizeof(regress_goldens[0])); i++)
+            if (regress_goldens[i].ranks == numprocs)
+                golden = &regress_goldens[i];
+
+        snprintf(name, sizeof(name), "diamond@%d", numprocs);
+        if (failures) {
+            printf("[MPI] Regress %s: runs made different maps FAIL\n", name);
+        } else if (!golden) {
+            printf("[MPI] Regress %s: no golden checksum for %d ranks, only for", name, numprocs);
+            for (i = 0; i < (int)(sizeof(regress_goldens) / sizeof(regress_goldens[0])); i++)
+                printf(" %d", regress_goldens[i].ranks);
+            printf(" FAIL\n");
+            failures++;
+        } else {
+            failures += regress_check(path, tolerance, "[MPI]", "mpi", name,
+                WIDTH, HEIGHT, golden->checksum, first, best);
+        }
+        printf("[MPI] Regression: %d ranks, %d failure%s\n", numprocs, failures,
+            failures == 1 ? "" : "s");
+    }
+
+    TRACE_DUMP();
+
     // All work done
     // Master closes I/O
     if (myid == master) {
         SDL_FreeSurface(screen);
         SDL_Quit();
     }
+    arena_free(&arena);
+    control_free(&control);
+    if (node_size > 1)
+        nodemem_free(&node_win);
+    else
+        huge_free(heightmap, map_bytes);
+    MPI_Comm_free(&node_comm);
+    free(leaders);
+    free(xs);
+    free(ys);
 
     MPI_Finalize();
 
-    return 0;
+    return failures ? 1 : 0;
 }
@@ -0,0 +1,53 @@
+#ifndef __NODEMEM_H__
+#define __NODEMEM_H__
+
+/*
+ * Memory shared by the ranks of one node.
+ *
+ * nodemem_alloc puts size bytes in an MPI-3 shared memory window owned by
+ * rank 0 of a node communicator (from MPI_Comm_split_type with
+ * MPI_COMM_TYPE_SHARED) and returns its address in every rank of it, so
+ * ranks on one node keep one copy of their data and read each other's
+ * results with plain loads instead of messages. The window stays in a
+ * passive epoch for its whole life; nodemem_fence is the point at which
+ * stores made by any rank of the node become visible to all of them.
+ */
+
+#include <stdio.h>
+#include <mpi.h>
+
+/*
+ * Collective over comm: allocates size bytes (as given on rank 0) and
+ * returns them in every rank, with the window in *win. Aborts on failure.
+ */
+static void *nodemem_alloc(MPI_Comm comm, size_t size, MPI_Win *win) {
+    MPI_Aint bytes;
+    void *base, *p;
+    int rank, disp;
+
+    MPI_Comm_rank(comm, &rank);
+    if (MPI_Win_allocate_shared(rank == 0 ? (MPI_Aint)size : 0, 1, MPI_INFO_NULL, comm, &base, win)
+            != MPI_SUCCESS) {
+        fprintf(stderr, "MPI_Win_allocate_shared of %zu bytes failed\n", size);
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Win_shared_query(*win, 0, &bytes, &disp, &p);
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, *win);
+
+    return p;
+}
+
+static void nodemem_free(MPI_Win *win) {
+    MPI_Win_unlock_all(*win);
+    MPI_Win_free(win);
+}
+
+// Collective over comm: everything any rank stored in win before the call
+// is seen by every rank after it
+static void nodemem_fence(MPI_Comm comm, MPI_Win win) {
+    MPI_Win_sync(win);
+    MPI_Barrier(comm);
+    MPI_Win_sync(win);
+}
+
+#endif
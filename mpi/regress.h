@@ -0,0 +1,142 @@
+#ifndef __REGRESS_H__
+#define __REGRESS_H__
+
+/*
+ * Regression checks: golden checksums and timing baselines.
+ *
+ * Every program runs the same cases (an engine, erosion, a pipeline and a
+ * fixed seed) and hands each heightmap's checksum and best time to
+ * regress_check. The checksum must match the case's golden one, which is
+ * part of the case, so a change to the map fails on any checkout. Only
+ * the times, which mean something on the machine that recorded them, go in
+ * a baseline file of lines
+ *
+ *   <program> <case> <width>x<height> <seconds>
+ *
+ * The time may be at most the tolerance slower than the baseline's. A
+ * case with no line yet has its time appended to the file instead, so the
+ * first run on a machine records it; delete a line (or the file) to record
+ * it again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define REGRESS_RUNS 3
+#define REGRESS_TOLERANCE 10.0
+
+typedef struct {
+    const char *name;
+    int engine;
+    const char *erode;   // as for -e, "0" for none
+    const char *post;    // as for -p, "" for none
+    unsigned seed;
+    uint64_t checksum;   // golden, of a WIDTH x HEIGHT map
+} regress_case_t;
+
+/*
+ * Parses "file[:tolerance]", the tolerance in percent, into path (at most
+ * size bytes) and *tolerance. Returns 0 on success, -1 on a malformed spec.
+ */
+static int regress_parse(const char *spec, char *path, size_t size, double *tolerance) {
+    const char *colon = strrchr(spec, ':');
+    char *end;
+    size_t len;
+
+    *tolerance = REGRESS_TOLERANCE;
+    len = colon ? (size_t)(colon - spec) : strlen(spec);
+    if (len == 0 || len >= size)
+        return -1;
+    memcpy(path, spec, len);
+    path[len] = '\0';
+
+    if (colon) {
+        *tolerance = strtod(colon + 1, &end);
+        if (end == colon + 1 || *end || *tolerance < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+// FNV-1a over the width x height map, stored column by column
+static uint64_t regress_checksum(const int *map, int stride, int width, int height) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint32_t v;
+    int x, y, b;
+
+    for (x = 0; x < width; x++) {
+        for (y = 0; y < height; y++) {
+            v = (uint32_t)map[(size_t)x * stride + y];
+            for (b = 0; b < 4; b++) {
+                h ^= (v >> (8 * b)) & 0xff;
+                h *= 0x100000001b3ULL;
+            }
+        }
+    }
+
+    return h;
+}
+
+/*
+ * Checks a case's checksum against golden and its time against the
+ * baseline file path, and prints the verdict after tag. Returns 0 if it
+ * passed, 1 if it failed. A missing time is recorded, which passes.
+ */
+static int regress_check(const char *path, double tolerance, const char *tag,
+        const char *program, const char *name, int width, int height,
+        uint64_t golden, uint64_t sum, double seconds) {
+    char line[256], p[64], n[64], extra;
+    double base;
+    int w, h, failed = 0;
+    FILE *f;
+
+    printf("%s Regress %s: checksum %016llx", tag, name, (unsigned long long)sum);
+    if (sum == golden) {
+        printf(" ok");
+    } else {
+        printf(" expected %016llx FAIL", (unsigned long long)golden);
+        failed = 1;
+    }
+
+    // Lines with anything after the time are from before the checksums
+    // moved into the cases, and are skipped
+    f = fopen(path, "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%63s %63s %dx%d %lf %c", p, n, &w, &h, &base, &extra) != 5)
+            continue;
+        if (strcmp(p, program) || strcmp(n, name) || w != width || h != height)
+            continue;
+
+        fclose(f);
+
+        printf(", %lf s against %lf s (%+.1lf%%)", seconds, base, (seconds / base - 1) * 100);
+        if (seconds > base * (1 + tolerance / 100)) {
+            printf(" FAIL\n");
+            failed = 1;
+        } else {
+            printf(" ok\n");
+        }
+
+        return failed;
+    }
+    if (f)
+        fclose(f);
+
+    f = fopen(path, "a");
+    if (!f) {
+        printf("\n");
+        perror(path);
+        return 1;
+    }
+    fprintf(f, "%s %s %dx%d %lf\n", program, name, width, height, seconds);
+    fclose(f);
+
+    printf(", %lf s recorded\n", seconds);
+
+    return failed;
+}
+
+#endif
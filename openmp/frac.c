@@ -1,10 +1,30 @@
+// For CPU affinity
+#define _GNU_SOURCE
+
 #include <SDL/SDL.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <omp.h>
 
+#include "errors.h"
+#include <pthread.h>
+#include "trace.h"
+#include "tilemap.h"
+#include "perf.h"
+#include "shade.h"
+#include "post.h"
+#include "erode.h"
+#include "affinity.h"
+#include "hugemem.h"
+#include "noise.h"
+#include "regress.h"
+#include "dirty.h"
+#include "mip.h"
+#include "tune.h"
+#include "cancel.h"
 
 #define WIDTH 4096 
 #define HEIGHT 4096
@@ -12,38 +32,165 @@
 #define MAXHEIGHT 20000
 #define BILLION  1000000000L;
 
+// Defaults for the team size and the fused tiles below, unless -a has
+// tuned them for this host (see tune.h)
 #define NUM_THREADS 4
 
 //Fiddle with these two to make different types of landscape at different distances
 #define RANGE_CHANGE 13000
 #define REDUCTION 0.7
 
+// Terrain engines, picked with -g. The noise engine's first octave has a
+// lattice point every NOISE_PERIOD cells.
+#define ENGINE_DIAMOND 0
+#define ENGINE_NOISE 1
+#define ENGINES 2
+#define NOISE_PERIOD 1024
+#define NOISE_AMPLITUDE (RANGE_CHANGE * 1.5f)
+
+// Where the S key saves the map on screen
+#define MAP_FILE "frac_map.tmap"
+#define MAP_TILE 256
+
+// SDL_USEREVENT code the generator posts when a map is ready
+#define EVENT_MAP_READY 1
+
+// Diamond-square levels from FUSE_STRIDE down run inside FUSE_TILE square
+// tiles rather than as whole-map sweeps (-f sets the stride, 0 turns it
+// off). A tile, its halo and its finer levels stay in L2.
+#define FUSE_STRIDE 32
+#define FUSE_TILE 128
+
 typedef struct {
     int x;
     int y;
 } Point;
 
 SDL_Surface *screen;
-int heightmap[WIDTH + 1][HEIGHT + 1];
+// What changed on screen since the last update (see dirty.h)
+dirty_t dirty;
 SDL_Event event;
 
+// Double buffering: make_map always fills heightmap while the map in front
+// is on screen. A background thread prepares the next map and its pixels in
+// back_surface; showing it swaps the two heightmap pointers. Post-processing
+// writes into spare and swaps it with heightmap. The maps and the
+// off-screen pixels are on huge pages (see hugemem.h).
+int (*heightmaps)[WIDTH + 1][HEIGHT + 1];
+int (*heightmap)[HEIGHT + 1];
+int (*front)[HEIGHT + 1];
+int (*spare)[HEIGHT + 1];
+int heightmaps_kind;
+SDL_Surface *back_surface;
+
+// Pyramids of heightmap and front down to the level on screen, which is
+// 2^zoom times smaller than the map (-z). They swap along with the maps.
+mip_t mips[2];
+mip_t *mip = &mips[0], *front_mip = &mips[1];
+int zoom;
+
+pthread_mutex_t swap_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t swap_cv = PTHREAD_COND_INITIALIZER;
+int next_ready, stop_signal;
+double next_time;
+
+// Escape drops the map the generator is making (see cancel.h)
+cancel_t cancel;
+
+// Set by space until a map is on screen, and when space was pressed
+int want_map;
+struct timespec want_time;
+
+// How maps are drawn (H cycles through them); next_mode is the mode
+// back_surface was drawn in
+int shade_mode = SHADE_FLAT;
+int next_mode;
+
+// Stages run over every new map, set with -p
+post_pipeline_t post;
+
+// Droplets run over every new map before post-processing, set with -e
+erode_params_t erosion;
+
+static const char *engine_names[ENGINES] = { "diamond", "noise" };
+int engine = ENGINE_DIAMOND;
+
+int threads = NUM_THREADS;
+int fuse_stride = FUSE_STRIDE;
+int fuse_size = FUSE_TILE;
+
+// Maps each configuration is timed over with -a
+int tune_maps;
+
+// What -r checks: every engine alone, then diamond-square through the rest
+// of the pipeline, each with the checksum every build must make
+static const regress_case_t regress_cases[] = {
+    { "diamond", ENGINE_DIAMOND, "0", "", 1, 0x76d98ab6450dcb5bULL },
+    { "noise", ENGINE_NOISE, "0", "", 2, 0xfaa7e67d3b9dbf9fULL },
+    { "pipeline", ENGINE_DIAMOND, "200000:3", "blur:2,thermal:4,terrace:12", 3, 0x01e7ba0abec14f87ULL },
+};
+
 static void shift_all(int amnt);
 
-static int rand_range(int low, int high) {
-    return rand() % (high - low) + low;
+// The random offset of cell (x, y) in the map made from seed, in
+// [low, high). A hash of the position rather than rand(), so that a seed
+// always gives the same map, whoever computes which cells in which order.
+static int cell_rand(unsigned seed, int x, int y, int low, int high) {
+    uint32_t v = seed ^ (uint32_t)x * 0x9e3779b1U ^ (uint32_t)y * 0x85ebca77U;
+
+    v ^= v >> 16;
+    v *= 0x7feb352dU;
+    v ^= v >> 15;
+    v *= 0x846ca68bU;
+    v ^= v >> 16;
+
+    return (int)(v % (uint32_t)(high - low)) + low;
+}
+
+static void alloc_heightmaps(void) {
+    heightmaps = huge_alloc(3 * sizeof(heightmaps[0]));
+    heightmaps_kind = huge_kind;
+    heightmap = heightmaps[0];
+    front = heightmaps[1];
+    spare = heightmaps[2];
+    mip_init(&mips[0], WIDTH, HEIGHT, HEIGHT + 1, zoom + 1);
+    mip_init(&mips[1], WIDTH, HEIGHT, HEIGHT + 1, zoom + 1);
+}
+
+// A w x h off-screen surface with its pixels on huge pages. SDL leaves
+// pixels it was given alone, so free_surface unmaps them.
+static SDL_Surface *create_surface(int w, int h, Uint32 rmask, Uint32 gmask, Uint32 bmask) {
+    SDL_Surface *s;
+
+    s = SDL_CreateRGBSurfaceFrom(huge_alloc((size_t)w * h * 4), w, h, 32,
+        w * 4, rmask, gmask, bmask, 0);
+    if (!s) {
+        fprintf(stderr, "SDL_CreateRGBSurfaceFrom: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    return s;
 }
 
-static void set_point(int x, int y, int value) {
+static void free_surface(SDL_Surface *s) {
+    void *pixels = s->pixels;
+    size_t bytes = (size_t)s->w * s->h * 4;
+
+    SDL_FreeSurface(s);
+    huge_free(pixels, bytes);
+}
+
+static void set_point(SDL_Surface *s, int x, int y, Uint32 value) {
     Uint32 *pix;
     int offset;
 
-    pix = (Uint32 *)screen->pixels;
-    offset = x + y * screen->w;
+    pix = (Uint32 *)s->pixels;
+    offset = x + y * s->w;
 
     pix[offset] = value;
 }
 
-static Uint32 height_to_colour(int height) {
+static Uint32 height_to_colour(int height, SDL_Surface *s) {
     int value;
     int range;
 
@@ -55,21 +202,79 @@ static Uint32 height_to_colour(int height) {
     value = ((float)(height - MINHEIGHT) / range) * 255;
 
     if (height < 0)
-        return SDL_MapRGB(screen->format, 0, 0, value);
-    return SDL_MapRGB(screen->format, 30, value, 30);
-    return SDL_MapRGB(screen->format, value, value, value);
+        return SDL_MapRGB(s->format, 0, 0, value);
+    return SDL_MapRGB(s->format, 30, value, 30);
+    return SDL_MapRGB(s->format, value, value, value);
+}
+
+// Pins the calling thread of a parallel region to the cpu of its thread
+// number. Teams keep their threads, so this only costs a call once.
+static void pin_team_thread(void) {
+    static __thread int pinned = -1;
+    int id = omp_get_thread_num();
+
+    if (pinned != id) {
+        affinity_pin(id);
+        pinned = id;
+    }
+}
+
+// Builds the pyramid of heightmap down to the level on screen. Called from
+// inside a parallel region: the columns of each level are shared out, and
+// the barrier at the end of a level orders it before the next.
+static void build_mip(void) {
+    int k, x;
+
+    #pragma omp single
+    mip_attach(mip, &heightmap[0][0]);
+    for (k = 1; k < mip->levels; k++) {
+        #pragma omp for
+        for (x = 0; x < mip->w[k]; x++)
+            mip_reduce(mip, k, x, x + 1);
+    }
+}
+
+// Draws the level of pyramid m that is as wide as s in the given mode.
+// Called from inside a parallel region: the rows or column strips are
+// shared out between the threads.
+static void colour_surface(mip_t *m, SDL_Surface *s, int mode) {
+    shade_format_t f;
+    int i, e;
+    int level = mip_level_for(m, s->w);
+    const int *map = m->data[level];
+    int stride = m->stride[level], w = m->w[level], h = m->h[level];
+
+    if (mode != SHADE_FLAT) {
+        f.rshift = s->format->Rshift;
+        f.gshift = s->format->Gshift;
+        f.bshift = s->format->Bshift;
+        f.amask = s->format->Amask;
+        f.minheight = MINHEIGHT;
+        f.maxheight = MAXHEIGHT;
+        f.cell = 1 << level;
+
+        #pragma omp for nowait
+        for (i = 0; i < w; i += SHADE_STRIP)
+            shade_columns(map, stride, w, h, s->pixels, s->pitch / 4,
+                i, i + SHADE_STRIP < w ? i + SHADE_STRIP : w, mode, &f);
+    } else {
+        #pragma omp for nowait
+        for (e = 0; e < h; ++e)
+            for (i = 0; i < w; ++i)
+                set_point(s, i, e, height_to_colour(map[(size_t)i * stride + e], s));
+    }
 }
 
-static int rect_avg_heights(SDL_Rect *r) {
+static int rect_avg_heights(int (*map)[HEIGHT + 1], SDL_Rect *r) {
     int total;
-    total = heightmap[r->x][r->y];
-    total += heightmap[(r->x + r->w) % WIDTH][r->y];
-    total += heightmap[r->x][r->y + r->h];
-    total += heightmap[(r->x + r->w) % WIDTH][r->y + r->h];
+    total = map[r->x][r->y];
+    total += map[(r->x + r->w) % WIDTH][r->y];
+    total += map[r->x][r->y + r->h];
+    total += map[(r->x + r->w) % WIDTH][r->y + r->h];
     return total / 4;
 }
 
-static int diam_avg_heights(SDL_Rect *r) {
+static int diam_avg_heights(int (*map)[HEIGHT + 1], SDL_Rect *r) {
     int total;
     int divisors;
 
@@ -78,20 +283,20 @@ static int diam_avg_heights(SDL_Rect *r) {
 
     //TOP
     if (r->y >= 0) {
-        total += heightmap[r->x + r->w / 2][r->y];
+        total += map[r->x + r->w / 2][r->y];
         divisors++;
     }
     //LEFT
     if (r->x >= 0) {
-        total += heightmap[r->x][r->y + r->h / 2];
+        total += map[r->x][r->y + r->h / 2];
         divisors++;
     }
     //RIGHT
-    total += heightmap[(r->x + r->w) % WIDTH][r->y + r->h / 2];
+    total += map[(r->x + r->w) % WIDTH][r->y + r->h / 2];
 
     //BOTTOM
     if (r->y + r->h < HEIGHT) {
-        total += heightmap[r->x + r->w / 2][r->y + r->h];
+        total += map[r->x + r->w / 2][r->y + r->h];
         divisors++;
     }
 
@@ -103,14 +308,140 @@ static int diam_avg_heights(SDL_Rect *r) {
     return total / divisors;
 }
 
+// The first p >= lo with p % stride == offset
+static int fuse_first(int lo, int offset, int stride) {
+    return lo + ((offset - lo) % stride + stride) % stride;
+}
+
+/*
+ * Makes the levels from stride down of the fuse_size tile at (x0, y0) in
+ * buf, then writes back the cells the tile owns; the lattice at stride
+ * must be done. buf holds the tile and a halo of one lattice cell around
+ * it (clipped to the map, and wrapped onto column 0 past the right edge),
+ * as (fuse_size + 2 * stride + 1)^2 cells column by column. The halo is
+ * made again by every tile that needs it, shrinking by one stride per
+ * level, so tiles only read lattice points, which no tile writes. Every
+ * cell comes out as the level by level sweep in make_map makes it: the
+ * same averages, edge rules and wrap. If s is not NULL the tile's cells
+ * are also coloured into it, flat, as they are written back, so the map
+ * need not be read again to draw it.
+ */
+static void fuse_tile(int *buf, int x0, int y0, int stride, float deviance, unsigned seed,
+        SDL_Surface *s) {
+    const int bw = fuse_size + 2 * stride + 1;
+    int bx0 = x0 - stride > 0 ? x0 - stride : 0;
+    int by0 = y0 - stride > 0 ? y0 - stride : 0;
+    int bx1 = x0 + fuse_size + stride;
+    int by1 = y0 + fuse_size + stride < HEIGHT ? y0 + fuse_size + stride : HEIGHT;
+    int x1 = x0 + fuse_size - 1;
+    int y1 = y0 + fuse_size == HEIGHT ? HEIGHT : y0 + fuse_size - 1;
+    int valid = 2 * stride - 2;
+    int step, half, m, x, y, lo_x, hi_x, lo_y, hi_y, total, divisors, v;
+
+// Cell (x, y) of the map in buf; x may run past WIDTH into the wrap
+#define B(x, y) buf[((x) - bx0) * bw + ((y) - by0)]
+
+    for (x = fuse_first(bx0, 0, stride); x <= bx1; x += stride)
+        for (y = fuse_first(by0, 0, stride); y <= by1; y += stride)
+            B(x, y) = heightmap[x % WIDTH][y];
+
+    for (step = stride; step >= 2; step >>= 1) {
+        half = step >> 1;
+
+        // Square centres
+        m = valid - half < stride ? valid - half : stride;
+        lo_x = x0 - m > bx0 + half ? x0 - m : bx0 + half;
+        hi_x = x1 + m < bx1 - half ? x1 + m : bx1 - half;
+        lo_y = y0 - m > by0 + half ? y0 - m : by0 + half;
+        hi_y = y1 + m < by1 - half ? y1 + m : by1 - half;
+        for (x = fuse_first(lo_x, half, step); x <= hi_x; x += step)
+            for (y = fuse_first(lo_y, half, step); y <= hi_y; y += step)
+                B(x, y) = (B(x - half, y - half) + B(x + half, y - half)
+                    + B(x - half, y + half) + B(x + half, y + half)) / 4
+                    + cell_rand(seed, x % WIDTH, y, -RANGE_CHANGE, RANGE_CHANGE) * deviance;
+
+        // Midpoints of the lattice lines, rows then columns. Left and right
+        // are always there; top and bottom only inside the map, and left
+        // of a column only past column 0.
+        m = valid - step < stride ? valid - step : stride;
+        lo_x = x0 - m > bx0 + half ? x0 - m : bx0 + half;
+        hi_x = x1 + m < bx1 - half ? x1 + m : bx1 - half;
+        lo_y = y0 - m > by0 ? y0 - m : by0;
+        hi_y = y1 + m < by1 ? y1 + m : by1;
+        for (x = fuse_first(lo_x, half, step); x <= hi_x; x += step) {
+            for (y = fuse_first(lo_y, 0, step); y <= hi_y; y += step) {
+                total = B(x - half, y) + B(x + half, y);
+                divisors = 2;
+                if (y - half >= 0) {
+                    total += B(x, y - half);
+                    divisors++;
+                }
+                if (y + half < HEIGHT) {
+                    total += B(x, y + half);
+                    divisors++;
+                }
+                B(x, y) = total / divisors
+                    + cell_rand(seed, x % WIDTH, y, -RANGE_CHANGE, RANGE_CHANGE) * deviance;
+            }
+        }
+
+        lo_x = x0 - m > bx0 ? x0 - m : bx0;
+        hi_x = x1 + m < bx1 - half ? x1 + m : bx1 - half;
+        lo_y = y0 - m > by0 + half ? y0 - m : by0 + half;
+        hi_y = y1 + m < by1 - half ? y1 + m : by1 - half;
+        for (x = fuse_first(lo_x, 0, step); x <= hi_x; x += step) {
+            for (y = fuse_first(lo_y, half, step); y <= hi_y; y += step) {
+                total = B(x, y - half) + B(x + half, y);
+                divisors = 2;
+                if (x % WIDTH > 0) {
+                    total += B(x - half, y);
+                    divisors++;
+                }
+                if (y + half < HEIGHT) {
+                    total += B(x, y + half);
+                    divisors++;
+                }
+                B(x, y) = total / divisors
+                    + cell_rand(seed, x % WIDTH, y, -RANGE_CHANGE, RANGE_CHANGE) * deviance;
+            }
+        }
+
+        deviance *= REDUCTION;
+        valid -= step;
+    }
+
+    for (x = x0; x <= x1; x++) {
+        for (y = y0; y <= y1; y++) {
+            v = B(x, y);
+            if (x % stride || y % stride)
+                heightmap[x][y] = v;
+            if (s && y < HEIGHT)
+                set_point(s, x, y, height_to_colour(v, s));
+        }
+    }
+
+#undef B
+}
+
+// Save the map on screen as a tiled, compressed file
+static void save_map(void) {
+    if (tilemap_write(MAP_FILE, &front[0][0], HEIGHT + 1, WIDTH, HEIGHT, MAP_TILE, threads))
+        perror(MAP_FILE);
+    else
+        printf("[OPENMP] Saved %s\n", MAP_FILE);
+}
+
 static void shift_all(int amnt) {
     int i, e;
     for (e = 0; e < HEIGHT; ++e)
         for (i = 0; i < WIDTH; ++i)
-            heightmap[i][e] += amnt;
+            front[i][e] += amnt;
+    mip_shift(front_mip, amnt);
 }
 
-static void make_map(void) {
+// Fills heightmap and draws it into s, if s is not NULL. Returns the time
+// it took, or -1 if the map was cancelled, which leaves it half made.
+static double make_map(SDL_Surface *s, int mode, unsigned seed) {
     register int w = WIDTH;
     register int h = HEIGHT;
     register float deviance;
@@ -118,181 +449,867 @@ static void make_map(void) {
 
     //register int id = omp_get_thread_num();
 
-    struct timespec start, stop; //start1, stop1, start12, stop12;
+    struct timespec start, stop;
     double accum;
     int rx, ry;
+    int level = 0;
 
     
+    noise_params_t noise;
+
+    // Threads check the token between tiles on their own, and agree on it
+    // once a level and at the end, where the team has to take one path
+    unsigned gen = cancel_begin(&cancel);
+    int abandon = 0;
+
+    // The fused levels colour the map if they are the last to touch it
+    // and it is drawn flat at full size
+    int fuse_colour = s && mode == SHADE_FLAT && engine == ENGINE_DIAMOND && fuse_stride
+        && !erosion.droplets && !post.nstages && s->w == WIDTH;
+
     deviance = 1.0;
+    noise_init(&noise, seed, NOISE_PERIOD, REDUCTION, NOISE_AMPLITUDE);
     clock_gettime(CLOCK_REALTIME, &start);
 
-    #pragma omp parallel private(i, e, rx, ry) shared(w, h)
+    #pragma omp parallel num_threads(threads) private(i, e, rx, ry) shared(w, h)
     {
-        //Reset the whole heightmap to the minimum height
-        #pragma omp for
-        for (e = 0; e < HEIGHT; ++e)
-            for (i = 0; i < WIDTH; ++i)
-                heightmap[i][e] = MINHEIGHT;
+        perf_sample_t ps;
 
-        //Add our starting corner points
+        pin_team_thread();
 
-        #pragma omp single
-        {
-            heightmap[0][0] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
-            heightmap[0][HEIGHT] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
-            heightmap[WIDTH][0] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
-            heightmap[WIDTH][HEIGHT] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
-        }
-        
-        while(w >= 2 || h >= 2) {
-               
-            // Diamond step 
-            // clock_gettime(CLOCK_REALTIME, &start12);
-            
-            #pragma omp sections nowait
+        if (engine == ENGINE_NOISE) {
+            // Every cell is independent: no reset and no barriers until
+            // the map is done. Same column bands as the reset and shading.
+            TRACE_BEGIN(noise);
+            perf_begin(&ps);
+            #pragma omp for schedule(static)
+            for (i = 0; i < WIDTH + 1; ++i)
+                if (!cancel_check(&cancel, gen))
+                    noise_fill(&noise, &heightmap[0][0], HEIGHT + 1, i, i + 1, 0, HEIGHT + 1);
+            perf_end(&ps, PERF_PHASE_NOISE);
+            TRACE_END(noise, "noise", -1);
+        } else {
+            //Reset the whole heightmap, edges included, to the minimum
+            //height. Threads take static bands of columns, as when shading,
+            //so on the first map each band's pages land on its thread's
+            //NUMA node.
+            TRACE_BEGIN(reset);
+            perf_begin(&ps);
+            #pragma omp for schedule(static) nowait
+            for (i = 0; i < WIDTH + 1; ++i)
+                for (e = 0; e < HEIGHT + 1; ++e)
+                    heightmap[i][e] = MINHEIGHT;
+            perf_end(&ps, PERF_PHASE_RESET);
+            TRACE_END(reset, "reset", -1);
+
+            TRACE_BEGIN(reset_wait);
+            #pragma omp barrier
+            TRACE_END(reset_wait, "barrier", -1);
+
+            //Add our starting corner points
+
+            #pragma omp single
             {
-                #pragma omp section
+                heightmap[0][0] = cell_rand(seed, 0, 0, -RANGE_CHANGE, RANGE_CHANGE);
+                heightmap[0][HEIGHT] = cell_rand(seed, 0, HEIGHT, -RANGE_CHANGE, RANGE_CHANGE);
+                heightmap[WIDTH][0] = cell_rand(seed, WIDTH, 0, -RANGE_CHANGE, RANGE_CHANGE);
+                heightmap[WIDTH][HEIGHT] = cell_rand(seed, WIDTH, HEIGHT, -RANGE_CHANGE, RANGE_CHANGE);
+            }
+        
+            while((w >= 2 || h >= 2) && w > fuse_stride && !abandon) {
+                perf_begin(&ps);
+
+                // Diamond step
+                #pragma omp sections nowait
                 {
-   
-                    for (ry = 0; ry < HEIGHT; ry += h) {
-                        for (rx = 0; rx < WIDTH; rx += w) {
-                            SDL_Rect r;
-                            r.h = h; r.w = w;
-                            r.x = rx; r.y = ry;
-                            heightmap[r.x + (r.w >> 1)][r.y + (r.h >> 1)] =
-                                rect_avg_heights(&r)
-                                    + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
+                    #pragma omp section
+                    {
+                        TRACE_BEGIN(square);
+                        for (ry = 0; ry < HEIGHT; ry += h) {
+                            for (rx = 0; rx < WIDTH; rx += w) {
+                                SDL_Rect r;
+                                r.h = h; r.w = w;
+                                r.x = rx; r.y = ry;
+                                heightmap[r.x + (r.w >> 1)][r.y + (r.h >> 1)] =
+                                    rect_avg_heights(heightmap, &r)
+                                        + cell_rand(seed, r.x + (r.w >> 1), r.y + (r.h >> 1), -RANGE_CHANGE, RANGE_CHANGE) * deviance;
+                            }
                         }
+                        TRACE_END(square, "square", level);
+                   }
+
+                    #pragma omp section
+                    {
+                        TRACE_BEGIN(square);
+                        for (ry = HEIGHT / 2; ry < HEIGHT; ry += h) {
+                            for (rx = 0 ; rx < WIDTH; rx += w) {
+                                SDL_Rect r;
+                                r.h = h; r.w = w;
+                                r.x = rx; r.y = ry;
+                                heightmap[r.x + (r.w >> 1)][r.y + (r.h >> 1)] =
+                                rect_avg_heights(heightmap, &r)
+                                    + cell_rand(seed, r.x + (r.w >> 1), r.y + (r.h >> 1), -RANGE_CHANGE, RANGE_CHANGE) * deviance;
+                            }
+                        }
+                        TRACE_END(square, "square", level);
                     }
-               }
+                }
+
+                TRACE_BEGIN(square_wait);
+                #pragma omp barrier
+                TRACE_END(square_wait, "barrier", level);
 
-                #pragma omp section
+                // Square step
+                #pragma omp sections nowait
                 {
-                    for (ry = HEIGHT / 2; ry < HEIGHT; ry += h) {
-                        for (rx = 0 ; rx < WIDTH; rx += w) {
-                            SDL_Rect r;
-                            r.h = h; r.w = w;
-                            r.x = rx; r.y = ry;
-                            heightmap[r.x + (r.w >> 1)][r.y + (r.h >> 1)] =
-                            rect_avg_heights(&r)
-                                + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
+                    #pragma omp section
+                    {
+                        TRACE_BEGIN(diamond);
+                        for (ry = 0 - (h >> 1); ry < HEIGHT; ry += h) {
+                            for (rx = 0; rx < WIDTH; rx += w) {
+                                SDL_Rect r;
+                                r.h = h; r.w = w;
+                                r.x = rx; r.y = ry;
+                                heightmap[r.x + (r.w >> 1)][r.y + (r.h >> 1)] =
+                                    diam_avg_heights(heightmap, &r)
+                                        + cell_rand(seed, r.x + (r.w >> 1), r.y + (r.h >> 1), -RANGE_CHANGE, RANGE_CHANGE) * deviance;
+                            }
                         }
+                        TRACE_END(diamond, "diamond", level);
                     }
+
+                    #pragma omp section
+                    {
+                        TRACE_BEGIN(diamond);
+                        for (ry = 0; ry < HEIGHT; ry += h) {
+                            for (rx = 0 - (w >> 1); rx < WIDTH - (w >> 1); rx += w) {
+                                SDL_Rect r;
+                                r.h = h; r.w = w;
+                                r.x = rx; r.y = ry;
+                                heightmap[r.x + (r.w >> 1)][r.y + (r.h >> 1)] =
+                                    diam_avg_heights(heightmap, &r)
+                                        + cell_rand(seed, r.x + (r.w >> 1), r.y + (r.h >> 1), -RANGE_CHANGE, RANGE_CHANGE) * deviance;
+                            }
+                        }
+                        TRACE_END(diamond, "diamond", level);
+                     }
+                 }
+
+                TRACE_BEGIN(diamond_wait);
+                #pragma omp barrier
+                TRACE_END(diamond_wait, "barrier", level);
+
+                perf_end(&ps, PERF_LEVEL(level));
+
+                #pragma omp single
+                {
+                    deviance *= REDUCTION;
+                    w = w >> 1;
+                    h = h >> 1;
+                    level++;
+                    abandon = cancel_check(&cancel, gen);
                 }
             }
-            
-            // clock_gettime(CLOCK_REALTIME, &stop12);
 
-            // accum = ( stop12.tv_sec - start12.tv_sec )
-            //     + (double)( stop12.tv_nsec - start12.tv_nsec )
-            //         / (double) BILLION;
-            // printf("[OPENMP] Diamonds: %lf\n", accum);
+            // The rest of the levels, a tile at a time. The first map
+            // touches the tiles' pages here, in the same column bands.
+            if (w >= 2 && !abandon) {
+                int t, tiles_y = HEIGHT / fuse_size;
+                int *buf = malloc((size_t)(fuse_size + 2 * w + 1) * (fuse_size + 2 * w + 1) * sizeof(int));
 
+                if (!buf) {
+                    perror("fuse tile");
+                    exit(1);
+                }
 
-            #pragma omp barrier
+                TRACE_BEGIN(fused);
+                perf_begin(&ps);
+                #pragma omp for schedule(static)
+                for (t = 0; t < (WIDTH / fuse_size) * tiles_y; t++)
+                    if (!cancel_check(&cancel, gen))
+                        fuse_tile(buf, t / tiles_y * fuse_size, t % tiles_y * fuse_size, w, deviance, seed,
+                            fuse_colour ? s : NULL);
+                perf_end(&ps, PERF_PHASE_FUSED);
+                TRACE_END(fused, "fused", level);
 
-            // clock_gettime(CLOCK_REALTIME, &start1);
+                free(buf);
+            }
+        }
 
+        // Erosion; the tiles of a round are independent, the rounds are not
+        if (erosion.droplets) {
+            int r, t;
 
-            // Square step
-            #pragma omp sections
-            {
-                #pragma omp section
-                {
-                    for (ry = 0 - (h >> 1); ry < HEIGHT; ry += h) {
-                        for (rx = 0; rx < WIDTH; rx += w) {
-                            SDL_Rect r;
-                            r.h = h; r.w = w;
-                            r.x = rx; r.y = ry;
-                            heightmap[r.x + (r.w >> 1)][r.y + (r.h >> 1)] =
-                                diam_avg_heights(&r)
-                                    + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
-                        }
-                    }
-                }
+            TRACE_BEGIN(erode);
+            perf_begin(&ps);
+            for (r = 0; r < ERODE_ROUNDS; r++) {
+                #pragma omp for schedule(dynamic)
+                for (t = 0; t < erode_tiles(WIDTH, HEIGHT); t++)
+                    if (!cancel_check(&cancel, gen))
+                        erode_tile(&erosion, &heightmap[0][0], HEIGHT + 1, WIDTH, HEIGHT, r, t);
+            }
+            perf_end(&ps, PERF_PHASE_ERODE);
+            TRACE_END(erode, "erode", -1);
+        }
 
-                #pragma omp section
-                {
-                    for (ry = 0; ry < HEIGHT; ry += h) {
-                        for (rx = 0 - (w >> 1); rx < WIDTH - (w >> 1); rx += w) {
-                            SDL_Rect r;
-                            r.h = h; r.w = w;
-                            r.x = rx; r.y = ry;
-                            heightmap[r.x + (r.w >> 1)][r.y + (r.h >> 1)] =
-                                diam_avg_heights(&r)
-                                    + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
-                        }
-                    }
-                 }
-             }
-            
-            // clock_gettime(CLOCK_REALTIME, &stop1);
-            // accum = ( stop1.tv_sec - start1.tv_sec )
-            //     + (double)( stop1.tv_nsec - start1.tv_nsec )
-            //         / (double) BILLION;
-            // printf("[OPENMP] Squares : %lf\n", accum);
+        // Post-processing; tiles are independent, so any thread takes any
+        if (post.nstages) {
+            int t;
+
+            TRACE_BEGIN(post);
+            perf_begin(&ps);
+            #pragma omp for schedule(dynamic)
+            for (t = 0; t < post_tiles(WIDTH, HEIGHT); t++)
+                if (!cancel_check(&cancel, gen))
+                    post_tile(&post, &heightmap[0][0], &spare[0][0], HEIGHT + 1, WIDTH, HEIGHT, t);
+            perf_end(&ps, PERF_PHASE_POST);
+            TRACE_END(post, "post", -1);
 
             #pragma omp single
             {
-                deviance *= REDUCTION;
-                w = w >> 1;
-                h = h >> 1;
+                int (*tmp)[HEIGHT + 1] = heightmap;
+                heightmap = spare;
+                spare = tmp;
             }
         }
 
-        // Display on screen
-        #pragma omp for
-        for (e = 0; e < HEIGHT; ++e)
-            for (i = 0; i < WIDTH; ++i)
-                set_point(i, e, height_to_colour(heightmap[i][e]));
+        // A map cancelled at any point is not drawn
+        #pragma omp single
+        abandon = cancel_check(&cancel, gen);
+
+        // Display on screen, unless the map is only wanted as data or the
+        // fused levels already drew it
+        if (s && !abandon) {
+            TRACE_BEGIN(mip);
+            build_mip();
+            TRACE_END(mip, "mip", -1);
+        }
+        if (s && !fuse_colour && !abandon) {
+            TRACE_BEGIN(colour);
+            perf_begin(&ps);
+            colour_surface(mip, s, mode);
+            perf_end(&ps, PERF_PHASE_COLOUR);
+            TRACE_END(colour, "colour", -1);
+        }
     }
 
     clock_gettime(CLOCK_REALTIME, &stop);
     accum = ( stop.tv_sec - start.tv_sec )
                 + (double)( stop.tv_nsec - start.tv_nsec )
                     / (double) BILLION;
-            printf("[OPENMP] Overall time on key pressed event: %lf\n", accum);
 
-    
-    SDL_Flip(screen);
+    return abandon ? -1 : accum;
 }
 
-int main(void) {
+// Generate maps back to back into an off-screen surface, timing each one
+// and collecting hardware counters per phase and thread
+static void benchmark(int maps) {
+    double accum, total = 0;
+    int n, screen_kind;
 
-    // Init SDL
-    srand(time(NULL));
-    SDL_Init(SDL_INIT_EVERYTHING);
-    screen = SDL_SetVideoMode(WIDTH, HEIGHT, 32, SDL_HWSURFACE);
+    screen = create_surface(WIDTH >> zoom, HEIGHT >> zoom, 0x00ff0000, 0x0000ff00, 0x000000ff);
+    screen_kind = huge_kind;
 
-    // Init openmp
-    omp_set_dynamic(0);
-    omp_set_num_threads(NUM_THREADS);
+    perf_enabled = 1;
+    for (n = 0; n < maps; n++) {
+        accum = make_map(screen, shade_mode, rand());
+        total += accum;
+        printf("[OPENMP] Map %d: %lf\n", n, accum);
+    }
+
+    printf("[OPENMP] Benchmark: %d maps, %d threads, %s, mean %lf\n", maps, threads,
+        engine_names[engine], total / maps);
+    perf_report("[OPENMP]");
+    huge_report("[OPENMP]", "Heightmaps", heightmaps, 3 * sizeof(heightmaps[0]), heightmaps_kind);
+    huge_report("[OPENMP]", "Framebuffer", screen->pixels, (size_t)screen->w * screen->h * 4, screen_kind);
+
+    free_surface(screen);
+}
+
+// Best time of tune_maps maps made and coloured with the parameters as
+// they are, or -1 if they do not go together
+static double tune_time(void) {
+    double accum, best = 0;
+    int n;
+
+    if (fuse_stride > fuse_size)
+        return -1;
+
+    for (n = 0; n < tune_maps; n++) {
+        accum = make_map(screen, shade_mode, n + 1);
+        if (n == 0 || accum < best)
+            best = accum;
+    }
+
+    return best;
+}
+
+// Searches the team size, then the fused tile size, then the stride the
+// fused levels start at, each with the best of the ones before, and saves
+// the fastest to TUNE_FILE
+static void autotune(int maps) {
+    static const int sizes[] = { 64, 128, 256 };
+    static const int strides[] = { 0, 8, 16, 32, 64, 128 };
+    int counts[TUNE_MAX_CANDIDATES];
+    tune_t t;
+    double best;
+
+    screen = create_surface(WIDTH >> zoom, HEIGHT >> zoom, 0x00ff0000, 0x0000ff00, 0x000000ff);
+    tune_maps = maps;
+
+    tune_pick("[OPENMP]", "threads", &threads, counts, tune_thread_counts(counts), tune_time);
+    tune_pick("[OPENMP]", "tile", &fuse_size, sizes, sizeof(sizes) / sizeof(sizes[0]), tune_time);
+    best = tune_pick("[OPENMP]", "stride", &fuse_stride, strides, sizeof(strides) / sizeof(strides[0]),
+        tune_time);
+
+    t.threads = threads;
+    t.cutoff = fuse_stride;
+    t.tile = fuse_size;
+    if (!tune_save(TUNE_FILE, "openmp", WIDTH, HEIGHT, &t))
+        printf("[OPENMP] Tuned: %d threads, stride %d, tile %d, %lf s a map, saved to %s\n",
+            threads, fuse_stride, fuse_size, best, TUNE_FILE);
 
-    // Make initial map
-    make_map();
+    free_surface(screen);
+}
+
+// Makes a whole map on the calling thread alone, into its own buffers. It
+// is the same map make_map makes from seed. Swaps *map and *spare if
+// post-processing leaves the map in the spare buffer.
+static void make_private_map(int (**map)[HEIGHT + 1], int (**spare)[HEIGHT + 1], unsigned seed) {
+    int (*m)[HEIGHT + 1] = *map;
+    int (*tmp)[HEIGHT + 1];
+    int w = WIDTH, h = HEIGHT;
+    float deviance = 1.0;
+    int i, e, r, t;
+    SDL_Rect rect;
+    noise_params_t noise;
+
+    if (engine == ENGINE_NOISE) {
+        noise_init(&noise, seed, NOISE_PERIOD, REDUCTION, NOISE_AMPLITUDE);
+        noise_fill(&noise, &m[0][0], HEIGHT + 1, 0, WIDTH + 1, 0, HEIGHT + 1);
+    } else {
+        for (i = 0; i < WIDTH + 1; ++i)
+            for (e = 0; e < HEIGHT + 1; ++e)
+                m[i][e] = MINHEIGHT;
+
+        m[0][0] = cell_rand(seed, 0, 0, -RANGE_CHANGE, RANGE_CHANGE);
+        m[0][HEIGHT] = cell_rand(seed, 0, HEIGHT, -RANGE_CHANGE, RANGE_CHANGE);
+        m[WIDTH][0] = cell_rand(seed, WIDTH, 0, -RANGE_CHANGE, RANGE_CHANGE);
+        m[WIDTH][HEIGHT] = cell_rand(seed, WIDTH, HEIGHT, -RANGE_CHANGE, RANGE_CHANGE);
+
+        while (w >= 2 || h >= 2) {
+            rect.w = w;
+            rect.h = h;
+
+            for (rect.y = 0; rect.y < HEIGHT; rect.y += h)
+                for (rect.x = 0; rect.x < WIDTH; rect.x += w)
+                    m[rect.x + (w >> 1)][rect.y + (h >> 1)] = rect_avg_heights(m, &rect)
+                        + cell_rand(seed, rect.x + (w >> 1), rect.y + (h >> 1), -RANGE_CHANGE, RANGE_CHANGE) * deviance;
+
+            for (rect.y = 0 - (h >> 1); rect.y < HEIGHT; rect.y += h)
+                for (rect.x = 0; rect.x < WIDTH; rect.x += w)
+                    m[rect.x + (w >> 1)][rect.y + (h >> 1)] = diam_avg_heights(m, &rect)
+                        + cell_rand(seed, rect.x + (w >> 1), rect.y + (h >> 1), -RANGE_CHANGE, RANGE_CHANGE) * deviance;
+            for (rect.y = 0; rect.y < HEIGHT; rect.y += h)
+                for (rect.x = 0 - (w >> 1); rect.x < WIDTH - (w >> 1); rect.x += w)
+                    m[rect.x + (w >> 1)][rect.y + (h >> 1)] = diam_avg_heights(m, &rect)
+                        + cell_rand(seed, rect.x + (w >> 1), rect.y + (h >> 1), -RANGE_CHANGE, RANGE_CHANGE) * deviance;
+
+            deviance *= REDUCTION;
+            w >>= 1;
+            h >>= 1;
+        }
+    }
+
+    if (erosion.droplets)
+        for (r = 0; r < ERODE_ROUNDS; r++)
+            for (t = 0; t < erode_tiles(WIDTH, HEIGHT); t++)
+                erode_tile(&erosion, &m[0][0], HEIGHT + 1, WIDTH, HEIGHT, r, t);
+
+    if (post.nstages) {
+        for (t = 0; t < post_tiles(WIDTH, HEIGHT); t++)
+            post_tile(&post, &m[0][0], &(*spare)[0][0], HEIGHT + 1, WIDTH, HEIGHT, t);
+        tmp = *map;
+        *map = *spare;
+        *spare = tmp;
+    }
+}
+
+// How many maps of a batch to make one per thread. That has no barriers
+// and no serial coarse levels, but needs every thread to have a map to
+// itself and memory for a heightmap and a spare per thread. Whatever is
+// left over is made one map at a time by all the threads.
+static int batch_plan(int maps, int threads) {
+    long long need, phys;
+
+    need = (long long)threads * 2 * sizeof(heightmaps[0]);
+    phys = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    if (need > phys / 2)
+        return 0;
+
+    return maps - maps % threads;
+}
+
+// Writes map n of a batch to <prefix><n>.tmap, if a prefix was given
+static void batch_save(const char *prefix, int n, int (*map)[HEIGHT + 1], int threads) {
+    char path[256];
+
+    if (!prefix)
+        return;
+
+    snprintf(path, sizeof(path), "%s%05d.tmap", prefix, n);
+    if (tilemap_write(path, &map[0][0], HEIGHT + 1, WIDTH, HEIGHT, MAP_TILE, threads))
+        perror(path);
+}
+
+// Generate maps as fast as possible, without drawing them, optionally
+// saving each one. Maps are seeded with the batch seed plus their number,
+// whichever way they are made.
+static void batch(int maps, const char *prefix) {
+    struct timespec start, stop;
+    double accum;
+    unsigned base = rand();
+    int inter, n;
+
+    inter = batch_plan(maps, threads);
+    clock_gettime(CLOCK_REALTIME, &start);
+
+    if (inter) {
+        #pragma omp parallel num_threads(threads) private(n)
+        {
+            int (*map)[HEIGHT + 1];
+            int (*mine)[HEIGHT + 1];
+            pin_team_thread();
+            map = huge_alloc(sizeof(heightmaps[0]));
+            mine = huge_alloc(sizeof(heightmaps[0]));
+
+            #pragma omp for schedule(dynamic)
+            for (n = 0; n < inter; n++) {
+                TRACE_BEGIN(batch_map);
+                make_private_map(&map, &mine, base + n);
+                batch_save(prefix, n, map, 1);
+                TRACE_END(batch_map, "map", -1);
+            }
+
+            huge_free(map, sizeof(heightmaps[0]));
+            huge_free(mine, sizeof(heightmaps[0]));
+        }
+    }
+
+    for (n = inter; n < maps; n++) {
+        make_map(NULL, SHADE_FLAT, base + n);
+        batch_save(prefix, n, heightmap, threads);
+    }
+
+    clock_gettime(CLOCK_REALTIME, &stop);
+    accum = ( stop.tv_sec - start.tv_sec )
+                + (double)( stop.tv_nsec - start.tv_nsec )
+                    / (double) BILLION;
+
+    printf("[OPENMP] Batch: %d maps (%d one per thread, %d across threads), %lf s, %lf maps/s\n",
+        maps, inter, maps - inter, accum, maps / accum);
+}
+
+// Wakes the event loop up with EVENT_MAP_READY. SDL_PushEvent may be
+// called from any thread.
+static void post_map_ready(void) {
+    SDL_Event e;
+
+    e.type = SDL_USEREVENT;
+    e.user.code = EVENT_MAP_READY;
+    e.user.data1 = NULL;
+    e.user.data2 = NULL;
+    if (SDL_PushEvent(&e))
+        fprintf(stderr, "SDL_PushEvent: %s\n", SDL_GetError());
+}
+
+// Background generator: fills heightmap and back_surface whenever the
+// previous map has been taken, and posts an event when it is done
+static void *generator(void *args) {
+    double accum;
+    int status;
+    int mode;
 
-    // Poll SDL
     while (1) {
-        SDL_PollEvent(&event);
+        status = pthread_mutex_lock(&swap_mutex);
+        if (status) err_abort(status, "lock mutex");
+
+        while (next_ready && !stop_signal) {
+            status = pthread_cond_wait(&swap_cv, &swap_mutex);
+            if (status) err_abort(status, "wait for condition");
+        }
+
+        mode = shade_mode;
+
+        status = pthread_mutex_unlock(&swap_mutex);
+        if (status) err_abort(status, "unlock mutex");
+
+        if (stop_signal)
+            break;
+
+        accum = make_map(back_surface, mode, rand());
+        if (accum < 0)
+            continue;
 
-        if (event.type == SDL_KEYDOWN) {
-            if (event.key.keysym.sym == SDLK_ESCAPE) {
+        status = pthread_mutex_lock(&swap_mutex);
+        if (status) err_abort(status, "lock mutex");
+
+        next_time = accum;
+        next_mode = mode;
+        next_ready = 1;
+        status = pthread_cond_broadcast(&swap_cv);
+        if (status) err_abort(status, "signal condition");
+
+        status = pthread_mutex_unlock(&swap_mutex);
+        if (status) err_abort(status, "unlock mutex");
+        post_map_ready();
+    }
+
+    return NULL;
+}
+
+// Put the prepared map on screen and let the generator start the next one.
+// Returns 0 without waiting if the generator has not finished yet.
+static int show_next_map(void) {
+    int (*tmp)[HEIGHT + 1];
+    mip_t *swap_mip;
+    int status;
+
+    status = pthread_mutex_lock(&swap_mutex);
+    if (status) err_abort(status, "lock mutex");
+
+    if (!next_ready) {
+        status = pthread_mutex_unlock(&swap_mutex);
+        if (status) err_abort(status, "unlock mutex");
+        return 0;
+    }
+
+    tmp = front;
+    front = heightmap;
+    heightmap = tmp;
+    swap_mip = front_mip;
+    front_mip = mip;
+    mip = swap_mip;
+    // The mode may have changed while the map was being made
+    if (next_mode == shade_mode) {
+        SDL_BlitSurface(back_surface, NULL, screen, NULL);
+    } else {
+        #pragma omp parallel num_threads(threads)
+        colour_surface(front_mip, screen, shade_mode);
+    }
+    printf("[OPENMP] Make_map: %lf\n", next_time);
+
+    next_ready = 0;
+    status = pthread_cond_broadcast(&swap_cv);
+    if (status) err_abort(status, "signal condition");
+
+    status = pthread_mutex_unlock(&swap_mutex);
+    if (status) err_abort(status, "unlock mutex");
+
+    dirty_add(&dirty, 0, 0, screen->w, screen->h);
+    dirty_flush(&dirty, screen);
+    return 1;
+}
+
+// Shows the next map if space asked for one and it is ready; otherwise the
+// generator's EVENT_MAP_READY calls this again
+static void take_next_map(void) {
+    struct timespec stop;
+    double accum;
+
+    if (!want_map || !show_next_map())
+        return;
+    want_map = 0;
+
+    clock_gettime(CLOCK_REALTIME, &stop);
+    accum = ( stop.tv_sec - want_time.tv_sec )
+                + (double)( stop.tv_nsec - want_time.tv_nsec )
+                    / (double) BILLION;
+    printf("[OPENMP] Overall time on key pressed event: %lf\n", accum);
+}
+
+// Switch to the next drawing mode and redraw the map on screen with it
+static void cycle_shade_mode(void) {
+    int status;
+
+    status = pthread_mutex_lock(&swap_mutex);
+    if (status) err_abort(status, "lock mutex");
+
+    shade_mode = (shade_mode + 1) % SHADE_MODES;
+
+    status = pthread_mutex_unlock(&swap_mutex);
+    if (status) err_abort(status, "unlock mutex");
+
+    #pragma omp parallel num_threads(threads)
+    colour_surface(front_mip, screen, shade_mode);
+    printf("[OPENMP] Shading: %s\n", shade_names[shade_mode]);
+    dirty_add(&dirty, 0, 0, screen->w, screen->h);
+    dirty_flush(&dirty, screen);
+}
+
+/*
+ * Makes the map of every regression case REGRESS_RUNS times, checking that
+ * they all come out the same and comparing that map's checksum and the best
+ * time against the baseline file in spec. Batch mode's single-thread map
+ * must come out the same too. Returns the number of failures.
+ */
+static int regress(const char *spec) {
+    const regress_case_t *c;
+    char path[256];
+    double tolerance, accum, best;
+    uint64_t sum, first;
+    int i, run, failures = 0;
+
+    if (regress_parse(spec, path, sizeof(path), &tolerance)) {
+        fprintf(stderr, "Bad regression '%s', expected baseline[:tolerance%%]\n", spec);
+        return 1;
+    }
+
+    for (i = 0; i < (int)(sizeof(regress_cases) / sizeof(regress_cases[0])); i++) {
+        c = &regress_cases[i];
+        engine = c->engine;
+        erode_parse(&erosion, c->erode);
+        post_parse(&post, c->post, MINHEIGHT, MAXHEIGHT);
+
+        best = 0;
+        first = 0;
+        for (run = 0; run < REGRESS_RUNS; run++) {
+            accum = make_map(NULL, SHADE_FLAT, c->seed);
+            if (run == 0 || accum < best)
+                best = accum;
+
+            sum = regress_checksum(&heightmap[0][0], HEIGHT + 1, WIDTH, HEIGHT);
+            if (run == 0) {
+                first = sum;
+            } else if (sum != first) {
+                printf("[OPENMP] Regress %s: run %d made a different map FAIL\n", c->name, run);
+                failures++;
                 break;
             }
-            else if (event.key.keysym.sym == SDLK_RIGHTBRACKET) {
-                shift_all(200);
+        }
+        if (run < REGRESS_RUNS)
+            continue;
+
+        make_private_map(&heightmap, &spare, c->seed);
+        sum = regress_checksum(&heightmap[0][0], HEIGHT + 1, WIDTH, HEIGHT);
+        if (sum != first) {
+            printf("[OPENMP] Regress %s: batch made a different map FAIL\n", c->name);
+            failures++;
+        }
+
+        failures += regress_check(path, tolerance, "[OPENMP]", "openmp", c->name,
+            WIDTH, HEIGHT, c->checksum, first, best);
+    }
+
+    printf("[OPENMP] Regression: %d threads, %d failure%s\n", threads, failures,
+        failures == 1 ? "" : "s");
+
+    return failures;
+}
+
+int main(int argc, char *argv[]) {
+    const char *prefix = NULL;
+    int batch_maps = 0;
+    int bench = 0;
+    const char *baseline = NULL;
+    int tune = 0;
+    tune_t tuned;
+    int opt;
+
+    // What -a found on this host, which the options below may override
+    if (!tune_load(TUNE_FILE, "openmp", WIDTH, HEIGHT, &tuned)
+            && tuned.threads >= 1 && tuned.threads <= omp_get_num_procs()
+            && tuned.tile >= 2 && !(tuned.tile & (tuned.tile - 1)) && tuned.tile <= HEIGHT
+            && tuned.cutoff >= 0 && tuned.cutoff <= tuned.tile && !(tuned.cutoff & (tuned.cutoff - 1))) {
+        threads = tuned.threads;
+        fuse_stride = tuned.cutoff;
+        fuse_size = tuned.tile;
+        printf("[OPENMP] Tuned: %d threads, stride %d, tile %d, from %s\n",
+            threads, fuse_stride, fuse_size, TUNE_FILE);
+    }
+
+    while ((opt = getopt(argc, argv, "a:B:b:e:f:g:m:o:p:r:z:")) != -1) {
+        switch (opt) {
+        case 'a':
+            tune = atoi(optarg);
+            break;
+        case 'B':
+            batch_maps = atoi(optarg);
+            break;
+        case 'b':
+            bench = atoi(optarg);
+            break;
+        case 'o':
+            prefix = optarg;
+            break;
+        case 'e':
+            if (erode_parse(&erosion, optarg)) {
+                fprintf(stderr, "Bad erosion '%s', expected droplets[:seed]\n", optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            fuse_stride = atoi(optarg);
+            if (fuse_stride && (fuse_stride < 2 || fuse_stride > fuse_size || fuse_stride & (fuse_stride - 1))) {
+                fprintf(stderr, "Bad fuse stride '%s', expected 0 or a power of 2 up to %d\n",
+                    optarg, fuse_size);
+                return 1;
+            }
+            break;
+        case 'g':
+            for (engine = ENGINES - 1; engine >= 0; engine--)
+                if (!strcmp(optarg, engine_names[engine]))
+                    break;
+            if (engine < 0) {
+                fprintf(stderr, "Bad engine '%s', expected diamond or noise\n", optarg);
+                return 1;
             }
-            else if (event.key.keysym.sym == SDLK_LEFTBRACKET) {
-                shift_all(-200);
+            break;
+        case 'm':
+            for (shade_mode = SHADE_MODES - 1; shade_mode >= 0; shade_mode--)
+                if (!strcmp(optarg, shade_names[shade_mode]))
+                    break;
+            if (shade_mode < 0) {
+                fprintf(stderr, "Bad shading '%s', expected flat, relief or normals\n", optarg);
+                return 1;
             }
-            else if (event.key.keysym.sym == SDLK_SPACE) {
-                make_map();
+            break;
+        case 'p':
+            if (post_parse(&post, optarg, MINHEIGHT, MAXHEIGHT)) {
+                fprintf(stderr, "Bad pipeline '%s', expected e.g. blur:2,thermal:8,terrace:12\n", optarg);
+                return 1;
             }
+            break;
+        case 'r':
+            baseline = optarg;
+            break;
+        case 'z':
+            zoom = atoi(optarg);
+            if (zoom < 0 || zoom >= MIP_LEVELS) {
+                fprintf(stderr, "Bad zoom '%s', expected 0 to %d\n", optarg, MIP_LEVELS - 1);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-a maps | -b maps | -B maps [-o prefix]] [-e droplets[:seed]]\n"
+                "       [-f stride] [-g diamond|noise] [-m flat|relief|normals] [-p stage:n,...]\n"
+                "       [-r baseline[:tolerance]] [-z zoom]\n", argv[0]);
+            return 1;
         }
     }
 
+    srand(time(NULL));
+    TRACE_INIT(0);
+    alloc_heightmaps();
+
+    // Init openmp
+    omp_set_dynamic(0);
+    omp_set_num_threads(threads);
+    affinity_init("[OPENMP]");
+
+    if (baseline) {
+        opt = regress(baseline) ? 1 : 0;
+        TRACE_DUMP();
+        return opt;
+    }
+
+    if (tune > 0) {
+        autotune(tune);
+        TRACE_DUMP();
+        return 0;
+    }
+
+    if (bench > 0) {
+        benchmark(bench);
+        TRACE_DUMP();
+        return 0;
+    }
+
+    if (batch_maps > 0) {
+        batch(batch_maps, prefix);
+        TRACE_DUMP();
+        return 0;
+    }
+
+    // Init SDL
+    SDL_Init(SDL_INIT_EVERYTHING);
+    screen = SDL_SetVideoMode(WIDTH >> zoom, HEIGHT >> zoom, 32, SDL_HWSURFACE);
+    back_surface = create_surface(screen->w, screen->h, screen->format->Rmask, screen->format->Gmask,
+        screen->format->Bmask);
+
+    pthread_t gen_thread;
+    int status;
+
+    // Keys held down repeat, so [ and ] keep shifting
+    SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY, SDL_DEFAULT_REPEAT_INTERVAL);
+
+    status = pthread_create(&gen_thread, NULL, generator, NULL);
+    if (status) err_abort(status, "create thread");
+
+    // Show the initial map as soon as it is ready
+    want_map = 1;
+    clock_gettime(CLOCK_REALTIME, &want_time);
+
+    // Sleep until there is something to do: a key, or the generator
+    // telling that a map is ready. Space only asks for the next map, so
+    // keys keep working while it is being made, and no core spins here
+    // while the team works.
+    while (SDL_WaitEvent(&event)) {
+        if (event.type == SDL_QUIT)
+            break;
+
+        if (event.type == SDL_USEREVENT && event.user.code == EVENT_MAP_READY) {
+            take_next_map();
+            continue;
+        }
+
+        if (event.type != SDL_KEYDOWN)
+            continue;
+
+        if (event.key.keysym.sym == SDLK_ESCAPE) {
+            break;
+        }
+        else if (event.key.keysym.sym == SDLK_RIGHTBRACKET) {
+            shift_all(200);
+        }
+        else if (event.key.keysym.sym == SDLK_LEFTBRACKET) {
+            shift_all(-200);
+        }
+        else if (event.key.keysym.sym == SDLK_s) {
+            save_map();
+        }
+        else if (event.key.keysym.sym == SDLK_h) {
+            cycle_shade_mode();
+        }
+        else if (event.key.keysym.sym == SDLK_SPACE && !want_map) {
+            want_map = 1;
+            clock_gettime(CLOCK_REALTIME, &want_time);
+            take_next_map();
+        }
+    }
+
+    // Stop the generator; it drops the map it is working on
+    status = pthread_mutex_lock(&swap_mutex);
+    if (status) err_abort(status, "lock mutex");
+
+    stop_signal = 1;
+    cancel_stop(&cancel);
+    status = pthread_cond_broadcast(&swap_cv);
+    if (status) err_abort(status, "signal condition");
+
+    status = pthread_mutex_unlock(&swap_mutex);
+    if (status) err_abort(status, "unlock mutex");
+
+    pthread_join(gen_thread, NULL);
+
+    TRACE_DUMP();
+
+    free_surface(back_surface);
+    mip_free(&mips[0]);
+    mip_free(&mips[1]);
     SDL_FreeSurface(screen);
     SDL_Quit();
+    huge_free(heightmaps, 3 * sizeof(heightmaps[0]));
 
     return 0;
 }
@@ -1,10 +1,27 @@
+// For CPU affinity
+#define _GNU_SOURCE
+
 #include <SDL/SDL.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "errors.h"
+#include "trace.h"
+#include "tilemap.h"
+#include "perf.h"
+#include "shade.h"
+#include "post.h"
+#include "erode.h"
+#include "affinity.h"
+#include "hugemem.h"
+#include "noise.h"
+#include "regress.h"
+#include "dirty.h"
+#include "tune.h"
+#include "cancel.h"
 #include <pthread.h>
 #include <math.h>
 
@@ -14,11 +31,31 @@
 #define MAXHEIGHT 20000
 #define BILLION  1000000000L;
 
+// Default number of workers, unless -a has tuned it for this host (see
+// tune.h)
 #define NUM_THREADS 8
 
 //Fiddle with these two to make different types of landscape at different distances
 #define RANGE_CHANGE 13000
 #define REDUCTION 0.7
+
+// Terrain engines, picked with -g. The noise engine's first octave has a
+// lattice point every NOISE_PERIOD cells.
+#define ENGINE_DIAMOND 0
+#define ENGINE_NOISE 1
+#define ENGINES 2
+#define NOISE_PERIOD 1024
+#define NOISE_AMPLITUDE (RANGE_CHANGE * 1.5f)
+
+// Where the S key saves the map on screen
+#define MAP_FILE "frac_map.tmap"
+#define MAP_TILE 256
+
+// SDL_USEREVENT code worker 0 posts when a map is ready
+#define EVENT_MAP_READY 1
+
+// Columns of noise a worker fills between checks for cancellation
+#define CANCEL_COLUMNS 64
 #define BILLION  1000000000L;
 
 
@@ -38,8 +75,68 @@ pthread_cond_t display_cv = PTHREAD_COND_INITIALIZER;
 
 int stop_signal;
 
+// The workers, how many there are and how many levels worker 0 makes
+// alone before they share the blocks of the map out. -1 levels is as few
+// as give every worker a block.
+pthread_t *workers;
+int threads = NUM_THREADS;
+int serial_levels = -1;
+
+// Maps each configuration is timed over with -a
+int tune_maps;
+
+// Maps requested by main and maps finished by the workers. Waiting on these
+// instead of on the bare condition variables means a broadcast that lands
+// before a thread starts waiting is not lost. Workers start at start_gen.
+int work_gen, done_gen, start_gen;
+
+// Space while a map is being made cancels it, and escape cancels it before
+// stopping (see cancel.h). map_cancel_gen is the number in the token of
+// the map requested; worker 0 reads the token for all the workers at
+// barriers, into two slots in turn, and sets map_dropped if the map was
+// given up.
+cancel_t cancel;
+unsigned map_cancel_gen;
+int map_cancelled[2];
+int map_dropped;
+double map_time;
+
+// Whether worker 0 posts EVENT_MAP_READY when a map is done, which only
+// the interactive loop waits for
+int post_events;
+
+// How maps are drawn, H cycles through the modes
+int shade_mode = SHADE_FLAT;
+
+// Stages run over every new map, set with -p
+post_pipeline_t post;
+
+// Droplets run over every new map before post-processing, set with -e
+erode_params_t erosion;
+
+// The engine, and the seed and noise parameters of the map requested
+static const char *engine_names[ENGINES] = { "diamond", "noise" };
+int engine = ENGINE_DIAMOND;
+unsigned map_seed;
+noise_params_t noise;
+
+// What -r checks: every engine alone, then diamond-square through the rest
+// of the pipeline, each with the checksum every build must make
+static const regress_case_t regress_cases[] = {
+    { "diamond", ENGINE_DIAMOND, "0", "", 1, 0x76d98ab6450dcb5bULL },
+    { "noise", ENGINE_NOISE, "0", "", 2, 0xfaa7e67d3b9dbf9fULL },
+    { "pipeline", ENGINE_DIAMOND, "200000:3", "blur:2,thermal:4,terrace:12", 3, 0x01e7ba0abec14f87ULL },
+};
+
 SDL_Surface *screen;
-int heightmap[WIDTH + 1][HEIGHT + 1];
+// What changed on screen since the last update (see dirty.h)
+dirty_t dirty;
+// Post-processing writes into spare and swaps it with heightmap. Both are
+// on huge pages (see hugemem.h).
+int (*heightmaps)[WIDTH + 1][HEIGHT + 1];
+int (*heightmap)[HEIGHT + 1];
+int (*spare)[HEIGHT + 1];
+int heightmaps_kind;
 SDL_Event event;
 
 int w = WIDTH;
@@ -48,8 +145,48 @@ float deviance = 1.0;
 
 static void shift_all(int amnt);
 
-static int rand_range(int low, int high) {
-    return rand() % (high - low) + low;
+// The random offset of cell (x, y) in the map made from seed, in
+// [low, high). A hash of the position rather than rand(), so that a seed
+// always gives the same map, whoever computes which cells in which order.
+static int cell_rand(unsigned seed, int x, int y, int low, int high) {
+    uint32_t v = seed ^ (uint32_t)x * 0x9e3779b1U ^ (uint32_t)y * 0x85ebca77U;
+
+    v ^= v >> 16;
+    v *= 0x7feb352dU;
+    v ^= v >> 15;
+    v *= 0x846ca68bU;
+    v ^= v >> 16;
+
+    return (int)(v % (uint32_t)(high - low)) + low;
+}
+
+static void alloc_heightmaps(void) {
+    heightmaps = huge_alloc(2 * sizeof(heightmaps[0]));
+    heightmaps_kind = huge_kind;
+    heightmap = heightmaps[0];
+    spare = heightmaps[1];
+}
+
+// An off-screen surface with its pixels on huge pages. SDL leaves pixels it
+// was given alone, so free_surface unmaps them.
+static SDL_Surface *create_surface(Uint32 rmask, Uint32 gmask, Uint32 bmask) {
+    SDL_Surface *s;
+
+    s = SDL_CreateRGBSurfaceFrom(huge_alloc((size_t)WIDTH * HEIGHT * 4), WIDTH, HEIGHT, 32,
+        WIDTH * 4, rmask, gmask, bmask, 0);
+    if (!s) {
+        fprintf(stderr, "SDL_CreateRGBSurfaceFrom: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    return s;
+}
+
+static void free_surface(SDL_Surface *s) {
+    void *pixels = s->pixels;
+
+    SDL_FreeSurface(s);
+    huge_free(pixels, (size_t)WIDTH * HEIGHT * 4);
 }
 
 static void set_point(int x, int y, int value) {
@@ -79,14 +216,34 @@ static Uint32 height_to_colour(int height, SDL_Surface *s) {
     return SDL_MapRGB(s->format, value, value, value);
 }
 
-static void heightmap_to_screen(SDL_Surface *s) {
+// Draws band part of parts of the heightmap into s: a band of rows for
+// the flat colours, a band of columns when shading
+static void heightmap_to_screen(SDL_Surface *s, int part, int parts, int mode) {
+    shade_format_t f;
     int i, e;
-
-    for (e = 0; e < HEIGHT ; ++e) {
-        for (i = 0; i < WIDTH; ++i) {
-            set_point(i, e, height_to_colour(heightmap[i][e], s));
+    perf_sample_t ps;
+
+    TRACE_BEGIN(colour);
+    perf_begin(&ps);
+    if (mode != SHADE_FLAT) {
+        f.rshift = s->format->Rshift;
+        f.gshift = s->format->Gshift;
+        f.bshift = s->format->Bshift;
+        f.amask = s->format->Amask;
+        f.minheight = MINHEIGHT;
+        f.maxheight = MAXHEIGHT;
+        f.cell = 1;
+        shade_columns(&heightmap[0][0], HEIGHT + 1, WIDTH, HEIGHT, s->pixels, s->pitch / 4,
+            part * WIDTH / parts, (part + 1) * WIDTH / parts, mode, &f);
+    } else {
+        for (e = part * HEIGHT / parts; e < (part + 1) * HEIGHT / parts; ++e) {
+            for (i = 0; i < WIDTH; ++i) {
+                set_point(i, e, height_to_colour(heightmap[i][e], s));
+            }
         }
     }
+    perf_end(&ps, PERF_PHASE_COLOUR);
+    TRACE_END(colour, "colour", -1);
 }
 
 static int rect_avg_heights(SDL_Rect *r) {
@@ -143,7 +300,8 @@ static void draw_all_squares(int startx, int starty, int W, int H, int w, int h,
 
     for (r.y = starty; r.y < H; r.y += r.h)
         for (r.x = startx; r.x < W; r.x += r.w)
-            heightmap[r.x + r.w / 2][r.y + r.h / 2] = rect_avg_heights(&r) + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
+            heightmap[r.x + r.w / 2][r.y + r.h / 2] = rect_avg_heights(&r)
+                + cell_rand(map_seed, r.x + r.w / 2, r.y + r.h / 2, -RANGE_CHANGE, RANGE_CHANGE) * deviance;
 }
 
 static void draw_all_diamonds(int startx, int starty, int W, int H, int w, int h, float deviance) {
@@ -153,10 +311,20 @@ static void draw_all_diamonds(int startx, int starty, int W, int H, int w, int h
 
     for (r.y = starty - r.h / 2; r.y < H; r.y += r.h)
         for (r.x = startx; r.x < W; r.x += r.w)
-            heightmap[r.x + r.w / 2][r.y + r.h / 2] = diam_avg_heights(&r) + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
+            heightmap[r.x + r.w / 2][r.y + r.h / 2] = diam_avg_heights(&r)
+                + cell_rand(map_seed, r.x + r.w / 2, r.y + r.h / 2, -RANGE_CHANGE, RANGE_CHANGE) * deviance;
     for (r.y = starty; r.y < H; r.y += r.h)
         for (r.x = startx - r.w / 2; r.x + r.w / 2 < W; r.x += r.w)
-            heightmap[r.x + r.w / 2][r.y + r.h / 2] = diam_avg_heights(&r) + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
+            heightmap[r.x + r.w / 2][r.y + r.h / 2] = diam_avg_heights(&r)
+                + cell_rand(map_seed, r.x + r.w / 2, r.y + r.h / 2, -RANGE_CHANGE, RANGE_CHANGE) * deviance;
+}
+
+// Save the map on screen as a tiled, compressed file
+static void save_map(void) {
+    if (tilemap_write(MAP_FILE, &heightmap[0][0], HEIGHT + 1, WIDTH, HEIGHT, MAP_TILE, threads))
+        perror(MAP_FILE);
+    else
+        printf("[PTHREADS] Saved %s\n", MAP_FILE);
 }
 
 static void shift_all(int amnt) {
@@ -166,15 +334,86 @@ static void shift_all(int amnt) {
             heightmap[i][e] += amnt;
 }
 
+// The part of the map that thread id resets, fills with noise and so
+// first touches: a block of the sqrt(threads) x sqrt(threads) grid when
+// threads is a power of 4, otherwise a band of columns. Blocks on the
+// right and bottom edges take the extra column and row.
+static void owned_block(long id, int *x0, int *x1, int *y0, int *y1) {
+    int side;
+
+    for (side = 1; side * side < threads; side *= 2)
+        ;
+
+    if (side * side == threads) {
+        *x0 = (id % side) * WIDTH / side;
+        *x1 = (id % side + 1) * WIDTH / side;
+        *y0 = (id / side) * HEIGHT / side;
+        *y1 = (id / side + 1) * HEIGHT / side;
+    } else {
+        *x0 = id * WIDTH / threads;
+        *x1 = (id + 1) * WIDTH / threads;
+        *y0 = 0;
+        *y1 = HEIGHT;
+    }
+
+    if (*x1 == WIDTH)
+        *x1 = WIDTH + 1;
+    if (*y1 == HEIGHT)
+        *y1 = HEIGHT + 1;
+}
+
+// Barrier wait that is timed as its own span when tracing
+static void barrier_wait(int level) {
+    TRACE_BEGIN(wait);
+    pthread_barrier_wait(&barrier);
+    TRACE_END(wait, "barrier", level);
+}
+
+// Barrier at which the workers also agree whether map gen is cancelled,
+// as worker 0 sees it when it gets there. Worker 0 only writes a slot
+// again two checks later, past a barrier every worker has to reach
+// after reading it.
+static int barrier_cancelled(long my_id, unsigned gen, int *checks, int level) {
+    int slot = (*checks)++ & 1;
+
+    if (my_id == 0)
+        map_cancelled[slot] = cancel_check(&cancel, gen);
+    barrier_wait(level);
+
+    return map_cancelled[slot];
+}
+
+// Wakes the event loop up with EVENT_MAP_READY. SDL_PushEvent may be
+// called from any thread.
+static void post_map_ready(void) {
+    SDL_Event e;
+
+    e.type = SDL_USEREVENT;
+    e.user.code = EVENT_MAP_READY;
+    e.user.data1 = NULL;
+    e.user.data2 = NULL;
+    if (SDL_PushEvent(&e))
+        fprintf(stderr, "SDL_PushEvent: %s\n", SDL_GetError());
+}
+
 static void *make_map(void *args) {
-    int i, e;
+    int (*tmp)[HEIGHT + 1];
+    int i, e, t, r, b;
     int status;
+    int level;
+    int gen = start_gen;
+    unsigned cancel_gen;
+    int abandon, checks = 0;
+    perf_sample_t ps;
 
     struct timespec start, stop;
-    double accum;
 
     long my_id = (long)args;
+    int own_x0, own_x1, own_y0, own_y1;
+
     srand(time(NULL));
+    affinity_pin(my_id);
+    owned_block(my_id, &own_x0, &own_x1, &own_y0, &own_y1);
 
     while (1) {
 
@@ -182,208 +421,621 @@ static void *make_map(void *args) {
         status = pthread_mutex_lock(&work_mutex);
         if (status) err_abort(status, "lock mutex");
 
-        status = pthread_cond_wait(&work_cv, &work_mutex);
-        if (status) err_abort(status, "wait for condition");
+        while (work_gen == gen && !stop_signal) {
+            status = pthread_cond_wait(&work_cv, &work_mutex);
+            if (status) err_abort(status, "wait for condition");
+        }
+
+        // Stop only with no map pending. A map requested before the stop
+        // is taken by every worker, or some would wait at its barriers
+        // for ever, and the stop cancels it.
+        if (work_gen == gen) {
+            status = pthread_mutex_unlock(&work_mutex);
+            if (status) err_abort(status, "unlock mutex");
+            pthread_exit(NULL);
+        }
+        gen = work_gen;
+        cancel_gen = map_cancel_gen;
 
         status = pthread_mutex_unlock(&work_mutex);
         if (status) err_abort(status, "unlock mutex");
 
-        // Check if ESC was pressed (stop_signal was set)
-        if (stop_signal) {
-            pthread_exit(NULL);
-        }
+        if (engine == ENGINE_NOISE) {
+            // Every cell is independent, so each thread fills the block it
+            // owns and only waits once the whole map is done
+            clock_gettime(CLOCK_REALTIME, &start);
+            TRACE_BEGIN(noise);
+            perf_begin(&ps);
+            for (i = own_x0; i < own_x1 && !cancel_check(&cancel, cancel_gen); i += CANCEL_COLUMNS)
+                noise_fill(&noise, &heightmap[0][0], HEIGHT + 1, i, i + CANCEL_COLUMNS < own_x1 ? i + CANCEL_COLUMNS : own_x1,
+                    own_y0, own_y1);
+            perf_end(&ps, PERF_PHASE_NOISE);
+            TRACE_END(noise, "noise", -1);
+
+            abandon = barrier_cancelled(my_id, cancel_gen, &checks, -1);
+        } else {
+            //Reset the heightmap to the minimum height. Every thread resets
+            //the block it owns, so on the first map its pages are placed on
+            //the thread's NUMA node.
+            TRACE_BEGIN(reset);
+            perf_begin(&ps);
+            for (i = own_x0; i < own_x1; ++i)
+                for (e = own_y0; e < own_y1; ++e)
+                    heightmap[i][e] = MINHEIGHT;
+            perf_end(&ps, PERF_PHASE_RESET);
+            TRACE_END(reset, "reset", -1);
 
-        w = WIDTH;
-        h = HEIGHT;
-        deviance = 1;
+            barrier_wait(-1);
 
-        if (my_id == 0) {
+            clock_gettime(CLOCK_REALTIME, &start);
+            level = 0;
+            if (my_id == 0) {
+                // Only thread 0 sets the shared level state: the others
+                // must not reset it while it is already going down levels
+                w = WIDTH;
+                h = HEIGHT;
+                deviance = 1;
 
-            //Reset the whole heightmap to the minimum height
-            for (e = 0; e < HEIGHT + 1; ++e)
-                for (i = 0; i < WIDTH + 1; ++i)
-                    heightmap[i][e] = MINHEIGHT;
+                //Add our starting corner points
+                heightmap[0][0] = cell_rand(map_seed, 0, 0, -RANGE_CHANGE, RANGE_CHANGE);
+                heightmap[0][HEIGHT] = cell_rand(map_seed, 0, HEIGHT, -RANGE_CHANGE, RANGE_CHANGE);
 
-            //Add our starting corner points
-            heightmap[0][0] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
-            heightmap[0][HEIGHT] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
-        }
+                while (h >= 2 && w >= 2 && level < serial_levels && !cancel_check(&cancel, cancel_gen)) {
+                    perf_begin(&ps);
 
-        pthread_barrier_wait (&barrier);
+                    TRACE_BEGIN(square);
+                    draw_all_squares(0, 0, WIDTH, HEIGHT, w, h, deviance);
+                    TRACE_END(square, "square", level);
 
-        clock_gettime(CLOCK_REALTIME, &start);
-        if (my_id == 0) {
-            while (h >= 2 && w >= 2) {
-                draw_all_squares(0, 0, WIDTH, HEIGHT, w, h, deviance);
-                draw_all_diamonds(0, 0, WIDTH, HEIGHT, w, h, deviance);
+                    TRACE_BEGIN(diamond);
+                    draw_all_diamonds(0, 0, WIDTH, HEIGHT, w, h, deviance);
+                    TRACE_END(diamond, "diamond", level);
 
-                w /= 2;
-                h /= 2;
+                    perf_end(&ps, PERF_LEVEL(level));
 
-                deviance *= REDUCTION;
+                    level++;
+                    w /= 2;
+                    h /= 2;
 
-                if (pow(4, (HEIGHT /  (2 * h))) == NUM_THREADS) {
-                    break;
+                    deviance *= REDUCTION;
                 }
             }
-        }
 
-        pthread_barrier_wait (&barrier);
+            abandon = barrier_cancelled(my_id, cancel_gen, &checks, -1);
 
-        int startx = 0;
-        int starty = 0;
-        int local_w = w;
-        int local_h = h;
-        float local_deviance = deviance;
+            // Threads other than 0 skipped the serial levels
+            for (level = 0; (WIDTH >> level) > w; level++)
+                ;
 
-        int proc = 0;
-        for (i = 0; i < HEIGHT; i += h) {
-            for (e = 0; e < WIDTH; e += w) {
-                if (proc == my_id) {
-                    startx = e;
-                    starty = i;
-                }
-                proc++;
-            }
-        }
+            // The w x h blocks of the map are dealt out in turn, so any
+            // number of threads can share any number of blocks
+            int side = WIDTH / w;
+            int blocks = side * (HEIGHT / h);
+            int local_w = w;
+            int local_h = h;
+            float local_deviance = deviance;
+
+            while (local_h >= 2 && local_w >= 2 && !abandon) {
+                perf_begin(&ps);
 
-        int local_W = startx + w;
-        int local_H = starty + h;
+                TRACE_BEGIN(square);
+                for (b = my_id; b < blocks; b += threads)
+                    draw_all_squares(b % side * w, b / side * h, (b % side + 1) * w, (b / side + 1) * h,
+                        local_w, local_h, local_deviance);
+                TRACE_END(square, "square", level);
+                barrier_wait(level);
 
+                TRACE_BEGIN(diamond);
+                for (b = my_id; b < blocks; b += threads)
+                    draw_all_diamonds(b % side * w, b / side * h, (b % side + 1) * w, (b / side + 1) * h,
+                        local_w, local_h, local_deviance);
+                TRACE_END(diamond, "diamond", level);
+                abandon = barrier_cancelled(my_id, cancel_gen, &checks, level);
 
-        // Else do work and create map
-        while (local_h >= 2 && local_w >= 2) {
-            // Individual computation
-            draw_all_squares(startx, starty, local_W, local_H, local_w, local_h, local_deviance);
-            pthread_barrier_wait(&barrier);
+                perf_end(&ps, PERF_LEVEL(level));
 
-            draw_all_diamonds(startx, starty, local_W, local_H, local_w, local_h, local_deviance);
-            pthread_barrier_wait(&barrier);
+                local_w /= 2;
+                local_h /= 2;
 
-            local_w /= 2;
-            local_h /= 2;
+                local_deviance *= REDUCTION;
+                level++;
+            }
 
-            local_deviance *= REDUCTION;
+            barrier_wait(-1);
         }
 
-        pthread_barrier_wait(&barrier);
+        // Erosion; the tiles of a round are independent, the rounds are not
+        if (erosion.droplets && !abandon) {
+            TRACE_BEGIN(erode);
+            perf_begin(&ps);
+            for (r = 0; r < ERODE_ROUNDS && !abandon; r++) {
+                for (t = my_id; t < erode_tiles(WIDTH, HEIGHT) && !cancel_check(&cancel, cancel_gen); t += threads)
+                    erode_tile(&erosion, &heightmap[0][0], HEIGHT + 1, WIDTH, HEIGHT, r, t);
+                abandon = barrier_cancelled(my_id, cancel_gen, &checks, -1);
+            }
+            perf_end(&ps, PERF_PHASE_ERODE);
+            TRACE_END(erode, "erode", -1);
+        }
+
+        // Post-processing; tiles are independent, so every thread takes
+        // every threads-th one
+        if (post.nstages && !abandon) {
+            TRACE_BEGIN(post);
+            perf_begin(&ps);
+            for (t = my_id; t < post_tiles(WIDTH, HEIGHT) && !cancel_check(&cancel, cancel_gen); t += threads)
+                post_tile(&post, &heightmap[0][0], &spare[0][0], HEIGHT + 1, WIDTH, HEIGHT, t);
+            perf_end(&ps, PERF_PHASE_POST);
+            TRACE_END(post, "post", -1);
+
+            abandon = barrier_cancelled(my_id, cancel_gen, &checks, -1);
+            if (my_id == 0) {
+                tmp = heightmap;
+                heightmap = spare;
+                spare = tmp;
+            }
+            barrier_wait(-1);
+        }
 
         if (my_id == 0) {
             clock_gettime(CLOCK_REALTIME, &stop);
 
-            accum = ( stop.tv_sec - start.tv_sec )
+            map_time = ( stop.tv_sec - start.tv_sec )
                 + (double)( stop.tv_nsec - start.tv_nsec )
                     / (double)BILLION;
-            printf("[PTHREADS] Make_map: %lf\n", accum);
+        }
+
+        // Every thread draws its own band, unless the map was dropped
+        if (!abandon)
+            heightmap_to_screen(screen, my_id, threads, shade_mode);
+
+        barrier_wait(-1);
 
+        if (my_id == 0) {
             status = pthread_mutex_lock(&display_mutex);
             if (status) err_abort(status, "lock mutex");
 
+            map_dropped = abandon;
+            done_gen = gen;
             status = pthread_cond_signal(&display_cv);
             if (status) err_abort(status, "signal condition");
 
             status = pthread_mutex_unlock(&display_mutex);
             if (status) err_abort(status, "unlock mutex");
+            if (post_events)
+                post_map_ready();
         }
     }
 }
 
-int main(void) {
+// Starts threads workers, waiting for the next map requested
+static void start_workers(void) {
+    pthread_attr_t attr;
     long t;
     int status;
-    pthread_t threads[NUM_THREADS];
-    pthread_attr_t attr;
 
-    // Init SDL
-    SDL_Init(SDL_INIT_EVERYTHING);
-    screen = SDL_SetVideoMode(WIDTH, HEIGHT, 32, SDL_HWSURFACE);
+    workers = malloc(threads * sizeof(pthread_t));
+    if (!workers) {
+        perror("workers");
+        exit(1);
+    }
 
-    // Create threads
-    stop_signal = 0;
+    // As few serial levels as leave a block for every worker
+    if (serial_levels < 0)
+        for (serial_levels = 0; 1 << (2 * serial_levels) < threads; serial_levels++)
+            ;
 
-    pthread_barrier_init (&barrier, NULL, NUM_THREADS);
+    stop_signal = 0;
+    start_gen = work_gen;
+    pthread_barrier_init(&barrier, NULL, threads);
 
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-    for (t = 0; t < NUM_THREADS; t++) {
-        status = pthread_create(&threads[t], &attr, make_map, (void *)t);
+    for (t = 0; t < threads; t++) {
+        status = pthread_create(&workers[t], &attr, make_map, (void *)t);
         if (status) err_abort(status, "create thread");
     }
+    pthread_attr_destroy(&attr);
+}
 
-    // Poll SDL events
-    while (1) {
-        SDL_PollEvent(&event);
+// Tells the workers to stop once idle and waits for them
+static void stop_workers(void) {
+    int status;
+    int t;
 
-        if (event.type == SDL_KEYDOWN) {
-            if (event.key.keysym.sym == SDLK_ESCAPE) {
-                // Set stop signal
-                stop_signal = 1;
+    // Set stop signal and wake the threads so they read it
+    status = pthread_mutex_lock(&work_mutex);
+    if (status) err_abort(status, "lock mutex");
 
-                // Signal threads to start work ( meaning to read the stop)
-                status = pthread_mutex_lock(&work_mutex);
-                if (status) err_abort(status, "lock mutex");
+    stop_signal = 1;
+    status = pthread_cond_broadcast(&work_cv);
+    if (status) err_abort(status, "signal condition");
 
-                status = pthread_cond_broadcast(&work_cv);
-                if (status) err_abort(status, "signal condition");
+    status = pthread_mutex_unlock(&work_mutex);
+    if (status) err_abort(status, "unlock mutex");
 
-                status = pthread_mutex_unlock(&work_mutex);
-                if (status) err_abort(status, "unlock mutex");
+    /* Wait for all threads to complete */
+    for (t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    pthread_barrier_destroy(&barrier);
+    free(workers);
+}
+
+// Ask the workers for a new map and return at once. When it is in
+// heightmap and coloured into screen, done_gen catches up with work_gen.
+static void submit_map(unsigned seed) {
+    int status;
+
+    status = pthread_mutex_lock(&work_mutex);
+    if (status) err_abort(status, "lock mutex");
+
+    map_seed = seed;
+    noise_init(&noise, seed, NOISE_PERIOD, REDUCTION, NOISE_AMPLITUDE);
+    map_cancel_gen = cancel_begin(&cancel);
+    work_gen++;
+    status = pthread_cond_broadcast(&work_cv);
+    if (status) err_abort(status, "signal condition");
+
+    status = pthread_mutex_unlock(&work_mutex);
+    if (status) err_abort(status, "unlock mutex");
+}
+
+// Ask the workers for a new map and wait until it is in heightmap and
+// coloured into screen
+static void request_map(unsigned seed) {
+    int status;
+
+    submit_map(seed);
+
+    // Wait for result
+    status = pthread_mutex_lock(&display_mutex);
+    if (status) err_abort(status, "lock mutex");
+
+    while (done_gen != work_gen) {
+        status = pthread_cond_wait(&display_cv, &display_mutex);
+        if (status) err_abort(status, "wait for condition");
+    }
+
+    status = pthread_mutex_unlock(&display_mutex);
+    if (status) err_abort(status, "unlock mutex");
+}
+
+// Generate maps back to back into an off-screen surface, timing each one
+// and collecting hardware counters per phase and thread
+static void benchmark(int maps) {
+    struct timespec start, stop;
+    double accum, total = 0;
+    int n, screen_kind;
+
+    screen = create_surface(0x00ff0000, 0x0000ff00, 0x000000ff);
+    screen_kind = huge_kind;
+
+    for (n = 0; n < maps; n++) {
+        clock_gettime(CLOCK_REALTIME, &start);
+        request_map(rand());
+        clock_gettime(CLOCK_REALTIME, &stop);
+
+        accum = ( stop.tv_sec - start.tv_sec )
+            + (double)( stop.tv_nsec - start.tv_nsec )
+                / (double)BILLION;
+        total += accum;
+        printf("[PTHREADS] Map %d: %lf (make_map %lf)\n", n, accum, map_time);
+    }
+
+    printf("[PTHREADS] Benchmark: %d maps, %d threads, %s, mean %lf\n", maps, threads,
+        engine_names[engine], total / maps);
+    perf_report("[PTHREADS]");
+    huge_report("[PTHREADS]", "Heightmaps", heightmaps, 2 * sizeof(heightmaps[0]), heightmaps_kind);
+    huge_report("[PTHREADS]", "Framebuffer", screen->pixels, (size_t)WIDTH * HEIGHT * 4, screen_kind);
+}
+
+// Best time of tune_maps maps from a fresh set of workers with the
+// parameters as they are
+static double tune_time(void) {
+    struct timespec start, stop;
+    double accum, best = 0;
+    int levels = serial_levels;
+    int n;
+
+    start_workers();
+    for (n = 0; n < tune_maps; n++) {
+        clock_gettime(CLOCK_REALTIME, &start);
+        request_map(n + 1);
+        clock_gettime(CLOCK_REALTIME, &stop);
+
+        accum = ( stop.tv_sec - start.tv_sec )
+            + (double)( stop.tv_nsec - start.tv_nsec )
+                / (double)BILLION;
+        if (n == 0 || accum < best)
+            best = accum;
+    }
+    stop_workers();
+    serial_levels = levels;
+
+    return best;
+}
+
+// Searches the number of workers, then the number of levels worker 0
+// makes alone with the best of them, and saves the fastest to TUNE_FILE
+static void autotune(int maps) {
+    static const int levels[] = { 0, 1, 2, 3, 4, 5 };
+    int counts[TUNE_MAX_CANDIDATES];
+    tune_t t;
+    double best;
+
+    screen = create_surface(0x00ff0000, 0x0000ff00, 0x000000ff);
+    tune_maps = maps;
+
+    // Every count of workers with its own default serial levels first
+    serial_levels = -1;
+    tune_pick("[PTHREADS]", "threads", &threads, counts, tune_thread_counts(counts), tune_time);
+    best = tune_pick("[PTHREADS]", "serial levels", &serial_levels, levels,
+        sizeof(levels) / sizeof(levels[0]), tune_time);
+
+    t.threads = threads;
+    t.cutoff = serial_levels;
+    t.tile = 0;
+    if (!tune_save(TUNE_FILE, "pthread", WIDTH, HEIGHT, &t))
+        printf("[PTHREADS] Tuned: %d threads, %d serial levels, %lf s a map, saved to %s\n",
+            threads, serial_levels, best, TUNE_FILE);
+}
+
+/*
+ * Has the workers make the map of every regression case REGRESS_RUNS times,
+ * checking that they all come out the same and comparing that map's
+ * checksum and the best time against the baseline file in spec. The time
+ * includes colouring, as the workers always do it. Returns the number of
+ * failures.
+ */
+static int regress(const char *spec) {
+    const regress_case_t *c;
+    struct timespec start, stop;
+    char path[256];
+    double tolerance, accum, best;
+    uint64_t sum, first;
+    int i, run, failures = 0;
+
+    if (regress_parse(spec, path, sizeof(path), &tolerance)) {
+        fprintf(stderr, "Bad regression '%s', expected baseline[:tolerance%%]\n", spec);
+        return 1;
+    }
+
+    screen = create_surface(0x00ff0000, 0x0000ff00, 0x000000ff);
+
+    // The workers are idle between requests, so the settings can change
+    for (i = 0; i < (int)(sizeof(regress_cases) / sizeof(regress_cases[0])); i++) {
+        c = &regress_cases[i];
+        engine = c->engine;
+        erode_parse(&erosion, c->erode);
+        post_parse(&post, c->post, MINHEIGHT, MAXHEIGHT);
+
+        best = 0;
+        first = 0;
+        for (run = 0; run < REGRESS_RUNS; run++) {
+            clock_gettime(CLOCK_REALTIME, &start);
+            request_map(c->seed);
+            clock_gettime(CLOCK_REALTIME, &stop);
+
+            accum = ( stop.tv_sec - start.tv_sec )
+                + (double)( stop.tv_nsec - start.tv_nsec )
+                    / (double)BILLION;
+            if (run == 0 || accum < best)
+                best = accum;
+
+            sum = regress_checksum(&heightmap[0][0], HEIGHT + 1, WIDTH, HEIGHT);
+            if (run == 0) {
+                first = sum;
+            } else if (sum != first) {
+                printf("[PTHREADS] Regress %s: run %d made a different map FAIL\n", c->name, run);
+                failures++;
                 break;
             }
-            else if (event.key.keysym.sym == SDLK_RIGHTBRACKET) {
-                shift_all(200);
+        }
+        if (run < REGRESS_RUNS)
+            continue;
+
+        failures += regress_check(path, tolerance, "[PTHREADS]", "pthread", c->name,
+            WIDTH, HEIGHT, c->checksum, first, best);
+    }
+
+    printf("[PTHREADS] Regression: %d threads, %d failure%s\n", threads, failures,
+        failures == 1 ? "" : "s");
+
+    return failures;
+}
+
+// Switch to the next drawing mode and redraw the map on screen with it.
+// The workers are idle between requests, so the heightmap is stable.
+static void cycle_shade_mode(void) {
+    shade_mode = (shade_mode + 1) % SHADE_MODES;
+
+    heightmap_to_screen(screen, 0, 1, shade_mode);
+    printf("[PTHREADS] Shading: %s\n", shade_names[shade_mode]);
+    dirty_add(&dirty, 0, 0, WIDTH, HEIGHT);
+    dirty_flush(&dirty, screen);
+}
+
+int main(int argc, char *argv[]) {
+    int bench = 0;
+    const char *baseline = NULL;
+    int tune = 0;
+    tune_t tuned;
+    int offscreen, failures = 0;
+    int opt;
+    int busy = 0, want_next = 0;
+
+    // What -a found on this host, which the options below may override
+    if (!tune_load(TUNE_FILE, "pthread", WIDTH, HEIGHT, &tuned) && tuned.cutoff >= 0
+            && tuned.threads >= 1 && tuned.threads <= sysconf(_SC_NPROCESSORS_ONLN)) {
+        threads = tuned.threads;
+        serial_levels = tuned.cutoff;
+        printf("[PTHREADS] Tuned: %d threads, %d serial levels, from %s\n",
+            threads, serial_levels, TUNE_FILE);
+    }
+
+    while ((opt = getopt(argc, argv, "a:b:e:g:m:p:r:")) != -1) {
+        switch (opt) {
+        case 'a':
+            tune = atoi(optarg);
+            break;
+        case 'b':
+            bench = atoi(optarg);
+            break;
+        case 'e':
+            if (erode_parse(&erosion, optarg)) {
+                fprintf(stderr, "Bad erosion '%s', expected droplets[:seed]\n", optarg);
+                return 1;
+            }
+            break;
+        case 'g':
+            for (engine = ENGINES - 1; engine >= 0; engine--)
+                if (!strcmp(optarg, engine_names[engine]))
+                    break;
+            if (engine < 0) {
+                fprintf(stderr, "Bad engine '%s', expected diamond or noise\n", optarg);
+                return 1;
+            }
+            break;
+        case 'm':
+            for (shade_mode = SHADE_MODES - 1; shade_mode >= 0; shade_mode--)
+                if (!strcmp(optarg, shade_names[shade_mode]))
+                    break;
+            if (shade_mode < 0) {
+                fprintf(stderr, "Bad shading '%s', expected flat, relief or normals\n", optarg);
+                return 1;
             }
-            else if (event.key.keysym.sym == SDLK_LEFTBRACKET) {
-                shift_all(-200);
+            break;
+        case 'p':
+            if (post_parse(&post, optarg, MINHEIGHT, MAXHEIGHT)) {
+                fprintf(stderr, "Bad pipeline '%s', expected e.g. blur:2,thermal:8,terrace:12\n", optarg);
+                return 1;
             }
-            else if (event.key.keysym.sym == SDLK_SPACE) {
-                // Add first task in queue
-                // Signal therads to work (signal is 0, so create a map)
-                status = pthread_mutex_lock(&work_mutex);
-                if (status) err_abort(status, "lock mutex");
+            break;
+        case 'r':
+            baseline = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-a maps | -b maps] [-e droplets[:seed]] [-g diamond|noise]\n"
+                "       [-m flat|relief|normals] [-p stage:n,...] [-r baseline[:tolerance]]\n", argv[0]);
+            return 1;
+        }
+    }
 
-                status = pthread_cond_broadcast(&work_cv);
-                if (status) err_abort(status, "signal condition");
+    TRACE_INIT(0);
+    perf_enabled = bench > 0;
+    offscreen = tune > 0 || bench > 0 || baseline;
+    alloc_heightmaps();
 
-                status = pthread_mutex_unlock(&work_mutex);
-                if (status) err_abort(status, "unlock mutex");
+    // Init SDL
+    if (!offscreen) {
+        SDL_Init(SDL_INIT_EVERYTHING);
+        screen = SDL_SetVideoMode(WIDTH, HEIGHT, 32, SDL_HWSURFACE);
+    }
 
-                // Wait for result
-                status = pthread_mutex_lock(&display_mutex);
-                if (status) err_abort(status, "lock mutex");
+    // Consecutive threads own neighbouring blocks, so give them
+    // neighbouring cpus
+    affinity_init("[PTHREADS]");
+
+    // Tuning starts and stops workers of its own
+    if (tune > 0) {
+        autotune(tune);
+    } else {
+        start_workers();
+        if (baseline)
+            failures = regress(baseline);
+        else if (bench > 0)
+            benchmark(bench);
+    }
 
-                status = pthread_cond_wait(&display_cv, &display_mutex);
-                if (status) err_abort(status, "signal condition");
+    // Sleep until there is something to do: a key, or worker 0 telling
+    // that the map asked for is ready, so all cores are left to the
+    // workers. The workers write heightmap and screen while busy, so keys
+    // other than escape and space wait until the map is done.
+    if (!offscreen) {
+        SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY, SDL_DEFAULT_REPEAT_INTERVAL);
+        post_events = 1;
+    }
+    while (!offscreen && SDL_WaitEvent(&event)) {
+        if (event.type == SDL_QUIT)
+            break;
+
+        if (event.type == SDL_USEREVENT && event.user.code == EVENT_MAP_READY) {
+            if (busy) {
+                busy = 0;
+                if (!map_dropped) {
+                    printf("[PTHREADS] Make_map: %lf\n", map_time);
+                    dirty_add(&dirty, 0, 0, WIDTH, HEIGHT);
+                    dirty_flush(&dirty, screen);
+                }
+                if (want_next) {
+                    want_next = 0;
+                    busy = 1;
+                    submit_map(rand());
+                }
+            }
+            continue;
+        }
 
-                status = pthread_mutex_unlock(&display_mutex);
-                if (status) err_abort(status, "unlock mutex");
+        if (event.type != SDL_KEYDOWN)
+            continue;
 
-                heightmap_to_screen(screen);
-                SDL_Flip(screen);
-            } else
-                continue;
-           //SDL_Delay(1);
+        if (event.key.keysym.sym == SDLK_ESCAPE) {
+            break;
+        }
+        else if (busy) {
+            // Space drops the map being made for a new one, once the
+            // workers have let it go
+            if (event.key.keysym.sym == SDLK_SPACE) {
+                cancel_supersede(&cancel);
+                want_next = 1;
+            }
+            continue;
+        }
+        else if (event.key.keysym.sym == SDLK_RIGHTBRACKET) {
+            shift_all(200);
+        }
+        else if (event.key.keysym.sym == SDLK_LEFTBRACKET) {
+            shift_all(-200);
+        }
+        else if (event.key.keysym.sym == SDLK_s) {
+            save_map();
+        }
+        else if (event.key.keysym.sym == SDLK_h) {
+            cycle_shade_mode();
+        }
+        else if (event.key.keysym.sym == SDLK_SPACE) {
+            busy = 1;
+            submit_map(rand());
         }
     }
 
-    /* Wait for all threads to complete */
-    for (t = 0; t < NUM_THREADS; t++) {
-        pthread_join(threads[t], NULL);
+    if (tune <= 0) {
+        cancel_stop(&cancel);
+        stop_workers();
+        printf ("Main(): Waited on %d threads. Done.\n", threads);
     }
-    printf ("Main(): Waited on %d threads. Done.\n", NUM_THREADS);
+
+    TRACE_DUMP();
 
     // Close resources
-    SDL_FreeSurface(screen);
-    SDL_Quit();
+    if (offscreen) {
+        free_surface(screen);
+    } else {
+        SDL_FreeSurface(screen);
+        SDL_Quit();
+    }
+    huge_free(heightmaps, 2 * sizeof(heightmaps[0]));
 
     /* Clean up and exit */
-    pthread_attr_destroy(&attr);
     pthread_mutex_destroy(&work_mutex);
     pthread_cond_destroy(&work_cv);
 
     pthread_mutex_destroy(&display_mutex);
     pthread_cond_destroy(&display_cv);
 
+    if (failures)
+        return 1;
+
     pthread_exit(NULL);
 
     return 0;
@@ -0,0 +1,147 @@
+#ifndef __NOISE_H__
+#define __NOISE_H__
+
+/*
+ * Fractal gradient noise, the second terrain engine.
+ *
+ * Every cell is a sum of octaves of 2D gradient noise (fBm): octave k has
+ * lattice points 2^k times closer than the first and an amplitude gain^k
+ * times smaller, the same halving of the scale and shrinking of the
+ * deviance that diamond-square does per level. Unlike diamond-square no
+ * cell depends on another, so the map can be cut up any way between
+ * threads with no barriers at all.
+ *
+ * The gradient at each lattice point comes from an integer hash of its
+ * coordinates, the octave and the seed, so there are no permutation tables
+ * to look up. noise_fill works down a column NOISE_LANES cells at a time
+ * with GCC vector extensions, like shade.h: x is fixed per column and the
+ * lanes walk y.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define NOISE_LANES 8
+
+typedef float noise_vf __attribute__((vector_size(NOISE_LANES * sizeof(float))));
+typedef int32_t noise_vi __attribute__((vector_size(NOISE_LANES * sizeof(int32_t))));
+typedef uint32_t noise_vu __attribute__((vector_size(NOISE_LANES * sizeof(uint32_t))));
+
+typedef struct {
+    uint32_t seed;
+    int octaves;
+    float frequency;   // of the first octave, in lattice cells per map cell
+    float gain;        // amplitude ratio between octaves
+    float amplitude;   // of the first octave, in height units
+} noise_params_t;
+
+/*
+ * Sets up p with period cells between the lattice points of the first
+ * octave, and as many octaves as it takes to get down to a lattice point
+ * every two cells.
+ */
+static void noise_init(noise_params_t *p, uint32_t seed, int period, float gain, float amplitude) {
+    int k;
+
+    p->seed = seed;
+    p->frequency = 1.0f / period;
+    p->gain = gain;
+    p->amplitude = amplitude;
+
+    for (k = 0; (period >> k) >= 2; k++)
+        ;
+    p->octaves = k;
+}
+
+// Dot product of the gradient at lattice points (x, y[lane]) of octave
+// seed s with the offsets (dx, dy[lane]) from them
+static void noise_grad(noise_vf *out, uint32_t x, const noise_vu *y, uint32_t s,
+        float dx, const noise_vf *dy) {
+    noise_vu h;
+    noise_vf gx, gy;
+
+    h = *y * 0x27d4eb2dU + (x * 0x165667b1U ^ s);
+    h ^= h >> 15;
+    h *= 0x2c1b3c6dU;
+    h ^= h >> 12;
+    h *= 0x297a2d39U;
+    h ^= h >> 15;
+
+    // Two 16 bit components in [-1, 1]
+    gx = __builtin_convertvector(h & 0xffff, noise_vf) * (2.0f / 65535) - 1;
+    gy = __builtin_convertvector(h >> 16, noise_vf) * (2.0f / 65535) - 1;
+
+    *out = gx * dx + gy * *dy;
+}
+
+/*
+ * Gradient noise at (x, y[lane]) for octave seed s, added to *sum scaled
+ * by amplitude. Coordinates are never negative, so truncation is floor.
+ */
+static void noise_octave(noise_vf *sum, float x, const noise_vf *y, uint32_t s, float amplitude) {
+    noise_vf fy, fy1, v, n00, n10, n01, n11, a, b;
+    noise_vu iy, iy1;
+    uint32_t ix;
+    float fx, u;
+
+    ix = (uint32_t)x;
+    fx = x - ix;
+    iy = __builtin_convertvector(*y, noise_vu);
+    fy = *y - __builtin_convertvector(iy, noise_vf);
+    iy1 = iy + 1;
+    fy1 = fy - 1;
+
+    noise_grad(&n00, ix, &iy, s, fx, &fy);
+    noise_grad(&n10, ix + 1, &iy, s, fx - 1, &fy);
+    noise_grad(&n01, ix, &iy1, s, fx, &fy1);
+    noise_grad(&n11, ix + 1, &iy1, s, fx - 1, &fy1);
+
+    // Quintic fade
+    u = fx * fx * fx * (fx * (fx * 6 - 15) + 10);
+    v = fy * fy * fy * (fy * (fy * 6 - 15) + 10);
+
+    a = n00 + (n10 - n00) * u;
+    b = n01 + (n11 - n01) * u;
+    *sum += (a + (b - a) * v) * amplitude;
+}
+
+/*
+ * Fills the cells [x0, x1) x [y0, y1) of map, stored column by column with
+ * stride ints per column.
+ */
+static void noise_fill(const noise_params_t *p, int *map, int stride,
+        int x0, int x1, int y0, int y1) {
+    const noise_vf zero = { 0 };
+    noise_vf sum, lanes, y;
+    noise_vi out;
+    float frequency, amplitude;
+    int x, row, k, l, n;
+
+    for (l = 0; l < NOISE_LANES; l++)
+        lanes[l] = l;
+
+    for (x = x0; x < x1; x++) {
+        for (row = y0; row < y1; row += NOISE_LANES) {
+            n = y1 - row < NOISE_LANES ? y1 - row : NOISE_LANES;
+
+            sum = zero;
+            frequency = p->frequency;
+            amplitude = p->amplitude;
+            for (k = 0; k < p->octaves; k++) {
+                y = (lanes + (float)row) * frequency;
+                noise_octave(&sum, x * frequency, &y, p->seed + k * 0x9e3779b9U, amplitude);
+                frequency *= 2;
+                amplitude *= p->gain;
+            }
+
+            out = __builtin_convertvector(sum, noise_vi);
+            if (n == NOISE_LANES)
+                memcpy(map + (size_t)x * stride + row, &out, sizeof(out));
+            else
+                for (l = 0; l < n; l++)
+                    map[(size_t)x * stride + row + l] = out[l];
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef __SHADE_H__
+#define __SHADE_H__
+
+/*
+ * Shaded relief and normal maps.
+ *
+ * Every pixel gets the surface normal from a 3x3 Horn stencil over the
+ * heightmap. In SHADE_RELIEF mode the blue/green height ramp is lit from
+ * the north-west with that normal; in SHADE_NORMALS mode the normal itself
+ * is written as RGB (x, y, z mapped from [-1, 1] to [0, 255]).
+ *
+ * The heightmap is stored column by column (cell (x, y) at
+ * map[x * stride + y]), so the stencil is vectorised down a column with GCC
+ * vector extensions, SHADE_LANES cells at a time. Work is split by
+ * columns: shade_columns(..., first, last) only touches columns
+ * [first, last), so each thread can take its own band. Cells on the map
+ * border reuse the nearest cell inside it.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#define SHADE_FLAT 0
+#define SHADE_RELIEF 1
+#define SHADE_NORMALS 2
+#define SHADE_MODES 3
+
+#define SHADE_LANES 8
+
+// Columns shaded side by side, so the pixel stores of a block fill whole
+// cache lines of each row
+#define SHADE_STRIP 16
+
+// Height units per cell of horizontal distance
+#define SHADE_Z (1.0f / 64)
+
+typedef float shade_vf __attribute__((vector_size(SHADE_LANES * sizeof(float))));
+typedef int32_t shade_vi __attribute__((vector_size(SHADE_LANES * sizeof(int32_t))));
+
+// Where the channels go in a 32 bit pixel, and the heights of the ramp
+typedef struct {
+    int rshift, gshift, bshift;
+    uint32_t amask;
+    int minheight, maxheight;
+    int cell;   // map cells between samples, more than 1 on a coarser mip level
+} shade_format_t;
+
+static const char *shade_names[SHADE_MODES] = { "flat", "relief", "normals" };
+
+// Lane-wise m ? a : b for a mask from a vector comparison
+#define SHADE_SELECT(m, a, b) \
+    ((shade_vf)(((m) & (shade_vi)(a)) | (~(m) & (shade_vi)(b))))
+
+#define SHADE_CLAMP(v, lo, hi) do { \
+    (v) = SHADE_SELECT((v) < (lo), zero + (lo), (v)); \
+    (v) = SHADE_SELECT((v) > (hi), zero + (hi), (v)); \
+} while (0)
+
+// Loads n cells of col starting at y; cells outside [0, height) are clamped
+static void shade_load(shade_vf *out, const int *col, int y, int n, int height) {
+    shade_vi v;
+    int l, yy;
+
+    if (y >= 0 && y + SHADE_LANES <= height && n == SHADE_LANES) {
+        memcpy(&v, col + y, sizeof(v));
+    } else {
+        for (l = 0; l < SHADE_LANES; l++) {
+            yy = y + (l < n ? l : n - 1);
+            yy = yy < 0 ? 0 : (yy >= height ? height - 1 : yy);
+            v[l] = col[yy];
+        }
+    }
+
+    *out = __builtin_convertvector(v, shade_vf);
+}
+
+static void shade_block(const int *lcol, const int *ccol, const int *rcol,
+        int x, int y, int n, int height, int mode, const shade_format_t *f,
+        uint32_t *pixels, int pitch) {
+    const shade_vf zero = { 0 };
+    shade_vf a, b, c, d, e, g, h, i, fr;
+    shade_vf dx, dy, len, nx, ny, nz, lit, value, red, green, blue;
+    shade_vi r8, g8, b8, pix, water;
+    int l;
+
+    shade_load(&a, lcol, y - 1, n, height);
+    shade_load(&b, ccol, y - 1, n, height);
+    shade_load(&c, rcol, y - 1, n, height);
+    shade_load(&d, lcol, y, n, height);
+    shade_load(&e, ccol, y, n, height);
+    shade_load(&fr, rcol, y, n, height);
+    shade_load(&g, lcol, y + 1, n, height);
+    shade_load(&h, ccol, y + 1, n, height);
+    shade_load(&i, rcol, y + 1, n, height);
+
+    // Horn's method
+    dx = ((c + 2 * fr + i) - (a + 2 * d + g)) * (SHADE_Z / 8 / f->cell);
+    dy = ((g + 2 * h + i) - (a + 2 * b + c)) * (SHADE_Z / 8 / f->cell);
+
+    len = dx * dx + dy * dy + 1;
+    for (l = 0; l < SHADE_LANES; l++)
+        len[l] = 1 / sqrtf(len[l]);
+    nx = -dx * len;
+    ny = -dy * len;
+    nz = len;
+
+    if (mode == SHADE_NORMALS) {
+        red = (nx + 1) * 127.5f;
+        green = (ny + 1) * 127.5f;
+        blue = (nz + 1) * 127.5f;
+    } else {
+        // Light from the north-west, 45 degrees up
+        lit = nx * -0.5f + ny * -0.5f + nz * 0.70710678f;
+        SHADE_CLAMP(lit, 0.0f, 1.0f);
+        lit = lit * 0.7f + 0.3f;
+
+        value = e;
+        SHADE_CLAMP(value, (float)f->minheight, (float)f->maxheight);
+        value = (value - (float)f->minheight) * (255.0f / (f->maxheight - f->minheight));
+
+        water = e < 0;
+        red = SHADE_SELECT(water, zero, zero + 30) * lit;
+        green = SHADE_SELECT(water, zero, value) * lit;
+        blue = SHADE_SELECT(water, value, zero + 30) * lit;
+    }
+
+    SHADE_CLAMP(red, 0.0f, 255.0f);
+    SHADE_CLAMP(green, 0.0f, 255.0f);
+    SHADE_CLAMP(blue, 0.0f, 255.0f);
+    r8 = __builtin_convertvector(red, shade_vi);
+    g8 = __builtin_convertvector(green, shade_vi);
+    b8 = __builtin_convertvector(blue, shade_vi);
+    pix = (r8 << f->rshift) | (g8 << f->gshift) | (b8 << f->bshift) | (int32_t)f->amask;
+
+    for (l = 0; l < n; l++)
+        pixels[(y + l) * pitch + x] = pix[l];
+}
+
+/*
+ * Shades columns [first, last) of the width x height map into pixels, a
+ * row-major buffer of 32 bit pixels with pitch pixels per row.
+ */
+static void shade_columns(const int *map, int stride, int width, int height,
+        uint32_t *pixels, int pitch, int first, int last, int mode,
+        const shade_format_t *f) {
+    const int *lcol, *ccol, *rcol;
+    int x, y, strip, end, n;
+
+    for (strip = first; strip < last; strip += SHADE_STRIP) {
+        end = strip + SHADE_STRIP < last ? strip + SHADE_STRIP : last;
+
+        for (y = 0; y < height; y += SHADE_LANES) {
+            n = height - y < SHADE_LANES ? height - y : SHADE_LANES;
+
+            for (x = strip; x < end; x++) {
+                lcol = map + (size_t)(x > 0 ? x - 1 : 0) * stride;
+                ccol = map + (size_t)x * stride;
+                rcol = map + (size_t)(x < width - 1 ? x + 1 : width - 1) * stride;
+                shade_block(lcol, ccol, rcol, x, y, n, height, mode, f, pixels, pitch);
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef __TUNE_H__
+#define __TUNE_H__
+
+/*
+ * Tuned parameters, per host and map size.
+ *
+ * A program run with -a searches its parameters on the machine it runs on
+ * and keeps the fastest in TUNE_FILE, as lines of
+ *
+ *   <program> <host> <width>x<height> <threads> <cutoff> <tile>
+ *
+ * Later runs on that host load their line before reading the command line,
+ * so options still override it. What the cutoff and the tile are is up to
+ * the program, 0 where it has no such thing. Saving replaces only the line
+ * of the program, host and size, so one file can serve several machines
+ * sharing a directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define TUNE_FILE "frac.tune"
+#define TUNE_MAX_CANDIDATES 32
+
+typedef struct {
+    int threads;
+    int cutoff;
+    int tile;
+} tune_t;
+
+static void tune_host(char *host, size_t size) {
+    if (gethostname(host, size) || !host[0])
+        snprintf(host, size, "unknown");
+    host[size - 1] = '\0';
+}
+
+/*
+ * Fills *t from the line of program on this host for a width x height map
+ * in path. Returns 0 if there is one, -1 if not.
+ */
+static int tune_load(const char *path, const char *program, int width, int height, tune_t *t) {
+    char line[256], p[64], host[64], n[64];
+    int w, h, threads, cutoff, tile;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    tune_host(host, sizeof(host));
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%63s %63s %dx%d %d %d %d", p, n, &w, &h, &threads, &cutoff, &tile) != 7)
+            continue;
+        if (strcmp(p, program) || strcmp(n, host) || w != width || h != height || threads < 1)
+            continue;
+
+        fclose(f);
+        t->threads = threads;
+        t->cutoff = cutoff;
+        t->tile = tile;
+        return 0;
+    }
+    fclose(f);
+
+    return -1;
+}
+
+// Replaces (or adds) the line of program on this host for a width x height
+// map in path. Returns 0 on success, -1 if the file cannot be written.
+static int tune_save(const char *path, const char *program, int width, int height, const tune_t *t) {
+    char line[256], p[64], host[64], n[64], tmp[512];
+    FILE *in, *out;
+    int w, h;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    out = fopen(tmp, "w");
+    if (!out) {
+        perror(tmp);
+        return -1;
+    }
+
+    tune_host(host, sizeof(host));
+    in = fopen(path, "r");
+    while (in && fgets(line, sizeof(line), in)) {
+        if (sscanf(line, "%63s %63s %dx%d", p, n, &w, &h) == 4
+                && !strcmp(p, program) && !strcmp(n, host) && w == width && h == height)
+            continue;
+        fputs(line, out);
+    }
+    if (in)
+        fclose(in);
+
+    fprintf(out, "%s %s %dx%d %d %d %d\n", program, host, width, height,
+        t->threads, t->cutoff, t->tile);
+    if (fclose(out) || rename(tmp, path)) {
+        perror(path);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Thread counts worth trying: the powers of 2 below the number of cpus,
+// and that number. Returns how many it put in counts.
+static int tune_thread_counts(int *counts) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = 0, c;
+
+    if (cpus < 1)
+        cpus = 1;
+    for (c = 1; c < cpus && n < TUNE_MAX_CANDIDATES - 1; c *= 2)
+        counts[n++] = c;
+    counts[n++] = (int)cpus;
+
+    return n;
+}
+
+/*
+ * Sets *param to each of the n candidates in turn and times it with
+ * time(), which returns a negative time for a candidate that does not go
+ * with the other parameters. Leaves *param at the fastest and returns its
+ * time.
+ */
+static double tune_pick(const char *tag, const char *name, int *param, const int *candidates,
+        int n, double (*time)(void)) {
+    double t, best = -1;
+    int i, pick = *param;
+
+    for (i = 0; i < n; i++) {
+        *param = candidates[i];
+        t = time();
+        if (t < 0)
+            continue;
+
+        printf("%s Tune %s %d: %lf\n", tag, name, candidates[i], t);
+        if (best < 0 || t < best) {
+            best = t;
+            pick = candidates[i];
+        }
+    }
+    *param = pick;
+
+    return best;
+}
+
+#endif
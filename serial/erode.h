@@ -0,0 +1,247 @@
+#ifndef __ERODE_H__
+#define __ERODE_H__
+
+/*
+ * Hydraulic erosion by water droplets.
+ *
+ * Each droplet starts at a random cell, runs downhill with some inertia,
+ * picks up sediment while it is fast and the ground is steep, drops it
+ * where it slows down or climbs, and slowly evaporates. What it still
+ * carries when it stops is left there, so no material is lost. Heights
+ * and gradients between cells are interpolated bilinearly, and erosion
+ * and deposits are shared between the four cells around the droplet.
+ *
+ * The map is split into ERODE_TILE x ERODE_TILE tiles and a droplet never
+ * leaves the tile it started in: it stops at the tile border. Tiles
+ * therefore never touch each other's cells and can be eroded by any
+ * thread, in any order, with no locking. To keep the tile borders from
+ * showing, the droplets are spread over ERODE_ROUNDS rounds and the tile
+ * grid is shifted by a different offset each round, so rounds must run one
+ * after the other.
+ *
+ * Every tile draws its droplets from its own generator seeded with the
+ * seed, the round and the tile number, so a given seed and map always
+ * give the same result, whatever the number of threads.
+ *
+ * erode_tile copies its tile into a float buffer of the calling thread,
+ * runs the droplets there and rounds the result back into the map.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#define ERODE_TILE 256
+#define ERODE_ROUNDS 4
+
+// Droplet physics, for heights scaled by ERODE_SCALE
+#define ERODE_SCALE (1.0f / 1024)
+#define ERODE_LIFETIME 30
+#define ERODE_INERTIA 0.05f
+#define ERODE_CAPACITY 4.0f
+#define ERODE_MIN_CAPACITY 0.01f
+#define ERODE_ERODE 0.3f
+#define ERODE_DEPOSIT 0.3f
+#define ERODE_EVAPORATE 0.01f
+#define ERODE_GRAVITY 4.0f
+
+typedef struct {
+    long droplets;   // per map, over all rounds
+    unsigned seed;
+} erode_params_t;
+
+// Tile of the calling thread, grown as needed
+static __thread float *erode_buf;
+static __thread size_t erode_buf_size;
+
+/*
+ * Parses "droplets[:seed]" into p, the seed defaulting to 1. Returns 0 on
+ * success, -1 on a malformed spec.
+ */
+static int erode_parse(erode_params_t *p, const char *spec) {
+    char *end;
+
+    p->droplets = strtol(spec, &end, 10);
+    p->seed = 1;
+    if (end == spec || p->droplets < 0)
+        return -1;
+    if (*end == ':') {
+        spec = end + 1;
+        p->seed = strtoul(spec, &end, 10);
+        if (end == spec)
+            return -1;
+    }
+
+    return *end ? -1 : 0;
+}
+
+// splitmix64, seeded per tile
+static uint64_t erode_next(uint64_t *s) {
+    uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, 1)
+static float erode_uniform(uint64_t *s) {
+    return (erode_next(s) >> 40) * (1.0f / (1 << 24));
+}
+
+// Tiles per round; the shifted grid needs one more row and column
+static int erode_tiles(int width, int height) {
+    return (width / ERODE_TILE + 1) * (height / ERODE_TILE + 1);
+}
+
+// Height and gradient at (x, y) of the w x h tile buf, stored by columns
+static float erode_sample(const float *buf, int h, float x, float y, float *gx, float *gy) {
+    int ix = (int)x, iy = (int)y;
+    float u = x - ix, v = y - iy;
+    float nw, ne, sw, se;
+
+    nw = buf[(size_t)ix * h + iy];
+    ne = buf[(size_t)(ix + 1) * h + iy];
+    sw = buf[(size_t)ix * h + iy + 1];
+    se = buf[(size_t)(ix + 1) * h + iy + 1];
+
+    *gx = (ne - nw) * (1 - v) + (se - sw) * v;
+    *gy = (sw - nw) * (1 - u) + (se - ne) * u;
+
+    return nw * (1 - u) * (1 - v) + ne * u * (1 - v) + sw * (1 - u) * v + se * u * v;
+}
+
+// Adds amount to the four cells around (x, y), split bilinearly
+static void erode_add(float *buf, int h, float x, float y, float amount) {
+    int ix = (int)x, iy = (int)y;
+    float u = x - ix, v = y - iy;
+
+    buf[(size_t)ix * h + iy] += amount * (1 - u) * (1 - v);
+    buf[(size_t)(ix + 1) * h + iy] += amount * u * (1 - v);
+    buf[(size_t)ix * h + iy + 1] += amount * (1 - u) * v;
+    buf[(size_t)(ix + 1) * h + iy + 1] += amount * u * v;
+}
+
+static void erode_droplet(float *buf, int w, int h, uint64_t *rng) {
+    float x, y, dx = 0, dy = 0, len;
+    float speed = 1, water = 1, sediment = 0;
+    float height, next, diff, capacity, amount, gx, gy, ox, oy;
+    int step;
+
+    x = erode_uniform(rng) * (w - 1);
+    y = erode_uniform(rng) * (h - 1);
+
+    for (step = 0; step < ERODE_LIFETIME; step++) {
+        height = erode_sample(buf, h, x, y, &gx, &gy);
+
+        dx = dx * ERODE_INERTIA - gx * (1 - ERODE_INERTIA);
+        dy = dy * ERODE_INERTIA - gy * (1 - ERODE_INERTIA);
+        len = sqrtf(dx * dx + dy * dy);
+        if (len == 0)
+            break;
+        dx /= len;
+        dy /= len;
+
+        ox = x;
+        oy = y;
+        x += dx;
+        y += dy;
+
+        // Stay inside the tile, including the cells right of and below
+        if (x < 0 || y < 0 || x >= w - 1 || y >= h - 1) {
+            x = ox;
+            y = oy;
+            break;
+        }
+
+        next = erode_sample(buf, h, x, y, &gx, &gy);
+        diff = next - height;
+
+        capacity = -diff * speed * water * ERODE_CAPACITY;
+        if (capacity < ERODE_MIN_CAPACITY)
+            capacity = ERODE_MIN_CAPACITY;
+
+        if (diff > 0 || sediment > capacity) {
+            // Fill the pit it climbs out of, or shed what it cannot carry
+            amount = diff > 0 ? (diff < sediment ? diff : sediment)
+                              : (sediment - capacity) * ERODE_DEPOSIT;
+            sediment -= amount;
+            erode_add(buf, h, ox, oy, amount);
+        } else {
+            // Never dig below the point it flows to
+            amount = (capacity - sediment) * ERODE_ERODE;
+            if (amount > -diff)
+                amount = -diff;
+            sediment += amount;
+            erode_add(buf, h, ox, oy, -amount);
+        }
+
+        speed = speed * speed + diff * -ERODE_GRAVITY;
+        speed = speed > 0 ? sqrtf(speed) : 0;
+        water *= 1 - ERODE_EVAPORATE;
+    }
+
+    // Whatever it still carries settles where it stopped
+    erode_add(buf, h, x, y, sediment);
+}
+
+/*
+ * Erodes tile t of round r of the width x height map, stored column by
+ * column with stride ints per column. Every tile of a round may run
+ * concurrently with the others.
+ */
+static void erode_tile(const erode_params_t *p, int *map, int stride,
+        int width, int height, int r, int t) {
+    int tiles_x = width / ERODE_TILE + 1;
+    int ox, oy, x0, x1, y0, y1, w, h, x, y;
+    long long n, i;
+    uint64_t rng;
+    size_t need;
+
+    // This round's grid offset, the same for every tile
+    rng = ((uint64_t)p->seed << 32) ^ (uint64_t)r * 0x51ed27;
+    ox = erode_next(&rng) % ERODE_TILE;
+    oy = erode_next(&rng) % ERODE_TILE;
+
+    x0 = (t % tiles_x) * ERODE_TILE - ox;
+    y0 = (t / tiles_x) * ERODE_TILE - oy;
+    x1 = x0 + ERODE_TILE < width ? x0 + ERODE_TILE : width;
+    y1 = y0 + ERODE_TILE < height ? y0 + ERODE_TILE : height;
+    x0 = x0 > 0 ? x0 : 0;
+    y0 = y0 > 0 ? y0 : 0;
+    w = x1 - x0;
+    h = y1 - y0;
+    if (w < 2 || h < 2)
+        return;
+
+    // Droplets in proportion to the tile's area
+    n = (long long)p->droplets * w * h / ((long long)width * height * ERODE_ROUNDS);
+    if (!n)
+        return;
+
+    need = (size_t)w * h;
+    if (need > erode_buf_size) {
+        free(erode_buf);
+        erode_buf = (float *) malloc(need * sizeof(float));
+        if (!erode_buf) {
+            perror("erosion buffer");
+            exit(1);
+        }
+        erode_buf_size = need;
+    }
+
+    for (x = 0; x < w; x++)
+        for (y = 0; y < h; y++)
+            erode_buf[(size_t)x * h + y] = map[(size_t)(x0 + x) * stride + y0 + y] * ERODE_SCALE;
+
+    rng ^= (uint64_t)t * 0x9e3779b97f4a7c15ULL;
+    for (i = 0; i < n; i++)
+        erode_droplet(erode_buf, w, h, &rng);
+
+    for (x = 0; x < w; x++)
+        for (y = 0; y < h; y++)
+            map[(size_t)(x0 + x) * stride + y0 + y] = lrintf(erode_buf[(size_t)x * h + y] / ERODE_SCALE);
+}
+
+#endif
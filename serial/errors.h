@@ -0,0 +1,34 @@
+#ifndef __ERRORS_H__
+#define __ERRORS_H__
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Define a macro that can be used for diagnostic output from
+ * examples. When compiled -DDEBUG, it results in calling printf
+ * with the specified argument list. When DEBUG is not defined, it
+ * expands to nothing.
+ */
+#ifdef DEBUG
+# define DPRINTF(arg) printf arg
+#else
+# define DPRINTF(arg)
+#endif
+
+
+#define err_abort(code,text) do { \
+    fprintf (stderr, "%s at \"%s\":%d: %s\n", \
+        text, __FILE__, __LINE__, strerror (code)); \
+    abort (); \
+    } while (0)
+#define errno_abort(text) do { \
+    fprintf (stderr, "%s at \"%s\":%d: %s\n", \
+        text, __FILE__, __LINE__, strerror (errno)); \
+    abort (); \
+    } while (0)
+
+#endif
\ No newline at end of file
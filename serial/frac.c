@@ -3,6 +3,23 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+
+#include "errors.h"
+#include <pthread.h>
+#include "trace.h"
+#include "tilemap.h"
+#include "perf.h"
+#include "shade.h"
+#include "post.h"
+#include "erode.h"
+#include "hugemem.h"
+#include "noise.h"
+#include "regress.h"
+#include "kbench.h"
+#include "dirty.h"
+#include "mip.h"
+#include "cancel.h"
 
 #define WIDTH 4096
 #define HEIGHT 4096
@@ -14,6 +31,28 @@
 #define RANGE_CHANGE 13000
 #define REDUCTION 0.7
 
+// Terrain engines, picked with -g. The noise engine's first octave has a
+// lattice point every NOISE_PERIOD cells.
+#define ENGINE_DIAMOND 0
+#define ENGINE_NOISE 1
+#define ENGINES 2
+#define NOISE_PERIOD 1024
+#define NOISE_AMPLITUDE (RANGE_CHANGE * 1.5f)
+
+// Where the S key saves the map on screen
+#define MAP_FILE "frac_map.tmap"
+#define MAP_TILE 256
+
+// SDL_USEREVENT code the generator posts when a map is ready
+#define EVENT_MAP_READY 1
+
+// Columns of noise filled between checks for cancellation
+#define CANCEL_COLUMNS 64
+
+// Side of the corner of the map -k runs its cache-resident inputs over:
+// 128 columns of 512 bytes, which fits in any L2
+#define KBENCH_CACHE_EXTENT 128
+
 
 typedef struct {
     int x;
@@ -22,28 +61,130 @@ typedef struct {
 
 
 SDL_Surface *screen;
-int heightmap[WIDTH][HEIGHT];
+// What changed on screen since the last update (see dirty.h)
+dirty_t dirty;
 SDL_Event event;
 
+// Double buffering: make_map always fills heightmap while the map in front
+// is on screen. A background thread prepares the next map and its pixels in
+// back_surface; showing it swaps the two heightmap pointers. Post-processing
+// writes into spare and swaps it with heightmap. The maps and the
+// off-screen pixels are on huge pages (see hugemem.h).
+int (*heightmaps)[WIDTH + 1][HEIGHT + 1];
+int (*heightmap)[HEIGHT + 1];
+int (*front)[HEIGHT + 1];
+int (*spare)[HEIGHT + 1];
+int heightmaps_kind;
+SDL_Surface *back_surface;
+
+// Pyramids of heightmap and front down to the level on screen, which is
+// 2^zoom times smaller than the map (-z). They swap along with the maps.
+mip_t mips[2];
+mip_t *mip = &mips[0], *front_mip = &mips[1];
+int zoom;
+
+pthread_mutex_t swap_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t swap_cv = PTHREAD_COND_INITIALIZER;
+int next_ready, stop_signal;
+double next_time;
+
+// Set by space until a map is on screen, and when space was pressed
+int want_map;
+struct timespec want_time;
+
+// How maps are drawn (H cycles through them); next_mode is the mode
+// back_surface was drawn in
+int shade_mode = SHADE_FLAT;
+int next_mode;
+
+// Stages run over every new map, set with -p
+post_pipeline_t post;
+
+// Droplets run over every new map before post-processing, set with -e
+erode_params_t erosion;
+
+// Seed of the map being made
+unsigned map_seed;
+
+// Escape drops the map the generator is making (see cancel.h); map_gen is
+// its number
+cancel_t cancel;
+unsigned map_gen;
+
+static const char *engine_names[ENGINES] = { "diamond", "noise" };
+int engine = ENGINE_DIAMOND;
+
+// What -r checks: every engine alone, then diamond-square through the rest
+// of the pipeline, each with the checksum every build must make
+static const regress_case_t regress_cases[] = {
+    { "diamond", ENGINE_DIAMOND, "0", "", 1, 0x76d98ab6450dcb5bULL },
+    { "noise", ENGINE_NOISE, "0", "", 2, 0xfaa7e67d3b9dbf9fULL },
+    { "pipeline", ENGINE_DIAMOND, "200000:3", "blur:2,thermal:4,terrace:12", 3, 0x01e7ba0abec14f87ULL },
+};
+
 static void square_step(SDL_Rect *r, float deviance);
 static void get_keypress(void);
 static void shift_all(int amnt);
 
-static int rand_range(int low, int high) {
-    return rand() % (high - low) + low;
+// The random offset of cell (x, y) in the map made from seed, in
+// [low, high). A hash of the position rather than rand(), so that a seed
+// always gives the same map, whoever computes which cells in which order.
+static int cell_rand(unsigned seed, int x, int y, int low, int high) {
+    uint32_t v = seed ^ (uint32_t)x * 0x9e3779b1U ^ (uint32_t)y * 0x85ebca77U;
+
+    v ^= v >> 16;
+    v *= 0x7feb352dU;
+    v ^= v >> 15;
+    v *= 0x846ca68bU;
+    v ^= v >> 16;
+
+    return (int)(v % (uint32_t)(high - low)) + low;
+}
+
+static void alloc_heightmaps(void) {
+    heightmaps = huge_alloc(3 * sizeof(heightmaps[0]));
+    heightmaps_kind = huge_kind;
+    heightmap = heightmaps[0];
+    front = heightmaps[1];
+    spare = heightmaps[2];
+    mip_init(&mips[0], WIDTH, HEIGHT, HEIGHT + 1, zoom + 1);
+    mip_init(&mips[1], WIDTH, HEIGHT, HEIGHT + 1, zoom + 1);
 }
 
-static void set_point(int x, int y, int value) {
+// A w x h off-screen surface with its pixels on huge pages. SDL leaves
+// pixels it was given alone, so free_surface unmaps them.
+static SDL_Surface *create_surface(int w, int h, Uint32 rmask, Uint32 gmask, Uint32 bmask) {
+    SDL_Surface *s;
+
+    s = SDL_CreateRGBSurfaceFrom(huge_alloc((size_t)w * h * 4), w, h, 32,
+        w * 4, rmask, gmask, bmask, 0);
+    if (!s) {
+        fprintf(stderr, "SDL_CreateRGBSurfaceFrom: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    return s;
+}
+
+static void free_surface(SDL_Surface *s) {
+    void *pixels = s->pixels;
+    size_t bytes = (size_t)s->w * s->h * 4;
+
+    SDL_FreeSurface(s);
+    huge_free(pixels, bytes);
+}
+
+static void set_point(SDL_Surface *s, int x, int y, Uint32 value) {
     Uint32 *pix;
     int offset;
 
-    pix = screen->pixels;
-    offset = x + y * screen->w;
+    pix = s->pixels;
+    offset = x + y * s->w;
 
     pix[offset] = value;
 }
 
-static Uint32 height_to_colour(int height) {
+static Uint32 height_to_colour(int height, SDL_Surface *s) {
     int value;
     int range;
 
@@ -55,17 +196,39 @@ static Uint32 height_to_colour(int height) {
     value = ((float)(height - MINHEIGHT) / range) * 255;
 
     if (height < 0)
-        return SDL_MapRGB(screen->format, 0, 0, value);
-    return SDL_MapRGB(screen->format, 30, value, 30);
-    return SDL_MapRGB(screen->format, value, value, value);
+        return SDL_MapRGB(s->format, 0, 0, value);
+    return SDL_MapRGB(s->format, 30, value, 30);
+    return SDL_MapRGB(s->format, value, value, value);
 }
 
-static void heightmap_to_screen(void) {
+// Colours the level of pyramid m that is as wide as s
+static void heightmap_to_surface(mip_t *m, SDL_Surface *s, int mode) {
+    shade_format_t f;
     int i, e;
-
-    for (e = 0; e < HEIGHT; ++e)
-        for (i = 0; i < WIDTH; ++i)
-            set_point(i, e, height_to_colour(heightmap[i][e]));
+    perf_sample_t ps;
+    int level = mip_level_for(m, s->w);
+    const int *map = m->data[level];
+    int stride = m->stride[level];
+
+    TRACE_BEGIN(colour);
+    perf_begin(&ps);
+    if (mode != SHADE_FLAT) {
+        f.rshift = s->format->Rshift;
+        f.gshift = s->format->Gshift;
+        f.bshift = s->format->Bshift;
+        f.amask = s->format->Amask;
+        f.minheight = MINHEIGHT;
+        f.maxheight = MAXHEIGHT;
+        f.cell = 1 << level;
+        shade_columns(map, stride, m->w[level], m->h[level], s->pixels, s->pitch / 4,
+            0, m->w[level], mode, &f);
+    } else {
+        for (e = 0; e < m->h[level]; ++e)
+            for (i = 0; i < m->w[level]; ++i)
+                set_point(s, i, e, height_to_colour(map[(size_t)i * stride + e], s));
+    }
+    perf_end(&ps, PERF_PHASE_COLOUR);
+    TRACE_END(colour, "colour", -1);
 }
 
 static int rect_avg_heights(SDL_Rect *r) {
@@ -116,7 +279,8 @@ static void draw_all_squares(int w, int h, float deviance) {
 
     for (r.y = 0; r.y < HEIGHT; r.y += r.h)
         for (r.x = 0; r.x < WIDTH; r.x += r.w)
-            heightmap[r.x + r.w / 2][r.y + r.h / 2] = rect_avg_heights(&r) + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
+            heightmap[r.x + r.w / 2][r.y + r.h / 2] = rect_avg_heights(&r)
+                + cell_rand(map_seed, r.x + r.w / 2, r.y + r.h / 2, -RANGE_CHANGE, RANGE_CHANGE) * deviance;
 }
 
 static void draw_all_diamonds(int w, int h, float deviance) {
@@ -126,39 +290,100 @@ static void draw_all_diamonds(int w, int h, float deviance) {
 
     for (r.y = 0 - r.h / 2; r.y < HEIGHT; r.y += r.h)
         for (r.x = 0; r.x < WIDTH; r.x += r.w)
-            heightmap[r.x + r.w / 2][r.y + r.h / 2] = diam_avg_heights(&r) + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
+            heightmap[r.x + r.w / 2][r.y + r.h / 2] = diam_avg_heights(&r)
+                + cell_rand(map_seed, r.x + r.w / 2, r.y + r.h / 2, -RANGE_CHANGE, RANGE_CHANGE) * deviance;
     for (r.y = 0; r.y < HEIGHT; r.y += r.h)
         for (r.x = 0 - r.w / 2; r.x + r.w / 2 < WIDTH; r.x += r.w)
-            heightmap[r.x + r.w / 2][r.y + r.h / 2] = diam_avg_heights(&r) + rand_range(-RANGE_CHANGE, RANGE_CHANGE) * deviance;
+            heightmap[r.x + r.w / 2][r.y + r.h / 2] = diam_avg_heights(&r)
+                + cell_rand(map_seed, r.x + r.w / 2, r.y + r.h / 2, -RANGE_CHANGE, RANGE_CHANGE) * deviance;
 }
 
-static void shift_all(int amnt) {
+// Save the map on screen as a tiled, compressed file
+static void save_map(void) {
+    if (tilemap_write(MAP_FILE, &front[0][0], HEIGHT + 1, WIDTH, HEIGHT, MAP_TILE, sysconf(_SC_NPROCESSORS_ONLN)))
+        perror(MAP_FILE);
+    else
+        printf("[SERIAL] Saved %s\n", MAP_FILE);
+}
+
+// Raises the width x height corner of map by amnt
+static void shift_block(int (*map)[HEIGHT + 1], int width, int height, int amnt) {
     int i, e;
-    for (e = 0; e < HEIGHT; ++e)
-        for (i = 0; i < WIDTH; ++i)
-            heightmap[i][e] += amnt;
+    for (e = 0; e < height; ++e)
+        for (i = 0; i < width; ++i)
+            map[i][e] += amnt;
+}
+
+static void shift_all(int amnt) {
+    shift_block(front, WIDTH, HEIGHT, amnt);
+    mip_shift(front_mip, amnt);
+}
+
+static int cancelled(void) {
+    return cancel_check(&cancel, map_gen);
+}
+
+// Fills the whole heightmap, edges included, with fractal noise, a band of
+// CANCEL_COLUMNS columns at a time
+static void make_noise_map(void) {
+    noise_params_t p;
+    perf_sample_t ps;
+    int x;
+
+    noise_init(&p, map_seed, NOISE_PERIOD, REDUCTION, NOISE_AMPLITUDE);
+
+    TRACE_BEGIN(noise);
+    perf_begin(&ps);
+    for (x = 0; x < WIDTH + 1 && !cancelled(); x += CANCEL_COLUMNS)
+        noise_fill(&p, &heightmap[0][0], HEIGHT + 1, x, x + CANCEL_COLUMNS < WIDTH + 1 ? x + CANCEL_COLUMNS : WIDTH + 1,
+            0, HEIGHT + 1);
+    perf_end(&ps, PERF_PHASE_NOISE);
+    TRACE_END(noise, "noise", -1);
 }
 
-static void make_map(void) {
+static void make_map(unsigned seed) {
     int w = WIDTH;
     int h = HEIGHT;
     float deviance;
     int i, e;
+    int level = 0;
+    perf_sample_t ps;
 
-    //Reset the whole heightmap to the minimum height
-    for (e = 0; e < HEIGHT; ++e)
-        for (i = 0; i < WIDTH; ++i)
+    map_seed = seed;
+    if (engine == ENGINE_NOISE) {
+        make_noise_map();
+        return;
+    }
+
+    //Reset the whole heightmap, edges included, to the minimum height. The
+    //edges are read as neighbours, so leftovers there would leak between maps
+    TRACE_BEGIN(reset);
+    perf_begin(&ps);
+    for (e = 0; e <= HEIGHT; ++e)
+        for (i = 0; i <= WIDTH; ++i)
             heightmap[i][e] = MINHEIGHT;
+    perf_end(&ps, PERF_PHASE_RESET);
+    TRACE_END(reset, "reset", -1);
 
     //Add our starting corner points
-    heightmap[0][0] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
-    heightmap[0][HEIGHT] = rand_range(-RANGE_CHANGE, RANGE_CHANGE);
+    heightmap[0][0] = cell_rand(map_seed, 0, 0, -RANGE_CHANGE, RANGE_CHANGE);
+    heightmap[0][HEIGHT] = cell_rand(map_seed, 0, HEIGHT, -RANGE_CHANGE, RANGE_CHANGE);
 
     deviance = 1.0;
-    while (1) {
+    while (!cancelled()) {
+        perf_begin(&ps);
+
+        TRACE_BEGIN(square);
         draw_all_squares(w, h, deviance);
+        TRACE_END(square, "square", level);
+
+        TRACE_BEGIN(diamond);
         draw_all_diamonds(w, h, deviance);
+        TRACE_END(diamond, "diamond", level);
+
+        perf_end(&ps, PERF_LEVEL(level));
 
+        level++;
         w /= 2;
         h /= 2;
 
@@ -174,64 +399,591 @@ static void make_map(void) {
     }
 }
 
+// Runs the droplet erosion over heightmap, round by round
+static void erode_map(void) {
+    int r, t;
+    perf_sample_t ps;
+
+    if (!erosion.droplets)
+        return;
+
+    TRACE_BEGIN(erode);
+    perf_begin(&ps);
+    for (r = 0; r < ERODE_ROUNDS; r++)
+        for (t = 0; t < erode_tiles(WIDTH, HEIGHT) && !cancelled(); t++)
+            erode_tile(&erosion, &heightmap[0][0], HEIGHT + 1, WIDTH, HEIGHT, r, t);
+    perf_end(&ps, PERF_PHASE_ERODE);
+    TRACE_END(erode, "erode", -1);
+}
 
-int main(void) {
+// Runs the post-processing pipeline over heightmap, tile by tile
+static void post_process(void) {
+    int (*tmp)[HEIGHT + 1];
+    int t;
+    perf_sample_t ps;
+
+    if (!post.nstages)
+        return;
+
+    TRACE_BEGIN(post);
+    perf_begin(&ps);
+    for (t = 0; t < post_tiles(WIDTH, HEIGHT) && !cancelled(); t++)
+        post_tile(&post, &heightmap[0][0], &spare[0][0], HEIGHT + 1, WIDTH, HEIGHT, t);
+    perf_end(&ps, PERF_PHASE_POST);
+    TRACE_END(post, "post", -1);
+
+    tmp = heightmap;
+    heightmap = spare;
+    spare = tmp;
+}
 
-    // Init SDL
-    srand(time(NULL));
-    SDL_Init(SDL_INIT_EVERYTHING);
-    screen = SDL_SetVideoMode(WIDTH, HEIGHT, 32, SDL_HWSURFACE);
+// Builds the pyramid of the finished heightmap down to the level on screen
+static void build_mip(void) {
+    int k;
 
+    TRACE_BEGIN(mip);
+    mip_attach(mip, &heightmap[0][0]);
+    for (k = 1; k < mip->levels; k++)
+        mip_reduce(mip, k, 0, mip->w[k]);
+    TRACE_END(mip, "mip", -1);
+}
+
+// Wakes the event loop up with EVENT_MAP_READY. SDL_PushEvent may be
+// called from any thread.
+static void post_map_ready(void) {
+    SDL_Event e;
+
+    e.type = SDL_USEREVENT;
+    e.user.code = EVENT_MAP_READY;
+    e.user.data1 = NULL;
+    e.user.data2 = NULL;
+    if (SDL_PushEvent(&e))
+        fprintf(stderr, "SDL_PushEvent: %s\n", SDL_GetError());
+}
+
+// Background generator: fills heightmap and back_surface whenever the
+// previous map has been taken, and posts an event when it is done
+static void *generator(void *args) {
     struct timespec start, stop;
+    int status;
+    int mode;
+
+    while (1) {
+        status = pthread_mutex_lock(&swap_mutex);
+        if (status) err_abort(status, "lock mutex");
+
+        while (next_ready && !stop_signal) {
+            status = pthread_cond_wait(&swap_cv, &swap_mutex);
+            if (status) err_abort(status, "wait for condition");
+        }
+
+        mode = shade_mode;
+
+        status = pthread_mutex_unlock(&swap_mutex);
+        if (status) err_abort(status, "unlock mutex");
+
+        if (stop_signal)
+            break;
+
+        clock_gettime(CLOCK_REALTIME, &start);
+        map_gen = cancel_begin(&cancel);
+        make_map(rand());
+        erode_map();
+        post_process();
+        if (cancelled())
+            continue;
+        build_mip();
+        heightmap_to_surface(mip, back_surface, mode);
+        clock_gettime(CLOCK_REALTIME, &stop);
+
+        status = pthread_mutex_lock(&swap_mutex);
+        if (status) err_abort(status, "lock mutex");
+
+        next_time = ( stop.tv_sec - start.tv_sec )
+                 + (double)( stop.tv_nsec - start.tv_nsec )
+                   / (double)BILLION;
+        next_mode = mode;
+        next_ready = 1;
+        status = pthread_cond_broadcast(&swap_cv);
+        if (status) err_abort(status, "signal condition");
+
+        status = pthread_mutex_unlock(&swap_mutex);
+        if (status) err_abort(status, "unlock mutex");
+
+        post_map_ready();
+    }
+
+    return NULL;
+}
+
+// Put the prepared map on screen and let the generator start the next one.
+// Returns 0 without waiting if the generator has not finished yet.
+static int show_next_map(void) {
+    int (*tmp)[HEIGHT + 1];
+    mip_t *swap_mip;
+    int status;
+
+    status = pthread_mutex_lock(&swap_mutex);
+    if (status) err_abort(status, "lock mutex");
+
+    if (!next_ready) {
+        status = pthread_mutex_unlock(&swap_mutex);
+        if (status) err_abort(status, "unlock mutex");
+        return 0;
+    }
+
+    tmp = front;
+    front = heightmap;
+    heightmap = tmp;
+    swap_mip = front_mip;
+    front_mip = mip;
+    mip = swap_mip;
+    // The mode may have changed while the map was being made
+    if (next_mode == shade_mode)
+        SDL_BlitSurface(back_surface, NULL, screen, NULL);
+    else
+        heightmap_to_surface(front_mip, screen, shade_mode);
+    printf("[SERIAL] Make_map: %lf\n", next_time);
+
+    next_ready = 0;
+    status = pthread_cond_broadcast(&swap_cv);
+    if (status) err_abort(status, "signal condition");
+
+    status = pthread_mutex_unlock(&swap_mutex);
+    if (status) err_abort(status, "unlock mutex");
+
+    dirty_add(&dirty, 0, 0, screen->w, screen->h);
+    dirty_flush(&dirty, screen);
+    return 1;
+}
+
+// Shows the next map if space asked for one and it is ready; otherwise the
+// generator's EVENT_MAP_READY calls this again
+static void take_next_map(void) {
+    struct timespec stop;
     double accum;
 
-    // Measure time to make initial map
-    clock_gettime(CLOCK_REALTIME, &start);
-    make_map();
-    heightmap_to_screen();
+    if (!want_map || !show_next_map())
+        return;
+    want_map = 0;
+
     clock_gettime(CLOCK_REALTIME, &stop);
+    accum = ( stop.tv_sec - want_time.tv_sec )
+        + (double)( stop.tv_nsec - want_time.tv_nsec )
+            / (double)BILLION;
+    printf("[SERIAL] Overall time on key pressed event: %lf\n", accum);
+}
 
-    accum = ( stop.tv_sec - start.tv_sec )
-             + (double)( stop.tv_nsec - start.tv_nsec )
-               / (double)1000000000;
-    printf("[SERIAL] Make_map: %lf\n", accum);
-    SDL_Flip(screen);
+// Switch to the next drawing mode and redraw the map on screen with it
+static void cycle_shade_mode(void) {
+    int status;
 
-    // Poll SDL events
-    while (1) {
-        SDL_PollEvent(&event);
+    status = pthread_mutex_lock(&swap_mutex);
+    if (status) err_abort(status, "lock mutex");
+
+    shade_mode = (shade_mode + 1) % SHADE_MODES;
+
+    status = pthread_mutex_unlock(&swap_mutex);
+    if (status) err_abort(status, "unlock mutex");
+
+    heightmap_to_surface(front_mip, screen, shade_mode);
+    printf("[SERIAL] Shading: %s\n", shade_names[shade_mode]);
+    dirty_add(&dirty, 0, 0, screen->w, screen->h);
+    dirty_flush(&dirty, screen);
+}
+
+// Generate maps back to back into an off-screen surface, timing each one
+// and collecting hardware counters per phase
+static void benchmark(int maps) {
+    struct timespec start, stop;
+    double accum, total = 0;
+    int n, screen_kind;
+
+    screen = create_surface(WIDTH >> zoom, HEIGHT >> zoom, 0x00ff0000, 0x0000ff00, 0x000000ff);
+    screen_kind = huge_kind;
+
+    perf_enabled = 1;
+    for (n = 0; n < maps; n++) {
+        clock_gettime(CLOCK_REALTIME, &start);
+        make_map(rand());
+        erode_map();
+        post_process();
+        build_mip();
+        heightmap_to_surface(mip, screen, shade_mode);
+        clock_gettime(CLOCK_REALTIME, &stop);
+
+        accum = ( stop.tv_sec - start.tv_sec )
+                 + (double)( stop.tv_nsec - start.tv_nsec )
+                   / (double)BILLION;
+        total += accum;
+        printf("[SERIAL] Map %d: %lf\n", n, accum);
+    }
 
-        if (event.type == SDL_KEYDOWN) {
-            if (event.key.keysym.sym == SDLK_ESCAPE) {
+    printf("[SERIAL] Benchmark: %d maps, %s, mean %lf\n", maps, engine_names[engine], total / maps);
+    perf_report("[SERIAL]");
+    huge_report("[SERIAL]", "Heightmaps", heightmaps, 3 * sizeof(heightmaps[0]), heightmaps_kind);
+    huge_report("[SERIAL]", "Framebuffer", screen->pixels, (size_t)screen->w * screen->h * 4, screen_kind);
+
+    free_surface(screen);
+}
+
+// The kernels -k times, one level's worth of work each, as in make_map
+static long kernel_rect_avg(int extent, int stride, size_t *bytes) {
+    SDL_Rect r;
+    long sum = 0, cells = 0;
+
+    r.w = stride;
+    r.h = stride;
+    for (r.y = 0; r.y < extent; r.y += r.h) {
+        for (r.x = 0; r.x < extent; r.x += r.w) {
+            sum += rect_avg_heights(&r);
+            cells++;
+        }
+    }
+
+    kbench_sink += sum;
+    *bytes = cells * 4 * sizeof(int);
+    return cells;
+}
+
+static long kernel_diam_avg(int extent, int stride, size_t *bytes) {
+    SDL_Rect r;
+    long sum = 0, cells = 0;
+
+    r.w = stride;
+    r.h = stride;
+    for (r.y = 0 - r.h / 2; r.y < extent; r.y += r.h) {
+        for (r.x = 0; r.x < extent; r.x += r.w) {
+            sum += diam_avg_heights(&r);
+            cells++;
+        }
+    }
+    for (r.y = 0; r.y < extent; r.y += r.h) {
+        for (r.x = 0 - r.w / 2; r.x + r.w / 2 < extent; r.x += r.w) {
+            sum += diam_avg_heights(&r);
+            cells++;
+        }
+    }
+
+    kbench_sink += sum;
+    *bytes = cells * 4 * sizeof(int);
+    return cells;
+}
+
+static long kernel_cell_rand(int extent, int stride, size_t *bytes) {
+    long sum = 0, cells = 0;
+    int x, y;
+
+    for (y = stride / 2; y < extent; y += stride) {
+        for (x = stride / 2; x < extent; x += stride) {
+            sum += cell_rand(map_seed, x, y, -RANGE_CHANGE, RANGE_CHANGE);
+            cells++;
+        }
+    }
+
+    kbench_sink += sum;
+    *bytes = 0;
+    return cells;
+}
+
+static long kernel_colour(int extent, int stride, size_t *bytes) {
+    int i, e;
+
+    for (e = 0; e < extent; ++e)
+        for (i = 0; i < extent; ++i)
+            set_point(screen, i, e, height_to_colour(heightmap[i][e], screen));
+
+    *bytes = (size_t)extent * extent * (sizeof(int) + 4);
+    return (long)extent * extent;
+}
+
+static long kernel_shift(int extent, int stride, size_t *bytes) {
+    static int amnt = 200;
+
+    // Up and down again, so the map stays the same
+    amnt = -amnt;
+    shift_block(heightmap, extent, extent, amnt);
+
+    *bytes = (size_t)extent * extent * 2 * sizeof(int);
+    return (long)extent * extent;
+}
+
+/*
+ * Times every kernel (or the one named) over a cache-sized corner of a map
+ * and over the whole map: the averaging and random kernels at every level's
+ * stride, colouring and shifting, which always visit every cell, at 1.
+ */
+static int kernels(const char *name) {
+    static const struct {
+        const char *name;
+        kbench_fn fn;
+        int strided;
+    } list[] = {
+        { "rect_avg", kernel_rect_avg, 1 },
+        { "diam_avg", kernel_diam_avg, 1 },
+        { "cell_rand", kernel_cell_rand, 1 },
+        { "colour", kernel_colour, 0 },
+        { "shift", kernel_shift, 0 },
+    };
+    static const struct {
+        const char *name;
+        int extent;
+    } inputs[] = {
+        { "cache", KBENCH_CACHE_EXTENT },
+        { "memory", WIDTH },
+    };
+    int k, n, stride, found = 0;
+
+    screen = create_surface(WIDTH, HEIGHT, 0x00ff0000, 0x0000ff00, 0x000000ff);
+    make_map(1);
+
+    for (k = 0; k < (int)(sizeof(list) / sizeof(list[0])); k++) {
+        if (strcmp(name, "all") && strcmp(name, list[k].name))
+            continue;
+        found = 1;
+
+        for (n = 0; n < (int)(sizeof(inputs) / sizeof(inputs[0])); n++) {
+            if (!list[k].strided) {
+                kbench_run("[SERIAL]", list[k].name, inputs[n].name, list[k].fn, inputs[n].extent, 1);
+                continue;
+            }
+            for (stride = 2; stride <= inputs[n].extent; stride *= 2)
+                kbench_run("[SERIAL]", list[k].name, inputs[n].name, list[k].fn, inputs[n].extent, stride);
+        }
+    }
+
+    free_surface(screen);
+
+    if (!found) {
+        fprintf(stderr, "Unknown kernel '%s', expected all, rect_avg, diam_avg, cell_rand,"
+            " colour or shift\n", name);
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Makes the map of every regression case REGRESS_RUNS times, checking that
+ * they all come out the same and comparing that map's checksum and the best
+ * time against the baseline file in spec. Returns the number of failures.
+ */
+static int regress(const char *spec) {
+    const regress_case_t *c;
+    struct timespec start, stop;
+    char path[256];
+    double tolerance, accum, best;
+    uint64_t sum, first;
+    int i, run, failures = 0;
+
+    if (regress_parse(spec, path, sizeof(path), &tolerance)) {
+        fprintf(stderr, "Bad regression '%s', expected baseline[:tolerance%%]\n", spec);
+        return 1;
+    }
+
+    for (i = 0; i < (int)(sizeof(regress_cases) / sizeof(regress_cases[0])); i++) {
+        c = &regress_cases[i];
+        engine = c->engine;
+        erode_parse(&erosion, c->erode);
+        post_parse(&post, c->post, MINHEIGHT, MAXHEIGHT);
+
+        best = 0;
+        first = 0;
+        for (run = 0; run < REGRESS_RUNS; run++) {
+            clock_gettime(CLOCK_REALTIME, &start);
+            make_map(c->seed);
+            erode_map();
+            post_process();
+            clock_gettime(CLOCK_REALTIME, &stop);
+
+            accum = ( stop.tv_sec - start.tv_sec )
+                     + (double)( stop.tv_nsec - start.tv_nsec )
+                       / (double)BILLION;
+            if (run == 0 || accum < best)
+                best = accum;
+
+            sum = regress_checksum(&heightmap[0][0], HEIGHT + 1, WIDTH, HEIGHT);
+            if (run == 0) {
+                first = sum;
+            } else if (sum != first) {
+                printf("[SERIAL] Regress %s: run %d made a different map FAIL\n", c->name, run);
+                failures++;
                 break;
             }
-            else if (event.key.keysym.sym == SDLK_RIGHTBRACKET) {
-                shift_all(200);
+        }
+
+        if (run < REGRESS_RUNS)
+            continue;
+
+        failures += regress_check(path, tolerance, "[SERIAL]", "serial", c->name,
+            WIDTH, HEIGHT, c->checksum, first, best);
+    }
+
+    printf("[SERIAL] Regression: %d failure%s\n", failures, failures == 1 ? "" : "s");
+
+    return failures;
+}
+
+int main(int argc, char *argv[]) {
+    int bench = 0;
+    const char *baseline = NULL;
+    const char *kernel = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:e:g:k:m:p:r:z:")) != -1) {
+        switch (opt) {
+        case 'b':
+            bench = atoi(optarg);
+            break;
+        case 'e':
+            if (erode_parse(&erosion, optarg)) {
+                fprintf(stderr, "Bad erosion '%s', expected droplets[:seed]\n", optarg);
+                return 1;
+            }
+            break;
+        case 'g':
+            for (engine = ENGINES - 1; engine >= 0; engine--)
+                if (!strcmp(optarg, engine_names[engine]))
+                    break;
+            if (engine < 0) {
+                fprintf(stderr, "Bad engine '%s', expected diamond or noise\n", optarg);
+                return 1;
             }
-            else if (event.key.keysym.sym == SDLK_LEFTBRACKET) {
-                shift_all(-200);
+            break;
+        case 'k':
+            kernel = optarg;
+            break;
+        case 'm':
+            for (shade_mode = SHADE_MODES - 1; shade_mode >= 0; shade_mode--)
+                if (!strcmp(optarg, shade_names[shade_mode]))
+                    break;
+            if (shade_mode < 0) {
+                fprintf(stderr, "Bad shading '%s', expected flat, relief or normals\n", optarg);
+                return 1;
             }
-            else if (event.key.keysym.sym == SDLK_SPACE) {
-                clock_gettime(CLOCK_REALTIME, &start);
-                
-                make_map();
-                heightmap_to_screen();
-                
-                clock_gettime(CLOCK_REALTIME, &stop);
-                accum = ( stop.tv_sec - start.tv_sec )
-                    + (double)( stop.tv_nsec - start.tv_nsec )
-                        / (double)BILLION;
-                printf("[SERIAL] Overall time on key pressed event: %lf\n", accum);
-            } else
-                continue;
+            break;
+        case 'p':
+            if (post_parse(&post, optarg, MINHEIGHT, MAXHEIGHT)) {
+                fprintf(stderr, "Bad pipeline '%s', expected e.g. blur:2,thermal:8,terrace:12\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            baseline = optarg;
+            break;
+        case 'z':
+            zoom = atoi(optarg);
+            if (zoom < 0 || zoom >= MIP_LEVELS) {
+                fprintf(stderr, "Bad zoom '%s', expected 0 to %d\n", optarg, MIP_LEVELS - 1);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b maps] [-e droplets[:seed]] [-g diamond|noise]\n"
+                "       [-k kernel|all] [-m flat|relief|normals] [-p stage:n,...]\n"
+                "       [-r baseline[:tolerance]] [-z zoom]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    srand(time(NULL));
+    TRACE_INIT(0);
+    alloc_heightmaps();
+
+    if (kernel)
+        return kernels(kernel);
+
+    if (baseline) {
+        opt = regress(baseline) ? 1 : 0;
+        TRACE_DUMP();
+        return opt;
+    }
+
+    if (bench > 0) {
+        benchmark(bench);
+        TRACE_DUMP();
+        return 0;
+    }
+
+    // Init SDL
+    SDL_Init(SDL_INIT_EVERYTHING);
+    screen = SDL_SetVideoMode(WIDTH >> zoom, HEIGHT >> zoom, 32, SDL_HWSURFACE);
+    back_surface = create_surface(screen->w, screen->h, screen->format->Rmask, screen->format->Gmask,
+        screen->format->Bmask);
+
+    pthread_t gen_thread;
+    int status;
+
+    // Keys held down repeat, so [ and ] keep shifting
+    SDL_EnableKeyRepeat(SDL_DEFAULT_REPEAT_DELAY, SDL_DEFAULT_REPEAT_INTERVAL);
+
+    status = pthread_create(&gen_thread, NULL, generator, NULL);
+    if (status) err_abort(status, "create thread");
+
+    // Show the initial map as soon as it is ready
+    want_map = 1;
+    clock_gettime(CLOCK_REALTIME, &want_time);
+
+    // Sleep until there is something to do: a key, or the generator
+    // telling that a map is ready. Space only asks for the next map, so
+    // keys keep working while it is being made.
+    while (SDL_WaitEvent(&event)) {
+        if (event.type == SDL_QUIT)
+            break;
+
+        if (event.type == SDL_USEREVENT && event.user.code == EVENT_MAP_READY) {
+            take_next_map();
+            continue;
         }
 
-        SDL_Flip(screen);
+        if (event.type != SDL_KEYDOWN)
+            continue;
+
+        if (event.key.keysym.sym == SDLK_ESCAPE) {
+            break;
+        }
+        else if (event.key.keysym.sym == SDLK_RIGHTBRACKET) {
+            shift_all(200);
+        }
+        else if (event.key.keysym.sym == SDLK_LEFTBRACKET) {
+            shift_all(-200);
+        }
+        else if (event.key.keysym.sym == SDLK_s) {
+            save_map();
+        }
+        else if (event.key.keysym.sym == SDLK_h) {
+            cycle_shade_mode();
+        }
+        else if (event.key.keysym.sym == SDLK_SPACE && !want_map) {
+            want_map = 1;
+            clock_gettime(CLOCK_REALTIME, &want_time);
+            take_next_map();
+        }
     }
 
+    // Stop the generator; it drops the map it is working on
+    status = pthread_mutex_lock(&swap_mutex);
+    if (status) err_abort(status, "lock mutex");
+
+    stop_signal = 1;
+    cancel_stop(&cancel);
+    status = pthread_cond_broadcast(&swap_cv);
+    if (status) err_abort(status, "signal condition");
+
+    status = pthread_mutex_unlock(&swap_mutex);
+    if (status) err_abort(status, "unlock mutex");
+
+    pthread_join(gen_thread, NULL);
+
+    TRACE_DUMP();
+
     // Close resources
+    free_surface(back_surface);
+    mip_free(&mips[0]);
+    mip_free(&mips[1]);
     SDL_FreeSurface(screen);
     SDL_Quit();
+    huge_free(heightmaps, 3 * sizeof(heightmaps[0]));
 
     return 0;
 }
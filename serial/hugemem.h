@@ -0,0 +1,148 @@
+#ifndef __HUGEMEM_H__
+#define __HUGEMEM_H__
+
+/*
+ * Large buffers on 2 MB pages.
+ *
+ * The heightmap is stored column by column, so walking it along a row
+ * touches a different 4 KB page for every cell and the TLB cannot keep up.
+ * huge_alloc maps big buffers so that they can live on 2 MB pages instead,
+ * as chosen by the FRAC_HUGEPAGES environment variable:
+ *
+ *   thp      anonymous memory aligned to 2 MB and marked MADV_HUGEPAGE, so
+ *            transparent huge pages back it (the default)
+ *   hugetlb  pages from the hugetlbfs pool (MAP_HUGETLB), falling back to
+ *            thp when the pool is empty
+ *   off      4 KB pages, with MADV_NOHUGEPAGE so that a system running THP
+ *            always does not quietly use huge pages anyway
+ *
+ * If the kernel has no THP, memory still comes back, on 4 KB pages. Memory
+ * is zeroed and no page is touched, so the first write still decides which
+ * NUMA node a page lands on. huge_report prints how a buffer ended up
+ * being backed, counting the huge pages actually in it from smaps.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+// A no-op mmap flag; the programs use the name for their map file
+#undef MAP_FILE
+
+#define HUGE_PAGE (2UL << 20)
+
+#define HUGE_OFF 0
+#define HUGE_THP 1
+#define HUGE_TLB 2
+
+static const char *huge_names[] = { "4K pages", "transparent huge pages", "hugetlbfs" };
+
+// How the calling thread's last buffer was mapped
+static __thread int huge_kind;
+
+static size_t huge_round(size_t size) {
+    return (size + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+}
+
+// Anonymous mapping of size bytes starting on a 2 MB boundary
+static void *huge_map_aligned(size_t size) {
+    char *p, *start;
+    size_t head;
+
+    p = (char *) mmap(NULL, size + HUGE_PAGE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    start = (char *)(((uintptr_t)p + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+    head = start - p;
+    if (head)
+        munmap(p, head);
+    munmap(start + size, HUGE_PAGE - head);
+
+    return start;
+}
+
+/*
+ * Maps size bytes of zeroed memory as configured. Exits if there is no
+ * memory at all.
+ */
+static void *huge_alloc(size_t size) {
+    const char *env = getenv("FRAC_HUGEPAGES");
+    void *p = NULL;
+    int want = HUGE_THP;
+
+    if (env && !strcmp(env, "off"))
+        want = HUGE_OFF;
+    else if (env && !strcmp(env, "hugetlb"))
+        want = HUGE_TLB;
+
+    size = huge_round(size);
+
+#ifdef MAP_HUGETLB
+    if (want == HUGE_TLB) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            huge_kind = HUGE_TLB;
+            return p;
+        }
+        p = NULL;
+    }
+#endif
+
+    p = huge_map_aligned(size);
+    if (!p) {
+        perror("mmap");
+        exit(1);
+    }
+
+    huge_kind = HUGE_OFF;
+#if defined(MADV_HUGEPAGE) && defined(MADV_NOHUGEPAGE)
+    if (want == HUGE_OFF)
+        madvise(p, size, MADV_NOHUGEPAGE);
+    else if (!madvise(p, size, MADV_HUGEPAGE))
+        huge_kind = HUGE_THP;
+#endif
+
+    return p;
+}
+
+static void huge_free(void *p, size_t size) {
+    if (p)
+        munmap(p, huge_round(size));
+}
+
+/*
+ * Prints after tag how the size bytes at p are backed and how much of them
+ * sits in huge pages right now. Only the benchmarks report, so this is
+ * inline to keep the MPI builds quiet about it.
+ */
+static inline void huge_report(const char *tag, const char *name, const void *p, size_t size, int kind) {
+    char line[256];
+    unsigned long start, end;
+    long kb, huge_kb = 0;
+    int inside = 0;
+    FILE *f;
+
+    f = fopen("/proc/self/smaps", "r");
+    if (f) {
+        while (fgets(line, sizeof(line), f)) {
+            if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+                inside = start < (uintptr_t)p + size && end > (uintptr_t)p;
+            } else if (inside && sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+                huge_kb += kb;
+            } else if (inside && kind == HUGE_TLB && sscanf(line, "Private_Hugetlb: %ld kB", &kb) == 1) {
+                huge_kb += kb;
+            }
+        }
+        fclose(f);
+    }
+
+    printf("%s %s: %zu MB on %s, %ld MB in huge pages\n", tag, name,
+        huge_round(size) >> 20, huge_names[kind], huge_kb >> 10);
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef __KBENCH_H__
+#define __KBENCH_H__
+
+/*
+ * Microbenchmarks of single kernels.
+ *
+ * A kernel is a function that runs one of the program's inner loops over
+ * the extent x extent corner of its input at a given stride, as one level
+ * of make_map would, and returns the number of cells it did and the bytes
+ * of heightmap and framebuffer it read and wrote for them. kbench_run
+ * calls it back to back for at least KBENCH_MIN_TIME seconds,
+ * KBENCH_REPEATS times, and prints the fastest pass as ns per cell and
+ * GB/s, so that a timer interrupt or a page fault costs one pass and not
+ * the result.
+ *
+ * Small extents stay in cache between calls and large ones do not, so
+ * running the same kernel at both separates its compute cost from its
+ * memory cost. At coarse strides even the full map is only a few cache
+ * lines, as it is in make_map.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+
+#define KBENCH_MIN_TIME 0.05
+#define KBENCH_REPEATS 3
+#define KBENCH_BATCH_CELLS 4096
+
+typedef long (*kbench_fn)(int extent, int stride, size_t *bytes);
+
+// Kernels add their results here, so the compiler cannot drop them
+static volatile long kbench_sink;
+
+static double kbench_now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/*
+ * Times fn over the extent x extent input at stride and prints the result
+ * after tag, kernel and the input's name.
+ */
+static void kbench_run(const char *tag, const char *kernel, const char *input,
+        kbench_fn fn, int extent, int stride) {
+    double start, elapsed, best = 0;
+    size_t bytes;
+    long cells, calls, batch, b;
+    int r;
+
+    // Warms the input up and tells how much one call does. Calls that do
+    // few cells go in batches, so reading the clock does not dominate.
+    cells = fn(extent, stride, &bytes);
+    batch = cells < KBENCH_BATCH_CELLS ? KBENCH_BATCH_CELLS / cells : 1;
+
+    for (r = 0; r < KBENCH_REPEATS; r++) {
+        calls = 0;
+        start = kbench_now();
+        do {
+            for (b = 0; b < batch; b++)
+                fn(extent, stride, &bytes);
+            calls += batch;
+            elapsed = kbench_now() - start;
+        } while (elapsed < KBENCH_MIN_TIME);
+
+        if (r == 0 || elapsed / calls < best)
+            best = elapsed / calls;
+    }
+
+    printf("%s Kernel %-9s %-6s stride %4d: %9.3lf ns/cell", tag, kernel, input,
+        stride, best * 1e9 / cells);
+    if (bytes)
+        printf(" %8.2lf GB/s", bytes / best * 1e-9);
+    printf("\n");
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef __MIP_H__
+#define __MIP_H__
+
+/*
+ * Mipmap pyramid of a heightmap.
+ *
+ * Level 0 is the map itself; level k is the map at 1/2^k of its resolution,
+ * every sample the mean of the 2 x 2 samples below it, stored column by
+ * column like the map. Once the map is attached, mip_reduce builds
+ * columns [first, last) of one level from the level below, so threads can
+ * share a level out, but the levels must be built in order. Whatever
+ * needs the map at a lower resolution (mip_level_for) then reads the
+ * coarsest level that has it instead of every cell of the map.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MIP_LEVELS 8
+
+typedef struct {
+    int levels;
+    int w[MIP_LEVELS], h[MIP_LEVELS], stride[MIP_LEVELS];
+    int *data[MIP_LEVELS];   // data[0] is the map, not owned
+} mip_t;
+
+// Sets up levels of the width x height map (levels 1 and up are allocated
+// here). Aborts if they do not fit.
+static void mip_init(mip_t *m, int width, int height, int stride, int levels) {
+    int k;
+
+    if (levels > MIP_LEVELS || (width >> (levels - 1)) < 1 || (height >> (levels - 1)) < 1) {
+        fprintf(stderr, "A %d x %d map has no %d mip levels\n", width, height, levels);
+        exit(1);
+    }
+
+    m->levels = levels;
+    m->w[0] = width;
+    m->h[0] = height;
+    m->stride[0] = stride;
+    m->data[0] = NULL;
+    for (k = 1; k < levels; k++) {
+        m->w[k] = m->w[k - 1] / 2;
+        m->h[k] = m->h[k - 1] / 2;
+        m->stride[k] = m->h[k];
+        m->data[k] = malloc((size_t)m->w[k] * m->h[k] * sizeof(int));
+        if (!m->data[k]) {
+            perror("mip level");
+            exit(1);
+        }
+    }
+}
+
+static void mip_free(mip_t *m) {
+    int k;
+
+    for (k = 1; k < m->levels; k++)
+        free(m->data[k]);
+    m->levels = 0;
+}
+
+// Builds columns [first, last) of level from the one below
+static void mip_reduce(mip_t *m, int level, int first, int last) {
+    const int *src = m->data[level - 1];
+    int *dst = m->data[level];
+    int ss = m->stride[level - 1], ds = m->stride[level];
+    const int *c0, *c1;
+    int x, y;
+
+    for (x = first; x < last; x++) {
+        c0 = src + (size_t)(2 * x) * ss;
+        c1 = c0 + ss;
+        for (y = 0; y < m->h[level]; y++)
+            dst[(size_t)x * ds + y] = ((long)c0[2 * y] + c0[2 * y + 1] + c1[2 * y] + c1[2 * y + 1]) / 4;
+    }
+}
+
+// Makes map level 0, before the levels above it are built from it
+static void mip_attach(mip_t *m, int *map) {
+    m->data[0] = map;
+}
+
+// The coarsest level at least width samples across
+static int mip_level_for(const mip_t *m, int width) {
+    int k = 0;
+
+    while (k + 1 < m->levels && m->w[k + 1] >= width)
+        k++;
+
+    return k;
+}
+
+// Adds amnt to every sample of levels 1 and up, as shifting the map does
+static void mip_shift(mip_t *m, int amnt) {
+    size_t i;
+    int k;
+
+    for (k = 1; k < m->levels; k++)
+        for (i = 0; i < (size_t)m->w[k] * m->h[k]; i++)
+            m->data[k][i] += amnt;
+}
+
+#endif
@@ -0,0 +1,249 @@
+#ifndef __PERF_H__
+#define __PERF_H__
+
+/*
+ * Hardware performance counters for the benchmark mode. Every thread that
+ * calls perf_begin opens its own set of counters through perf_event_open
+ * (user space only, so it works with perf_event_paranoid <= 2). A
+ * perf_begin/perf_end pair adds the counter deltas to the calling thread's
+ * totals for the given phase; perf_report prints them per phase summed
+ * over all threads, then per thread summed over all phases.
+ *
+ * Phases are the heightmap reset, the colorization, the post-processing
+ * pipeline, the hydraulic erosion, the noise engine, the fine levels run
+ * fused in tiles and one per diamond-square refinement level
+ * (PERF_LEVEL(n)). Counters that the kernel refuses to open are reported
+ * as n/a.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PERF_PHASE_RESET 0
+#define PERF_PHASE_COLOUR 1
+#define PERF_PHASE_POST 2
+#define PERF_PHASE_ERODE 3
+#define PERF_PHASE_NOISE 4
+#define PERF_PHASE_FUSED 5
+#define PERF_LEVEL(n) (6 + (n))
+#define PERF_PHASES (6 + 16)
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_NUM
+};
+
+static const char *perf_names[PERF_NUM] = {
+    "cycles", "instr", "L1d-miss", "LLC-miss", "dTLB-miss"
+};
+
+typedef struct {
+    long long v[PERF_NUM];
+} perf_sample_t;
+
+typedef struct perf_thread {
+    int id;
+    int fd[PERF_NUM];
+    perf_sample_t phase[PERF_PHASES];
+    struct perf_thread *next;
+} perf_thread_t;
+
+static pthread_mutex_t perf_mutex = PTHREAD_MUTEX_INITIALIZER;
+static perf_thread_t *perf_threads;
+static int perf_next_id;
+static int perf_enabled;
+static int perf_warned;
+static __thread perf_thread_t *perf_mine;
+
+static int perf_open_event(int event) {
+    struct perf_event_attr pe;
+
+    memset(&pe, 0, sizeof(pe));
+    pe.size = sizeof(pe);
+    pe.disabled = 0;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+
+    switch (event) {
+    case PERF_CYCLES:
+        pe.type = PERF_TYPE_HARDWARE;
+        pe.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case PERF_INSTRUCTIONS:
+        pe.type = PERF_TYPE_HARDWARE;
+        pe.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case PERF_L1D_MISSES:
+        pe.type = PERF_TYPE_HW_CACHE;
+        pe.config = PERF_COUNT_HW_CACHE_L1D
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    case PERF_LLC_MISSES:
+        pe.type = PERF_TYPE_HARDWARE;
+        pe.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case PERF_DTLB_MISSES:
+        pe.type = PERF_TYPE_HW_CACHE;
+        pe.config = PERF_COUNT_HW_CACHE_DTLB
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    }
+
+    // Count the calling thread on whatever cpu it runs
+    return syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static perf_thread_t *perf_thread(void) {
+    int i;
+
+    if (perf_mine)
+        return perf_mine;
+
+    perf_mine = (perf_thread_t *) calloc(1, sizeof(perf_thread_t));
+    if (!perf_mine) {
+        perror("perf counters");
+        exit(1);
+    }
+
+    for (i = 0; i < PERF_NUM; i++) {
+        perf_mine->fd[i] = perf_open_event(i);
+        if (perf_mine->fd[i] < 0 && !perf_warned) {
+            perf_warned = 1;
+            fprintf(stderr, "perf_event_open(%s): %s\n", perf_names[i], strerror(errno));
+        }
+    }
+
+    pthread_mutex_lock(&perf_mutex);
+    perf_mine->id = perf_next_id++;
+    perf_mine->next = perf_threads;
+    perf_threads = perf_mine;
+    pthread_mutex_unlock(&perf_mutex);
+
+    return perf_mine;
+}
+
+static void perf_read(perf_thread_t *t, perf_sample_t *s) {
+    int i;
+
+    for (i = 0; i < PERF_NUM; i++) {
+        s->v[i] = 0;
+        if (t->fd[i] >= 0 && read(t->fd[i], &s->v[i], sizeof(long long)) != sizeof(long long))
+            s->v[i] = 0;
+    }
+}
+
+static void perf_begin(perf_sample_t *s) {
+    if (!perf_enabled)
+        return;
+
+    perf_read(perf_thread(), s);
+}
+
+static void perf_end(perf_sample_t *s, int phase) {
+    perf_thread_t *t;
+    perf_sample_t now;
+    int i;
+
+    if (!perf_enabled)
+        return;
+
+    t = perf_thread();
+    perf_read(t, &now);
+    for (i = 0; i < PERF_NUM; i++)
+        t->phase[phase].v[i] += now.v[i] - s->v[i];
+}
+
+static void perf_print_row(const char *tag, const char *label, perf_sample_t *s, int *open) {
+    int i;
+
+    printf("%s %-10s", tag, label);
+    for (i = 0; i < PERF_NUM; i++) {
+        if (open[i])
+            printf(" %14lld", s->v[i]);
+        else
+            printf(" %14s", "n/a");
+    }
+    if (open[PERF_CYCLES] && open[PERF_INSTRUCTIONS] && s->v[PERF_CYCLES])
+        printf(" %6.2lf\n", (double)s->v[PERF_INSTRUCTIONS] / s->v[PERF_CYCLES]);
+    else
+        printf(" %6s\n", "n/a");
+}
+
+static void perf_report(const char *tag) {
+    perf_thread_t *t;
+    perf_sample_t sum;
+    int open[PERF_NUM];
+    char label[32];
+    int p, i, used;
+
+    if (!perf_enabled)
+        return;
+
+    pthread_mutex_lock(&perf_mutex);
+
+    for (i = 0; i < PERF_NUM; i++) {
+        open[i] = 0;
+        for (t = perf_threads; t; t = t->next)
+            if (t->fd[i] >= 0)
+                open[i] = 1;
+    }
+
+    printf("%s %-10s", tag, "phase");
+    for (i = 0; i < PERF_NUM; i++)
+        printf(" %14s", perf_names[i]);
+    printf(" %6s\n", "IPC");
+
+    for (p = 0; p < PERF_PHASES; p++) {
+        memset(&sum, 0, sizeof(sum));
+        used = 0;
+        for (t = perf_threads; t; t = t->next) {
+            for (i = 0; i < PERF_NUM; i++) {
+                sum.v[i] += t->phase[p].v[i];
+                used |= t->phase[p].v[i] != 0;
+            }
+        }
+        if (!used)
+            continue;
+
+        if (p == PERF_PHASE_RESET)
+            snprintf(label, sizeof(label), "reset");
+        else if (p == PERF_PHASE_COLOUR)
+            snprintf(label, sizeof(label), "colour");
+        else if (p == PERF_PHASE_POST)
+            snprintf(label, sizeof(label), "post");
+        else if (p == PERF_PHASE_ERODE)
+            snprintf(label, sizeof(label), "erode");
+        else if (p == PERF_PHASE_NOISE)
+            snprintf(label, sizeof(label), "noise");
+        else if (p == PERF_PHASE_FUSED)
+            snprintf(label, sizeof(label), "fused");
+        else
+            snprintf(label, sizeof(label), "level %d", p - PERF_LEVEL(0));
+        perf_print_row(tag, label, &sum, open);
+    }
+
+    for (t = perf_threads; t; t = t->next) {
+        memset(&sum, 0, sizeof(sum));
+        for (p = 0; p < PERF_PHASES; p++)
+            for (i = 0; i < PERF_NUM; i++)
+                sum.v[i] += t->phase[p].v[i];
+        snprintf(label, sizeof(label), "thread %d", t->id);
+        perf_print_row(tag, label, &sum, open);
+    }
+
+    pthread_mutex_unlock(&perf_mutex);
+}
+
+#endif
@@ -0,0 +1,264 @@
+#ifndef __POST_H__
+#define __POST_H__
+
+/*
+ * Terrain post-processing: a pipeline of stencil stages run over the
+ * finished heightmap.
+ *
+ *   blur:N      N passes of a 3x3 binomial blur
+ *   thermal:N   N steps of thermal erosion: material slides to each of the
+ *               four neighbours that is more than POST_TALUS lower
+ *   terrace:N   quantise the heights to N levels with gently sloped steps
+ *
+ * A pipeline is written as the stages separated by commas, for example
+ * "blur:2,thermal:8,terrace:12", and post_parse turns that into a
+ * post_pipeline_t.
+ *
+ * Instead of sweeping the whole map once per pass, the map is cut into
+ * POST_TILE x POST_TILE tiles. post_tile loads one tile plus a halo as
+ * wide as the whole pipeline reaches (one cell per blur or thermal pass)
+ * into a scratch buffer that stays in cache, runs every pass of every
+ * stage there, and stores only the tile back. Halo cells are computed
+ * redundantly by neighbouring tiles, so tiles are independent and can be
+ * run by any thread in any order. The map is read once and written once
+ * however many passes there are.
+ *
+ * Results go to a second map, since neighbouring tiles still read the
+ * source. Cells outside the map are treated as copies of the nearest
+ * border cell, the same as a plain full-map sweep would.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define POST_BLUR 0
+#define POST_THERMAL 1
+#define POST_TERRACE 2
+#define POST_TYPES 3
+
+#define POST_MAX_STAGES 16
+#define POST_TILE 128
+
+// Height difference between neighbours that thermal erosion tolerates,
+// and the fraction of the excess moved per step
+#define POST_TALUS 256
+#define POST_THERMAL_RATE 0.1f
+
+// Slope left on terrace steps, 0 gives flat steps
+#define POST_TERRACE_SLOPE 0.25f
+
+typedef struct {
+    int type;
+    int n;
+} post_stage_t;
+
+typedef struct {
+    int nstages;
+    post_stage_t stage[POST_MAX_STAGES];
+    int radius;   // cells of halo the whole pipeline needs
+    int minheight, maxheight;
+} post_pipeline_t;
+
+static const char *post_names[POST_TYPES] = { "blur", "thermal", "terrace" };
+
+// Scratch tiles of the calling thread, grown as needed
+static __thread float *post_buf;
+static __thread size_t post_buf_size;
+
+/*
+ * Parses a pipeline spec into p. Returns 0 on success, -1 on a malformed
+ * spec or one with too many stages.
+ */
+static int post_parse(post_pipeline_t *p, const char *spec, int minheight, int maxheight) {
+    char name[16];
+    const char *c = spec;
+    int len, type, n;
+
+    memset(p, 0, sizeof(*p));
+    p->minheight = minheight;
+    p->maxheight = maxheight;
+
+    while (*c) {
+        len = strcspn(c, ":,");
+        if (len == 0 || len >= (int)sizeof(name))
+            return -1;
+        memcpy(name, c, len);
+        name[len] = '\0';
+        c += len;
+
+        for (type = 0; type < POST_TYPES; type++)
+            if (!strcmp(name, post_names[type]))
+                break;
+        if (type == POST_TYPES)
+            return -1;
+
+        n = 1;
+        if (*c == ':') {
+            n = strtol(c + 1, (char **)&c, 10);
+            if (n < 1)
+                return -1;
+        }
+        if (*c == ',')
+            c++;
+        else if (*c)
+            return -1;
+
+        if (p->nstages == POST_MAX_STAGES)
+            return -1;
+        p->stage[p->nstages].type = type;
+        p->stage[p->nstages].n = n;
+        p->nstages++;
+
+        if (type != POST_TERRACE)
+            p->radius += n;
+    }
+
+    return 0;
+}
+
+static int post_tiles(int width, int height) {
+    return ((width + POST_TILE - 1) / POST_TILE) * ((height + POST_TILE - 1) / POST_TILE);
+}
+
+// The part of a height difference beyond the talus, with its sign
+static inline float post_excess(float d) {
+    if (d > POST_TALUS)
+        return d - POST_TALUS;
+    if (d < -POST_TALUS)
+        return d + POST_TALUS;
+    return 0;
+}
+
+static inline float post_cell(int type, const float *l, const float *c, const float *r,
+        int y, int up, int down) {
+    if (type == POST_BLUR)
+        return (l[up] + 2 * l[y] + l[down]
+            + 2 * (c[up] + 2 * c[y] + c[down])
+            + r[up] + 2 * r[y] + r[down]) * (1.0f / 16);
+
+    // Gather form of thermal erosion, so every cell only writes itself:
+    // it loses to lower neighbours what they gain
+    return c[y] + POST_THERMAL_RATE * (post_excess(l[y] - c[y]) + post_excess(r[y] - c[y])
+        + post_excess(c[up] - c[y]) + post_excess(c[down] - c[y]));
+}
+
+// One pass of a radius 1 stage over [x0, x1) x [y0, y1) of the bw x bh
+// buffer in, into out. Neighbours are clamped to the buffer.
+static void post_pass(int type, const float *in, float *out, int bw, int bh,
+        int x0, int x1, int y0, int y1) {
+    const float *l, *c, *r;
+    float *o;
+    int x, y, ya, yb;
+
+    // Rows 0 and bh - 1 need clamping, the rest is a straight loop
+    ya = y0 > 1 ? y0 : 1;
+    yb = y1 < bh - 1 ? y1 : bh - 1;
+
+    for (x = x0; x < x1; x++) {
+        l = in + (size_t)(x > 0 ? x - 1 : 0) * bh;
+        c = in + (size_t)x * bh;
+        r = in + (size_t)(x < bw - 1 ? x + 1 : bw - 1) * bh;
+        o = out + (size_t)x * bh;
+
+        if (y0 == 0)
+            o[0] = post_cell(type, l, c, r, 0, 0, bh > 1 ? 1 : 0);
+        if (type == POST_BLUR) {
+            for (y = ya; y < yb; y++)
+                o[y] = post_cell(POST_BLUR, l, c, r, y, y - 1, y + 1);
+        } else {
+            for (y = ya; y < yb; y++)
+                o[y] = post_cell(POST_THERMAL, l, c, r, y, y - 1, y + 1);
+        }
+        if (y1 == bh && bh > 1)
+            o[bh - 1] = post_cell(type, l, c, r, bh - 1, bh - 2, bh - 1);
+    }
+}
+
+static void post_terrace(const post_pipeline_t *p, int levels, float *buf, size_t cells) {
+    float step, q;
+    size_t i;
+
+    step = (float)(p->maxheight - p->minheight) / levels;
+    for (i = 0; i < cells; i++) {
+        q = p->minheight + floorf((buf[i] - p->minheight) / step) * step;
+        buf[i] = q + (buf[i] - q) * POST_TERRACE_SLOPE;
+    }
+}
+
+/*
+ * Runs pipeline p over tile t (numbered row by row) of the width x height
+ * map src and stores the tile into dst. Both maps are stored column by
+ * column with stride ints per column.
+ */
+static void post_tile(const post_pipeline_t *p, const int *src, int *dst,
+        int stride, int width, int height, int t) {
+    int tiles_x = (width + POST_TILE - 1) / POST_TILE;
+    int tx0, tx1, ty0, ty1, bx0, bx1, by0, by1, bw, bh;
+    int x0, x1, y0, y1;
+    int x, y, s, k;
+    float *in, *out, *tmp;
+    size_t need;
+
+    tx0 = (t % tiles_x) * POST_TILE;
+    ty0 = (t / tiles_x) * POST_TILE;
+    tx1 = tx0 + POST_TILE < width ? tx0 + POST_TILE : width;
+    ty1 = ty0 + POST_TILE < height ? ty0 + POST_TILE : height;
+
+    // The tile and its halo, clipped to the map
+    bx0 = tx0 - p->radius > 0 ? tx0 - p->radius : 0;
+    by0 = ty0 - p->radius > 0 ? ty0 - p->radius : 0;
+    bx1 = tx1 + p->radius < width ? tx1 + p->radius : width;
+    by1 = ty1 + p->radius < height ? ty1 + p->radius : height;
+    bw = bx1 - bx0;
+    bh = by1 - by0;
+
+    need = 2 * (size_t)bw * bh;
+    if (need > post_buf_size) {
+        free(post_buf);
+        post_buf = (float *) malloc(need * sizeof(float));
+        if (!post_buf) {
+            perror("post-processing buffer");
+            exit(1);
+        }
+        post_buf_size = need;
+    }
+    in = post_buf;
+    out = post_buf + (size_t)bw * bh;
+
+    for (x = 0; x < bw; x++)
+        for (y = 0; y < bh; y++)
+            in[(size_t)x * bh + y] = src[(size_t)(bx0 + x) * stride + by0 + y];
+
+    // Every pass leaves one more ring of halo stale, on the sides that are
+    // inside the map. Only compute what the next pass can still use.
+    x0 = 0;
+    x1 = bw;
+    y0 = 0;
+    y1 = bh;
+    for (s = 0; s < p->nstages; s++) {
+        if (p->stage[s].type == POST_TERRACE) {
+            post_terrace(p, p->stage[s].n, in, (size_t)bw * bh);
+            continue;
+        }
+
+        for (k = 0; k < p->stage[s].n; k++) {
+            if (bx0 > 0) x0++;
+            if (bx1 < width) x1--;
+            if (by0 > 0) y0++;
+            if (by1 < height) y1--;
+
+            post_pass(p->stage[s].type, in, out, bw, bh, x0, x1, y0, y1);
+            tmp = in;
+            in = out;
+            out = tmp;
+        }
+    }
+
+    for (x = tx0; x < tx1; x++)
+        for (y = ty0; y < ty1; y++)
+            dst[(size_t)x * stride + y] = lrintf(in[(size_t)(x - bx0) * bh + y - by0]);
+}
+
+#endif
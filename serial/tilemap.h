@@ -0,0 +1,468 @@
+#ifndef __TILEMAP_H__
+#define __TILEMAP_H__
+
+/*
+ * Tiled, compressed heightmap files.
+ *
+ * The map is cut into square tiles that are compressed on their own, so a
+ * reader can fetch any tile with a single pread. The file starts with a
+ * fixed header and the tile index, followed by the tile data in whatever
+ * order the writer threads finished them. All fields are in host byte order.
+ *
+ *   tilemap_header_t
+ *   tilemap_entry_t[tiles_x * tiles_y]   (row of tiles by row of tiles)
+ *   tile data
+ *
+ * Inside a tile the samples are stored column by column, the same order as
+ * heightmap[x][y]. Each sample is coded as the difference to the previous
+ * sample of its column; the first sample of a column uses the first sample
+ * of the previous column. The zigzagged differences are Rice coded with
+ * one parameter k per tile (the first byte of the tile). A difference too
+ * large for the Rice code is escaped and stored raw, in 17 bits for 16 bit
+ * maps and 32 bits for 32 bit maps.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define TILEMAP_MAGIC "FRTM"
+#define TILEMAP_VERSION 1
+#define TILEMAP_ESCAPE 24
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t width, height;
+    uint32_t tile;
+    uint32_t bits; // 16 or 32
+    uint32_t tiles_x, tiles_y;
+} tilemap_header_t;
+
+typedef struct {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t reserved;
+} tilemap_entry_t;
+
+typedef struct {
+    int fd;
+    tilemap_header_t hdr;
+    tilemap_entry_t *index;
+} tilemap_t;
+
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t size;    // bytes a reader may take from buf
+    uint64_t acc;
+    int nbits;
+    int overrun;    // a reader ran out of bytes
+} tilemap_bits_t;
+
+static void tilemap_put(tilemap_bits_t *b, uint32_t value, int n) {
+    b->acc |= (uint64_t)value << b->nbits;
+    b->nbits += n;
+    while (b->nbits >= 8) {
+        b->buf[b->len++] = b->acc & 0xff;
+        b->acc >>= 8;
+        b->nbits -= 8;
+    }
+}
+
+static void tilemap_flush(tilemap_bits_t *b) {
+    if (b->nbits)
+        b->buf[b->len++] = b->acc & 0xff;
+    b->acc = 0;
+    b->nbits = 0;
+}
+
+// Reads n bits. Past the end of the buffer it sets overrun and returns 0.
+static uint32_t tilemap_get(tilemap_bits_t *b, int n) {
+    uint32_t value;
+
+    while (b->nbits < n) {
+        if (b->len >= b->size) {
+            b->overrun = 1;
+            return 0;
+        }
+        b->acc |= (uint64_t)b->buf[b->len++] << b->nbits;
+        b->nbits += 8;
+    }
+    value = b->acc & ((n == 32) ? 0xffffffffu : ((1u << n) - 1));
+    b->acc >>= n;
+    b->nbits -= n;
+
+    return value;
+}
+
+static uint32_t tilemap_zigzag(int32_t v) {
+    return ((uint32_t)v << 1) ^ (uint32_t)(v >> 31);
+}
+
+static int32_t tilemap_unzigzag(uint32_t z) {
+    return (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+}
+
+// Worst case size of one coded tile
+static size_t tilemap_tile_bound(int tile) {
+    return 1 + (size_t)tile * tile * (TILEMAP_ESCAPE + 1 + 32 + 7) / 8 + 8;
+}
+
+/*
+ * Codes the tw x th samples starting at (x0, y0) of map, where cell (x, y)
+ * is map[x * stride + y]. Returns the number of bytes written to out.
+ */
+static size_t tilemap_encode(const int *map, int stride, int x0, int y0,
+        int tw, int th, int bits, uint8_t *out) {
+    tilemap_bits_t b;
+    uint64_t sum = 0;
+    uint32_t z, q;
+    int32_t prev, col_prev;
+    int raw = bits == 16 ? 17 : 32;
+    int x, y, k;
+
+    // Pick k from the mean zigzagged difference
+    col_prev = 0;
+    for (x = 0; x < tw; x++) {
+        const int *col = map + (size_t)(x0 + x) * stride + y0;
+        prev = col_prev;
+        col_prev = col[0];
+        for (y = 0; y < th; y++) {
+            sum += tilemap_zigzag((int32_t)((uint32_t)col[y] - (uint32_t)prev));
+            prev = col[y];
+        }
+    }
+    sum /= (uint64_t)tw * th;
+    for (k = 0; k < 31 && ((uint64_t)1 << (k + 1)) <= sum; k++)
+        ;
+
+    out[0] = k;
+    b.buf = out + 1;
+    b.len = 0;
+    b.acc = 0;
+    b.nbits = 0;
+
+    col_prev = 0;
+    for (x = 0; x < tw; x++) {
+        const int *col = map + (size_t)(x0 + x) * stride + y0;
+        prev = col_prev;
+        col_prev = col[0];
+        for (y = 0; y < th; y++) {
+            z = tilemap_zigzag((int32_t)((uint32_t)col[y] - (uint32_t)prev));
+            prev = col[y];
+
+            q = z >> k;
+            if (q < TILEMAP_ESCAPE) {
+                tilemap_put(&b, (1u << q) - 1, q + 1);
+                if (k)
+                    tilemap_put(&b, z & ((1u << k) - 1), k);
+            } else {
+                tilemap_put(&b, (1u << TILEMAP_ESCAPE) - 1, TILEMAP_ESCAPE + 1);
+                tilemap_put(&b, z, raw);
+            }
+        }
+    }
+    tilemap_flush(&b);
+
+    return b.len + 1;
+}
+
+/*
+ * Inverse of tilemap_encode on the size bytes at in; out receives tw x th
+ * samples column by column. Returns 0 on success, -1 if the tile is
+ * corrupt.
+ */
+static int tilemap_decode(const uint8_t *in, size_t size, int tw, int th, int bits, int *out) {
+    tilemap_bits_t b;
+    uint32_t z, q;
+    int32_t prev, col_prev;
+    int raw = bits == 16 ? 17 : 32;
+    int x, y, k;
+
+    if (size < 1 || in[0] > 31)
+        return -1;
+
+    k = in[0];
+    b.buf = (uint8_t *) in + 1;
+    b.len = 0;
+    b.size = size - 1;
+    b.acc = 0;
+    b.nbits = 0;
+    b.overrun = 0;
+
+    col_prev = 0;
+    for (x = 0; x < tw; x++) {
+        prev = col_prev;
+        for (y = 0; y < th; y++) {
+            for (q = 0; q < TILEMAP_ESCAPE && tilemap_get(&b, 1); q++)
+                ;
+            if (q < TILEMAP_ESCAPE)
+                z = (q << k) | (k ? tilemap_get(&b, k) : 0);
+            else if (tilemap_get(&b, 1))
+                return -1;
+            else
+                z = tilemap_get(&b, raw);
+            if (b.overrun)
+                return -1;
+
+            prev = (int32_t)((uint32_t)prev + (uint32_t)tilemap_unzigzag(z));
+            out[x * th + y] = prev;
+            if (y == 0)
+                col_prev = prev;
+        }
+    }
+
+    return 0;
+}
+
+typedef struct {
+    int fd;
+    const int *map;
+    int stride;
+    tilemap_header_t *hdr;
+    tilemap_entry_t *index;
+    pthread_mutex_t mutex;
+    int next_tile;
+    uint64_t cursor;
+    int failed;
+} tilemap_job_t;
+
+// Writer thread: compress the next free tile and append it to the file
+static void *tilemap_worker(void *args) {
+    tilemap_job_t *job = (tilemap_job_t *) args;
+    tilemap_header_t *hdr = job->hdr;
+    uint8_t *buf;
+    uint64_t offset;
+    size_t len;
+    int t, tx, ty, tw, th;
+
+    buf = (uint8_t *) malloc(tilemap_tile_bound(hdr->tile));
+    if (!buf) {
+        job->failed = errno;
+        return NULL;
+    }
+
+    while (1) {
+        pthread_mutex_lock(&job->mutex);
+        t = job->next_tile++;
+        pthread_mutex_unlock(&job->mutex);
+
+        if (t >= (int)(hdr->tiles_x * hdr->tiles_y))
+            break;
+
+        tx = t % hdr->tiles_x;
+        ty = t / hdr->tiles_x;
+        tw = hdr->width - tx * hdr->tile < hdr->tile ? hdr->width - tx * hdr->tile : hdr->tile;
+        th = hdr->height - ty * hdr->tile < hdr->tile ? hdr->height - ty * hdr->tile : hdr->tile;
+
+        len = tilemap_encode(job->map, job->stride, tx * hdr->tile, ty * hdr->tile,
+            tw, th, hdr->bits, buf);
+
+        // Reserve room at the end of the file, then write outside the lock
+        pthread_mutex_lock(&job->mutex);
+        offset = job->cursor;
+        job->cursor += len;
+        pthread_mutex_unlock(&job->mutex);
+
+        if (pwrite(job->fd, buf, len, offset) != (ssize_t)len) {
+            job->failed = errno ? errno : EIO;
+            break;
+        }
+        job->index[t].offset = offset;
+        job->index[t].size = len;
+        job->index[t].reserved = 0;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/*
+ * Writes the width x height map (cell (x, y) at map[x * stride + y]) to path
+ * with nthreads compressing tiles in parallel. Returns 0 on success, -1 with
+ * errno set on failure.
+ */
+static int tilemap_write(const char *path, const int *map, int stride,
+        int width, int height, int tile, int nthreads) {
+    tilemap_header_t hdr;
+    tilemap_job_t job;
+    pthread_t *threads;
+    size_t index_size;
+    int x, y, t, status;
+
+    memcpy(hdr.magic, TILEMAP_MAGIC, 4);
+    hdr.version = TILEMAP_VERSION;
+    hdr.width = width;
+    hdr.height = height;
+    hdr.tile = tile;
+    hdr.tiles_x = (width + tile - 1) / tile;
+    hdr.tiles_y = (height + tile - 1) / tile;
+
+    // 16 bit samples when every height fits
+    hdr.bits = 16;
+    for (x = 0; x < width && hdr.bits == 16; x++)
+        for (y = 0; y < height; y++)
+            if (map[(size_t)x * stride + y] < INT16_MIN || map[(size_t)x * stride + y] > INT16_MAX) {
+                hdr.bits = 32;
+                break;
+            }
+
+    index_size = (size_t)hdr.tiles_x * hdr.tiles_y * sizeof(tilemap_entry_t);
+
+    job.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (job.fd < 0)
+        return -1;
+    job.map = map;
+    job.stride = stride;
+    job.hdr = &hdr;
+    job.index = (tilemap_entry_t *) calloc(1, index_size);
+    job.next_tile = 0;
+    job.cursor = sizeof(hdr) + index_size;
+    job.failed = 0;
+    pthread_mutex_init(&job.mutex, NULL);
+
+    threads = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    if (!job.index || !threads) {
+        job.failed = ENOMEM;
+        nthreads = 0;
+    }
+
+    for (t = 0; t < nthreads; t++) {
+        status = pthread_create(&threads[t], NULL, tilemap_worker, &job);
+        if (status) {
+            job.failed = status;
+            break;
+        }
+    }
+    nthreads = t;
+    for (t = 0; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+
+    if (!job.failed) {
+        if (pwrite(job.fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)
+                || pwrite(job.fd, job.index, index_size, sizeof(hdr)) != (ssize_t)index_size)
+            job.failed = errno ? errno : EIO;
+    }
+
+    close(job.fd);
+    pthread_mutex_destroy(&job.mutex);
+    free(job.index);
+    free(threads);
+
+    if (job.failed) {
+        errno = job.failed;
+        return -1;
+    }
+    return 0;
+}
+
+// Reader side. The frac programs only write maps, so these are inline to
+// keep -Wall quiet about them.
+
+// Closes a file tilemap_open cannot use
+static inline int tilemap_reject(tilemap_t *tm) {
+    free(tm->index);
+    tm->index = NULL;
+    close(tm->fd);
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * Reads the header and tile index, and checks that they describe the map
+ * and that every tile lies inside the file. Returns 0 on success, -1 on
+ * failure.
+ */
+static inline int tilemap_open(tilemap_t *tm, const char *path) {
+    tilemap_header_t *h = &tm->hdr;
+    struct stat st;
+    uint64_t tiles, t;
+    size_t index_size;
+
+    tm->index = NULL;
+    tm->fd = open(path, O_RDONLY);
+    if (tm->fd < 0)
+        return -1;
+
+    if (fstat(tm->fd, &st)
+            || pread(tm->fd, h, sizeof(*h), 0) != (ssize_t)sizeof(*h)
+            || memcmp(h->magic, TILEMAP_MAGIC, 4)
+            || h->version != TILEMAP_VERSION
+            || h->tile == 0 || (h->bits != 16 && h->bits != 32)
+            || h->tiles_x != ((uint64_t)h->width + h->tile - 1) / h->tile
+            || h->tiles_y != ((uint64_t)h->height + h->tile - 1) / h->tile)
+        return tilemap_reject(tm);
+
+    tiles = (uint64_t)h->tiles_x * h->tiles_y;
+    if (tiles > ((uint64_t)st.st_size - sizeof(*h)) / sizeof(tilemap_entry_t))
+        return tilemap_reject(tm);
+    index_size = tiles * sizeof(tilemap_entry_t);
+    tm->index = (tilemap_entry_t *) malloc(index_size);
+    if (!tm->index
+            || pread(tm->fd, tm->index, index_size, sizeof(*h)) != (ssize_t)index_size)
+        return tilemap_reject(tm);
+
+    for (t = 0; t < tiles; t++)
+        if (tm->index[t].offset < sizeof(*h) + index_size
+                || tm->index[t].offset > (uint64_t)st.st_size
+                || tm->index[t].size > (uint64_t)st.st_size - tm->index[t].offset)
+            return tilemap_reject(tm);
+
+    return 0;
+}
+
+/*
+ * Decodes tile (tx, ty) into out, column by column. Edge tiles are smaller
+ * than hdr.tile; their size is returned through tw and th.
+ */
+static inline int tilemap_read_tile(tilemap_t *tm, int tx, int ty, int *out, int *tw, int *th) {
+    tilemap_entry_t *e;
+    uint8_t *buf;
+
+    if (tx < 0 || ty < 0 || tx >= (int)tm->hdr.tiles_x || ty >= (int)tm->hdr.tiles_y) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    *tw = tm->hdr.width - tx * tm->hdr.tile;
+    if (*tw > (int)tm->hdr.tile)
+        *tw = tm->hdr.tile;
+    *th = tm->hdr.height - ty * tm->hdr.tile;
+    if (*th > (int)tm->hdr.tile)
+        *th = tm->hdr.tile;
+
+    e = &tm->index[ty * tm->hdr.tiles_x + tx];
+    buf = (uint8_t *) malloc(e->size + 8);
+    if (!buf)
+        return -1;
+
+    if (pread(tm->fd, buf, e->size, e->offset) != (ssize_t)e->size) {
+        free(buf);
+        errno = EIO;
+        return -1;
+    }
+    memset(buf + e->size, 0, 8);
+
+    if (tilemap_decode(buf, e->size, *tw, *th, tm->hdr.bits, out)) {
+        free(buf);
+        errno = EINVAL;
+        return -1;
+    }
+    free(buf);
+
+    return 0;
+}
+
+static inline void tilemap_close(tilemap_t *tm) {
+    close(tm->fd);
+    free(tm->index);
+}
+
+#endif